@@ -1,6 +1,7 @@
 from pathlib import Path
 import sqlite3
 import stat
+import subprocess
 import sys
 
 
@@ -9,7 +10,7 @@ CREATE TABLE catifs(
   path TEXT NOT NULL,
   real_path TEXT,
   st_dev INT,
-  st_ino INT PRIMARY KEY,
+  st_ino INTEGER PRIMARY KEY,
   st_mode INT,
   st_nlink INT,
   st_uid INT,
@@ -34,8 +35,42 @@ CREATE TABLE catifs_attrs(
   value TEXT NOT NULL,
  PRIMARY KEY (st_ino, name)
 );
+CREATE TABLE catifs_tree(
+  path TEXT PRIMARY KEY,
+  size INT NOT NULL DEFAULT 0,
+  files INT NOT NULL DEFAULT 0,
+  dirs INT NOT NULL DEFAULT 0
+);
 """
 
+def stat_record(st):
+    """
+    Stat record of compact databases (see stat_pack in cati_fs.c): a
+    format byte followed by zigzag LEB128 varints.
+    """
+    record = bytearray([1])
+    for value in (
+        st.st_dev,
+        st.st_nlink,
+        st.st_uid,
+        st.st_gid,
+        st.st_rdev,
+        st.st_blksize,
+        st.st_blocks,
+        st.st_atime_ns // 1000000000,
+        st.st_atime_ns % 1000000000,
+        st.st_mtime_ns // 1000000000,
+        st.st_mtime_ns % 1000000000,
+        st.st_ctime_ns // 1000000000,
+        st.st_ctime_ns % 1000000000,
+    ):
+        value = (value << 1) ^ (value >> 63)
+        while value >= 0x80:
+            record.append((value & 0x7F) | 0x80)
+            value >>= 7
+        record.append(value)
+    return bytes(record)
+
 
 def size_to_string(fullSize):
     size = fullSize
@@ -69,6 +104,13 @@ with sqlite3.connect(sqlite_file) as database:
     if create_schema:
         database.executescript(schema)
     cursor = database.cursor()
+    columns = [row[1] for row in database.execute("PRAGMA table_info(catifs)")]
+    compact = "stat" in columns
+    # Change feed of databases already opened by cati_fs (see change_log
+    # in cati_fs.c), op 1 is an addition
+    log_changes = database.execute(
+        "SELECT 1 FROM sqlite_master WHERE name = 'catifs_changes'"
+    ).fetchone()
     count = 0
     dir_count = 0
     link_count = 0
@@ -82,34 +124,52 @@ with sqlite3.connect(sqlite_file) as database:
             is_dir = stat.S_ISDIR(st.st_mode)
             is_link = stat.S_ISLNK(st.st_mode)
 
-            cursor.execute(
-                "INSERT INTO catifs (path, real_path, st_dev, st_mode, "
-                "st_nlink, st_uid, st_gid, st_rdev, st_size, st_blksize, "
-                "st_blocks, st_atim_sec, st_atim_nsec, st_mtim_sec, st_mtim_nsec, "
-                "st_ctim_sec, st_ctim_nsec, is_dir, is_link) "
-                "VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?);",
-                [
-                    path,
-                    str(real_path),
-                    st.st_dev,
-                    st.st_mode,
-                    st.st_nlink,
-                    st.st_uid,
-                    st.st_gid,
-                    st.st_rdev,
-                    st.st_size,
-                    st.st_blksize,
-                    st.st_blocks,
-                    st.st_atime,
-                    st.st_atime_ns,
-                    st.st_mtime,
-                    st.st_mtime_ns,
-                    st.st_ctime,
-                    st.st_ctime_ns,
-                    is_dir,
-                    is_link,
-                ],
-            )
+            if compact:
+                cursor.execute(
+                    "INSERT INTO catifs (path, real_path, st_mode, st_size, stat) "
+                    "VALUES (?,?,?,?,?);",
+                    [path, str(real_path), st.st_mode, st.st_size, stat_record(st)],
+                )
+                if "is_dir" in columns:
+                    cursor.execute(
+                        "UPDATE catifs SET is_dir=?, is_link=? WHERE rowid=?;",
+                        [is_dir, is_link, cursor.lastrowid],
+                    )
+            else:
+                cursor.execute(
+                    "INSERT INTO catifs (path, real_path, st_dev, st_mode, "
+                    "st_nlink, st_uid, st_gid, st_rdev, st_size, st_blksize, "
+                    "st_blocks, st_atim_sec, st_atim_nsec, st_mtim_sec, st_mtim_nsec, "
+                    "st_ctim_sec, st_ctim_nsec, is_dir, is_link) "
+                    "VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?);",
+                    [
+                        path,
+                        str(real_path),
+                        st.st_dev,
+                        st.st_mode,
+                        st.st_nlink,
+                        st.st_uid,
+                        st.st_gid,
+                        st.st_rdev,
+                        st.st_size,
+                        st.st_blksize,
+                        st.st_blocks,
+                        st.st_atime_ns // 1000000000,
+                        st.st_atime_ns % 1000000000,
+                        st.st_mtime_ns // 1000000000,
+                        st.st_mtime_ns % 1000000000,
+                        st.st_ctime_ns // 1000000000,
+                        st.st_ctime_ns % 1000000000,
+                        is_dir,
+                        is_link,
+                    ],
+                )
+            if log_changes:
+                cursor.execute(
+                    "INSERT INTO catifs_changes (time, op, path) "
+                    "VALUES (strftime('%s', 'now'), 1, ?);",
+                    [path],
+                )
             count += 1
             if is_dir:
                 dir_count += 1
@@ -124,3 +184,10 @@ with sqlite3.connect(sqlite_file) as database:
                     f"Stored {dir_count} directories, {file_count} files and {link_count} symlinks [{size_to_string(size_count)}]"
                 )
                 print(f"{count}: {path}")
+    database.commit()
+database.close()
+
+# Recompute recursive size, file count and directory count of every
+# directory (catifs_tree) with the cati_fs program next to this script
+cati_fs = Path(__file__).resolve().parent / "cati_fs"
+subprocess.run([str(cati_fs), "aggregate", sqlite_file], check=True)
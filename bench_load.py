@@ -0,0 +1,266 @@
+"""
+End-to-end load of a live cati_fs mount. A test tree is created in a
+temporary directory, imported with add_dir_to_db.py (Python >= 3.12),
+mounted with cati_fs and driven by N concurrent processes running a mix
+of operations for a few seconds, for each N. Throughput and latency
+percentiles are printed and written in bench_load.json next to cati_fs.
+
+    python3 bench_load.py [--mix stat,list,...] [--concurrency 1,2,4,8] [--duration 5]
+
+Mixes:
+    stat        os.stat of random files and directories
+    list        recursive listing (os.walk) of a random top level directory
+    header      open, read of the first 4 KiB and close of random small files
+    sequential  read of a whole large file by 1 MiB blocks
+    rename      rename of a file of the process and back
+    chmod       chmod -R of a random top level directory
+    mixed       all of the above except sequential, stat being the most frequent
+"""
+from __future__ import print_function
+
+import argparse
+from multiprocessing import Pool
+from tempfile import mkdtemp
+import json
+import os
+import random
+import shutil
+from subprocess import check_call, Popen
+import time
+import sys
+
+osp = os.path
+
+HEADER_SIZE = 4096
+BLOCK_SIZE = 1024 * 1024
+MIXED = [('stat', 60), ('header', 20), ('list', 5), ('rename', 10), ('chmod', 5)]
+
+
+def create_tree(backing, files, top_dirs, large_files, large_size, workers):
+    """
+    tree/dI/dJ/fK small files (stat, list, header, chmod), large/bigI
+    (sequential) and rename/wI/fJ files renamed by worker I only.
+    """
+    header = os.urandom(HEADER_SIZE * 4)
+    per_dir = max(1, files // (top_dirs * 10))
+    count = 0
+    for i in range(top_dirs):
+        for j in range(10):
+            directory = osp.join(backing, 'tree', 'd%d' % i, 'd%d' % j)
+            os.makedirs(directory)
+            for k in range(per_dir):
+                with open(osp.join(directory, 'f%d' % k), 'wb') as f:
+                    f.write(header)
+                count += 1
+    os.makedirs(osp.join(backing, 'large'))
+    block = os.urandom(BLOCK_SIZE)
+    for i in range(large_files):
+        with open(osp.join(backing, 'large', 'big%d' % i), 'wb') as f:
+            for _ in range(large_size // BLOCK_SIZE):
+                f.write(block)
+    for i in range(workers):
+        directory = osp.join(backing, 'rename', 'w%d' % i)
+        os.makedirs(directory)
+        for j in range(10):
+            open(osp.join(directory, 'f%d' % j), 'wb').close()
+    return count
+
+
+def tree_entries(mountpoint):
+    files, dirs = [], []
+    for root, dirnames, filenames in os.walk(osp.join(mountpoint, 'tree')):
+        dirs.extend(osp.join(root, i) for i in dirnames)
+        files.extend(osp.join(root, i) for i in filenames)
+    return files, dirs
+
+
+def run_op(op, worker, rng, context):
+    """Run one operation, return the number of bytes read."""
+    mountpoint = context['mountpoint']
+    if op == 'stat':
+        if rng.random() < 0.8:
+            os.stat(rng.choice(context['files']))
+        else:
+            os.stat(rng.choice(context['dirs']))
+    elif op == 'list':
+        for _ in os.walk(osp.join(mountpoint, 'tree', 'd%d' % rng.randrange(context['top_dirs']))):
+            pass
+    elif op == 'header':
+        with open(rng.choice(context['files']), 'rb') as f:
+            return len(f.read(HEADER_SIZE))
+    elif op == 'sequential':
+        size = 0
+        path = osp.join(mountpoint, 'large', 'big%d' % rng.randrange(context['large_files']))
+        with open(path, 'rb', buffering=0) as f:
+            while True:
+                block = f.read(BLOCK_SIZE)
+                if not block:
+                    return size
+                size += len(block)
+    elif op == 'rename':
+        path = osp.join(mountpoint, 'rename', 'w%d' % worker, 'f%d' % rng.randrange(10))
+        os.rename(path, path + '.renamed')
+        os.rename(path + '.renamed', path)
+    elif op == 'chmod':
+        mode = rng.choice((0o644, 0o664))
+        top = osp.join(mountpoint, 'tree', 'd%d' % rng.randrange(context['top_dirs']))
+        for root, dirnames, filenames in os.walk(top):
+            for name in filenames:
+                os.chmod(osp.join(root, name), mode)
+    return 0
+
+
+def worker(args):
+    """
+    Run operations of a mix from start until stop (time.time() values),
+    return the latencies (seconds) of each operation, bytes read and
+    errors.
+    """
+    mix, index, start, stop, context = args
+    rng = random.Random(index)
+    if mix == 'mixed':
+        ops = [op for op, weight in MIXED for _ in range(weight)]
+    else:
+        ops = [mix]
+    latencies = {}
+    size = 0
+    errors = 0
+    time.sleep(max(0, start - time.time()))
+    while time.time() < stop:
+        op = rng.choice(ops)
+        begin = time.time()
+        try:
+            size += run_op(op, index, rng, context)
+        except OSError:
+            errors += 1
+        latencies.setdefault(op, []).append(time.time() - begin)
+    return latencies, size, errors
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def bench(mix, concurrency, duration, context):
+    pool = Pool(concurrency)
+    try:
+        start = time.time() + 0.5
+        results = pool.map(worker, [(mix, i, start, start + duration, context)
+                                    for i in range(concurrency)])
+    finally:
+        pool.close()
+        pool.join()
+    elapsed = max(duration, time.time() - start)
+    latencies = {}
+    size = 0
+    errors = 0
+    for result, result_size, result_errors in results:
+        for op, values in result.items():
+            latencies.setdefault(op, []).extend(values)
+        size += result_size
+        errors += result_errors
+    all_latencies = sorted(v for values in latencies.values() for v in values)
+    report = {
+        'ops': len(all_latencies),
+        'ops_per_sec': len(all_latencies) / elapsed,
+        'mib_per_sec': size / elapsed / 1048576,
+        'errors': errors,
+        'operations': {},
+    }
+    for op, values in [('all', all_latencies)] + sorted(latencies.items()):
+        values.sort()
+        if not values:
+            continue
+        stats = {
+            'ops': len(values),
+            'p50_ms': percentile(values, 50) * 1000,
+            'p90_ms': percentile(values, 90) * 1000,
+            'p99_ms': percentile(values, 99) * 1000,
+            'max_ms': values[-1] * 1000,
+        }
+        if op == 'all':
+            report.update(stats)
+        else:
+            report['operations'][op] = stats
+    return report
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Load a live cati_fs mount from concurrent processes')
+    parser.add_argument('--mix', default='stat,list,header,sequential,rename,chmod,mixed',
+                        help='comma separated mixes (default: all)')
+    parser.add_argument('--concurrency', default='1,2,4,8,16',
+                        help='comma separated numbers of processes (default: 1,2,4,8,16)')
+    parser.add_argument('--duration', type=float, default=5, help='seconds per run (default: 5)')
+    parser.add_argument('--files', type=int, default=20000, help='small files (default: 20000)')
+    parser.add_argument('--large-files', type=int, default=4, help='large files (default: 4)')
+    parser.add_argument('--large-size', type=int, default=64, help='size of large files in MiB (default: 64)')
+    parser.add_argument('--mount-option', action='append', default=[],
+                        help='option given to cati_fs mount (e.g. --mount-option=-p --mount-option=0)')
+    options = parser.parse_args()
+    mixes = options.mix.split(',')
+    levels = [int(i) for i in options.concurrency.split(',')]
+
+    cati_fs = osp.realpath(osp.join(osp.dirname(sys.argv[0]), 'cati_fs'))
+    add_dir_to_db = osp.join(osp.dirname(cati_fs), 'add_dir_to_db.py')
+    tmp = mkdtemp(prefix='cati_fs_load')
+    try:
+        mountpoint = osp.join(tmp, 'cati_fs')
+        os.mkdir(mountpoint)
+        backing = osp.join(tmp, 'backing')
+        top_dirs = max(1, options.files // 1000)
+        count = create_tree(backing, options.files, top_dirs, options.large_files,
+                            options.large_size * 1024 * 1024, max(levels))
+        db = osp.join(tmp, 'cati_fs.sqlite')
+        check_call([sys.executable, add_dir_to_db, db, backing], stdout=open(os.devnull, 'w'))
+        mount = Popen([cati_fs, 'mount'] + options.mount_option + [db, mountpoint],
+                      stderr=open(os.devnull, 'w'))
+        try:
+            for _ in range(50):
+                if osp.ismount(mountpoint) or mount.poll() is not None:
+                    break
+                time.sleep(0.1)
+            if not osp.ismount(mountpoint):
+                print('ERROR: while mounting cati_fs', file=sys.stderr)
+                return 1
+            files, dirs = tree_entries(mountpoint)
+            context = {
+                'mountpoint': mountpoint,
+                'files': files,
+                'dirs': dirs,
+                'top_dirs': top_dirs,
+                'large_files': options.large_files,
+            }
+            print('%d small files in %d directories, %d large files of %d MiB' %
+                  (count, len(dirs), options.large_files, options.large_size))
+            print('%-10s %5s %10s %9s %9s %9s %9s %7s' %
+                  ('mix', 'procs', 'ops/s', 'MiB/s', 'p50 ms', 'p99 ms', 'max ms', 'errors'))
+            results = {}
+            for mix in mixes:
+                for concurrency in levels:
+                    report = bench(mix, concurrency, options.duration, context)
+                    results.setdefault(mix, {})[str(concurrency)] = report
+                    print('%-10s %5d %10.1f %9.1f %9.3f %9.3f %9.3f %7d' %
+                          (mix, concurrency, report['ops_per_sec'], report['mib_per_sec'],
+                           report.get('p50_ms', 0), report.get('p99_ms', 0),
+                           report.get('max_ms', 0), report['errors']))
+                    sys.stdout.flush()
+        finally:
+            check_call(['fusermount', '-u', mountpoint])
+            mount.wait()
+        with open(osp.join(osp.dirname(cati_fs), 'bench_load.json'), 'w') as f:
+            json.dump({
+                'files': count,
+                'large_files': options.large_files,
+                'large_size_mib': options.large_size,
+                'duration': options.duration,
+                'mount_options': options.mount_option,
+                'results': results,
+            }, f, indent=2)
+    finally:
+        shutil.rmtree(tmp)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,93 @@
+from __future__ import print_function
+
+from tempfile import mkdtemp
+import os
+import shutil
+from subprocess import check_call, Popen
+import time
+import sys
+
+osp = os.path
+
+# Size of the backing file and latency (microseconds) added by cati_fs
+# to every read of a backing file to emulate network storage.
+FILE_SIZE = 256 * 1024 * 1024
+LATENCY = 2000
+
+# (name, bytes per read, distance between two reads)
+PATTERNS = [
+    ('sequential 128K', 128 * 1024, 128 * 1024),
+    ('sequential 1M', 1024 * 1024, 1024 * 1024),
+    ('strided 128K every 1M', 128 * 1024, 1024 * 1024),
+    ('strided 4K every 64K', 4096, 64 * 1024),
+]
+
+
+def read_pattern(path, size, stride):
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        total = 0
+        start = time.time()
+        for offset in range(0, FILE_SIZE, stride):
+            total += len(os.pread(fd, size, offset))
+        return total / (time.time() - start)
+    finally:
+        os.close(fd)
+
+
+def bench(cati_fs, db, mountpoint, options):
+    mount = Popen([cati_fs, 'mount', '-l', str(LATENCY)] + options + [db, mountpoint],
+                  stderr=open(os.devnull, 'w'))
+    try:
+        time.sleep(1)
+        if mount.poll() is not None:
+            raise RuntimeError('cannot mount cati_fs')
+        results = []
+        for name, size, stride in PATTERNS:
+            # Each pattern reads its own file, not pages cached by the previous one
+            path = osp.join(mountpoint, 'data_%d_%d' % (size, stride))
+            results.append((name, read_pattern(path, size, stride)))
+        return results
+    finally:
+        check_call(['fusermount', '-u', mountpoint])
+        mount.wait()
+
+
+def main():
+    cati_fs = osp.realpath(osp.join(osp.dirname(sys.argv[0]), 'cati_fs'))
+    tmp = mkdtemp(prefix='cati_fs_bench')
+    try:
+        mountpoint = osp.join(tmp, 'cati_fs')
+        os.mkdir(mountpoint)
+        backing = osp.join(tmp, 'backing')
+        os.mkdir(backing)
+        data = os.urandom(1024 * 1024)
+        for _, size, stride in PATTERNS:
+            name = 'data_%d_%d' % (size, stride)
+            with open(osp.join(backing, name), 'wb') as f:
+                for i in range(FILE_SIZE // len(data)):
+                    f.write(data)
+        cache = osp.join(tmp, 'cache')
+        output = []
+        for label, options in (('no readahead', ['-p', '0']),
+                               ('readahead', []),
+                               ('cache (cold)', ['-p', '0', '-C', cache, '-S', '4096']),
+                               ('cache (warm)', ['-p', '0', '-C', cache, '-S', '4096'])):
+            db = osp.join(tmp, 'cati_fs_%d.sqlite' % len(output))
+            for _, size, stride in PATTERNS:
+                name = 'data_%d_%d' % (size, stride)
+                check_call([cati_fs, '-c', 'add', db, osp.join(backing, name), '/' + name])
+            for name, rate in bench(cati_fs, db, mountpoint, options):
+                line = '%-14s %-24s %8.1f MiB/s' % (label, name, rate / 1048576)
+                print(line)
+                output.append(line)
+        with open(osp.join(osp.dirname(cati_fs), 'bench_output.txt'), 'w') as f:
+            f.write('latency %d us\n' % LATENCY)
+            f.write('\n'.join(output) + '\n')
+    finally:
+        shutil.rmtree(tmp)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
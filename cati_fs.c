@@ -50,12 +50,20 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
-#ifdef HAVE_SETXATTR
+#include <sys/statvfs.h>
 #include <sys/xattr.h>
-#endif
 #include <sys/file.h> /* flock(2) */
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <sqlite3.h>
+#include <zstd.h>
+
+#include "cati_fs_ioctl.h"
 
 
 static const char schema[] =
@@ -63,7 +71,7 @@ static const char schema[] =
   "  path TEXT NOT NULL,\n"
   "  real_path TEXT,\n"
   "  st_dev INT,\n"
-  "  st_ino INT PRIMARY KEY,\n"
+  "  st_ino INTEGER PRIMARY KEY,\n"
   "  st_mode INT,\n"
   "  st_nlink INT,\n"
   "  st_uid INT,\n"
@@ -87,166 +95,466 @@ static const char schema[] =
   " PRIMARY KEY (st_ino, name)\n"
   ");";
 
+/*
+ * catifs_tree holds, for each directory ("/" for the root), the total
+ * size and the number of files and directories below it. The parent of
+ * a path p is rtrim(rtrim(p, <non '/' characters of p>), '/'), with ''
+ * for the root. Attributes in catifs_attrs are linked to catifs rows
+ * by st_ino, an alias of the rowid (see upgrade_st_ino()).
+ */
+#define PARENT(p) "rtrim(rtrim(" p ", replace(" p ", '/', '')), '/')"
 
-static void *catifs_init(struct fuse_conn_info *conn,
-		         struct fuse_config *cfg)
+/*
+ * Children of a directory are listed from an index on their parent, a
+ * listing seeks to (parent, last name) instead of scanning every path
+ * below the directory.
+ */
+static const char parent_schema[] =
+  "CREATE INDEX IF NOT EXISTS idx_catifs_parent ON catifs (" PARENT("path") ", path);";
+
+static const char tree_schema[] =
+  "CREATE TABLE catifs_tree(\n"
+  "  path TEXT PRIMARY KEY,\n"
+  "  size INT NOT NULL DEFAULT 0,\n"
+  "  files INT NOT NULL DEFAULT 0,\n"
+  "  dirs INT NOT NULL DEFAULT 0\n"
+  ");";
+
+/*
+ * real_path is either absolute (volume is NULL) or relative to the
+ * prefix of a volume. Moving a volume to new storage only updates its
+ * prefix. Prefixes end with '/'.
+ */
+static const char volumes_schema[] =
+  "CREATE TABLE catifs_volumes(\n"
+  "  id INTEGER PRIMARY KEY,\n"
+  "  prefix TEXT NOT NULL UNIQUE\n"
+  ");\n"
+  "ALTER TABLE catifs ADD COLUMN volume INT REFERENCES catifs_volumes (id);";
+
+#define VOLUME_MATCH(p) \
+    "FROM catifs_volumes WHERE substr(" p ", 1, length(prefix)) = prefix " \
+    "ORDER BY length(prefix) DESC LIMIT 1"
+/* Volume of absolute path p */
+#define VOLUME_OF(p) "(SELECT id " VOLUME_MATCH(p) ")"
+/* Path p relative to its volume (or p if it is on no volume) */
+#define VOLUME_RELATIVE(p) \
+    "substr(" p ", 1 + coalesce((SELECT length(prefix) " VOLUME_MATCH(p) "), 0))"
+
+/*
+ * Optional columns added by "cati_fs hash". Rows pointing to the same
+ * backing file after "cati_fs dedup" keep their own former real path
+ * (absolute) in dedup_origin, the file is copied back there before
+ * being opened for writing.
+ */
+static const char hash_schema[] =
+  "ALTER TABLE catifs ADD COLUMN content_hash INT;\n"
+  "ALTER TABLE catifs ADD COLUMN dedup_origin TEXT;\n"
+  "CREATE INDEX idx_catifs_hash ON catifs (content_hash, st_size) "
+  "WHERE content_hash IS NOT NULL;";
+
+/*
+ * Format of the backing file, see seekable_open().
+ */
+static const char compression_schema[] =
+  "ALTER TABLE catifs ADD COLUMN compression INT;";
+
+/*
+ * Target of the symbolic links created in the mount (see
+ * catifs_symlink()). Symbolic links imported by add_dir_to_db.py
+ * (is_link) have no target here, their real_path is the link itself on
+ * the backing storage.
+ */
+static const char links_schema[] =
+  "ALTER TABLE catifs ADD COLUMN link_target TEXT;";
+
+/*
+ * Change feed: every modification of the catalogue appends a row in the
+ * same savepoint. seq is never reused (AUTOINCREMENT) even after old
+ * rows are pruned, so a consumer only has to remember the last seq it
+ * processed. target is the new path of a rename or an attribute name.
+ */
+static const char changes_schema[] =
+  "CREATE TABLE catifs_changes(\n"
+  "  seq INTEGER PRIMARY KEY AUTOINCREMENT,\n"
+  "  time INT NOT NULL,\n"
+  "  op INT NOT NULL,\n"
+  "  path TEXT NOT NULL,\n"
+  "  target TEXT\n"
+  ");";
+
+enum {
+    CHANGE_ADD = 1, CHANGE_REMOVE, CHANGE_RENAME, CHANGE_MODE, CHANGE_OWNER,
+    CHANGE_TIMES, CHANGE_WRITE, CHANGE_SET_ATTR, CHANGE_REMOVE_ATTR,
+};
+
+static const char *change_names[] = {
+    NULL, "add", "remove", "rename", "chmod", "chown",
+    "utimens", "write", "setxattr", "removexattr",
+};
+
+/*
+ * Snapshots. Rows of catifs and catifs_attrs hold the generation in
+ * which they were written. "cati_fs snapshot" records the current
+ * generation under a name and starts the next one, without copying
+ * anything. Once there are snapshots, triggers (see snapshot_schema())
+ * save the previous version of a row seen by a snapshot in
+ * catifs_history (catifs_attrs_history) when it is modified or removed.
+ * The snapshot of generation g sees the rows of generation <= g and the
+ * saved versions of generation <= g < died, unchanged rows are shared
+ * with the live catalogue.
+ */
+static const char snapshots_schema[] =
+  "CREATE TABLE catifs_snapshots(\n"
+  "  name TEXT PRIMARY KEY,\n"
+  "  generation INT NOT NULL UNIQUE,\n"
+  "  time INT NOT NULL\n"
+  ");\n"
+  "ALTER TABLE catifs ADD COLUMN generation INT NOT NULL DEFAULT 0;\n"
+  "ALTER TABLE catifs_attrs ADD COLUMN generation INT NOT NULL DEFAULT 0;\n"
+  "CREATE TABLE catifs_history AS\n"
+  "  SELECT rowid AS row_id, *, 0 AS died FROM catifs WHERE 0;\n"
+  "CREATE INDEX idx_catifs_history_path ON catifs_history (path);\n"
+  "CREATE TABLE catifs_attrs_history AS\n"
+  "  SELECT *, 0 AS died FROM catifs_attrs WHERE 0;\n"
+  "CREATE INDEX idx_catifs_attrs_history ON catifs_attrs_history (st_ino, name);";
+
+/*
+ * Recursive aggregates (as catifs_tree) of the generation of each
+ * snapshot that was mounted, see snapshot_tree().
+ */
+static const char snapshots_tree_schema[] =
+  "CREATE TABLE IF NOT EXISTS main.catifs_snapshots_tree(\n"
+  "  generation INT NOT NULL,\n"
+  "  path TEXT NOT NULL,\n"
+  "  size INT NOT NULL,\n"
+  "  files INT NOT NULL,\n"
+  "  dirs INT NOT NULL,\n"
+  "  PRIMARY KEY (generation, path)\n"
+  ") WITHOUT ROWID;";
+
+/* Generation of the last snapshot, generation of new rows */
+#define SNAPSHOT_LAST "(SELECT max(generation) FROM catifs_snapshots)"
+#define SNAPSHOT_NEXT "(SELECT max(generation) + 1 FROM catifs_snapshots)"
+
+static const char tree_rebuild[] =
+  "DELETE FROM catifs_tree;\n"
+  "WITH RECURSIVE up(dir, size, files, dirs) AS (\n"
+  "  SELECT " PARENT("path") ",\n"
+  "         CASE WHEN st_mode & 61440 = 16384 THEN 0 ELSE st_size END,\n"
+  "         st_mode & 61440 != 16384, st_mode & 61440 = 16384\n"
+  "  FROM catifs\n"
+  "  UNION ALL\n"
+  "  SELECT " PARENT("dir") ", size, files, dirs FROM up WHERE dir != ''\n"
+  ")\n"
+  "INSERT INTO catifs_tree (path, size, files, dirs)\n"
+  "  SELECT CASE dir WHEN '' THEN '/' ELSE dir END, sum(size), sum(files), sum(dirs)\n"
+  "  FROM up GROUP BY dir;";
+
+
+/*
+ * Bloom filter over every path of the catalogue. Applications probe
+ * many names that do not exist (Python imports, PATH lookups, etc.),
+ * the filter answers most of these lookups without querying SQLite.
+ * Paths are only ever added: removed or renamed paths stay in the
+ * filter as false positives until the next rebuild.
+ */
+#define BLOOM_BITS_PER_PATH 10
+#define BLOOM_HASHES 7
+#define BLOOM_MIN_BITS (1 << 16)
+
+struct bloom {
+    uint64_t *bits;
+    uint64_t mask;            /* number of bits - 1 (power of two) */
+    uint64_t count;           /* paths inserted since last build */
+    uint64_t capacity;        /* rebuild when count exceeds this */
+    uint64_t negatives;       /* lookups answered by the filter */
+    uint64_t false_positives; /* lookups let through but not found */
+    sqlite3_stmt *data_version;
+    int version;
+};
+
+/*
+ * State of one catalogue database.
+ */
+struct catifs {
+    sqlite3 *db;
+    int compact;        /* stat fields stored in a BLOB (see stat_pack()) */
+    int hashing;        /* content_hash column exists (see hash_schema) */
+    struct bloom bloom;
+};
+
+/*
+ * A mount is the union of several catalogue databases (shards). The
+ * paths of a shard mounted below a prefix are relative to the prefix,
+ * shards without prefix are merged at the root.
+ */
+struct catifs_shard {
+    char *prefix;       /* "" if merged at the root, no trailing '/' */
+    size_t prefix_len;
+    struct catifs fs;
+    int control;        /* listening control socket or -1 (see control_start()) */
+    char *control_path;
+};
+
+/*
+ * File system state given to FUSE as private_data.
+ */
+struct catifs_mount {
+    int count;
+    struct catifs_shard *shards;
+    struct fuse *fuse;
+    pthread_t control;  /* thread serving the control sockets */
+    int control_running;
+    int control_pipe[2];
+    struct prefetch_pool *prefetch; /* readahead threads, NULL if disabled */
+    struct read_cache *cache;       /* local copies of backing files, NULL if disabled */
+    unsigned latency;               /* added to backing reads (microseconds) */
+};
+
+
+static inline struct catifs_mount *get_mount(void)
 {
-    (void) conn;
+    return (struct catifs_mount *) fuse_get_context()->private_data;
+}
 
-    /* Pick up changes from lower filesystem right away. This is
-        also necessary for better hardlink support. When the kernel
-        calls the unlink() handler, it does not know the inode of
-        the to-be-removed entry and can therefore not invalidate
-        the cache of the associated inode - resulting in an
-        incorrect st_nlink value being reported for any remaining
-        hardlinks to this inode. */
-    cfg->entry_timeout = 0;
-    cfg->attr_timeout = 0;
-    cfg->negative_timeout = 0;
 
-    return fuse_get_context()->private_data;
+static void bloom_hash(const char *path, uint64_t *h1, uint64_t *h2)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    /* FNV-1a followed by a splitmix64 finalizer */
+    for( ; *path; ++path ) {
+        h ^= (unsigned char) *path;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    *h1 = h;
+    *h2 = (h >> 32) | (h << 32) | 1;
 }
 
-static void catifs_destroy(void *private_data)
+static void bloom_add(struct bloom *bloom, const char *path)
 {
-#ifdef debug
-    fpfrinf(stderr, "Closing database\n");
-#endif
-    sqlite3_close(private_data);
+    uint64_t h1, h2;
+    int i;
+
+    if( ! bloom->bits ) return;
+    bloom_hash(path, &h1, &h2);
+    for( i=0; i<BLOOM_HASHES; i++ ) {
+        uint64_t bit = (h1 + i * h2) & bloom->mask;
+        bloom->bits[bit >> 6] |= 1ULL << (bit & 63);
+    }
+    ++bloom->count;
 }
 
-static int cati_getattr(const char *path, struct stat *buf,
-			struct fuse_file_info *fi)
+static int bloom_test(const struct bloom *bloom, const char *path)
 {
-    (void) fi;
-    int result;
-    sqlite3_stmt *query = 0;
-    int rc;
-    sqlite3 *db;
-    const char * sql;
-    
-    memset(buf, 0, sizeof(*buf));
-    if( strcmp(path, "/")==0 ){
-        buf->st_mode = S_IFDIR | 0755;
-        buf->st_nlink = 2;
-        return 0;
+    uint64_t h1, h2;
+    int i;
+
+    bloom_hash(path, &h1, &h2);
+    for( i=0; i<BLOOM_HASHES; i++ ) {
+        uint64_t bit = (h1 + i * h2) & bloom->mask;
+        if( ! (bloom->bits[bit >> 6] & (1ULL << (bit & 63))) )
+            return 0;
     }
-    sql = "SELECT st_dev, st_ino, st_mode, st_nlink, st_uid, st_gid, "
-            "st_rdev, st_size, st_blksize, st_blocks, st_atim_sec, "
-            "st_atim_nsec, st_mtim_sec, st_mtim_nsec, st_ctim_sec, "
-            "st_ctim_nsec FROM catifs WHERE path=?";
-    db = fuse_get_context()->private_data;
-    rc = sqlite3_prepare_v2(db,
-            sql,
-            -1, &query, 0);
-    if( rc != SQLITE_OK ) {
+    return 1;
+}
+
 #ifdef DEBUG
-        fprintf(stderr, "getattr cannot prepare SQL query: %s\n", sqlite3_errmsg(db));
+/*
+ * Expected false positive rate of the filter once it holds its full
+ * capacity: (1 - e^(-k.n/m))^k
+ */
+static double bloom_fp_rate(const struct bloom *bloom)
+{
+    double m = (double) bloom->mask + 1;
+    return pow(1 - exp(-BLOOM_HASHES * (double) bloom->capacity / m),
+               BLOOM_HASHES);
+}
 #endif
-        return -ENOENT;
-    }
-    
-    rc = sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+
+/*
+ * Read the database version seen by this connection. It changes when
+ * another connection (e.g. "cati_fs add" or add_dir_to_db.py) commits.
+ */
+static int bloom_data_version(sqlite3 *db, struct bloom *bloom)
+{
+    int version = -1;
+
+    if( ! bloom->data_version &&
+        sqlite3_prepare_v2(db, "PRAGMA data_version", -1,
+                           &bloom->data_version, 0) != SQLITE_OK )
+        return -1;
+    if( sqlite3_step(bloom->data_version) == SQLITE_ROW )
+        version = sqlite3_column_int(bloom->data_version, 0);
+    sqlite3_reset(bloom->data_version);
+    return version;
+}
+
+/*
+ * (Re)build the filter from all the paths of the database. On error
+ * the filter is disabled and every lookup goes to SQLite.
+ */
+static int bloom_build(struct catifs *fs)
+{
+    struct bloom *bloom = &fs->bloom;
+    sqlite3_stmt *query;
+    uint64_t count = 0;
+    uint64_t nbits;
+    int rc;
+
+    free(bloom->bits);
+    bloom->bits = NULL;
+    bloom->version = bloom_data_version(fs->db, bloom);
+    rc = sqlite3_prepare_v2(fs->db, "SELECT count(*) FROM catifs", -1, &query, 0);
+    if( rc != SQLITE_OK ) return -EIO;
+    if( sqlite3_step(query) == SQLITE_ROW )
+        count = sqlite3_column_int64(query, 0);
+    sqlite3_finalize(query);
+
+    /* Keep room for the catalogue to double before the next rebuild */
+    bloom->capacity = 2 * count;
+    for( nbits = BLOOM_MIN_BITS; nbits < bloom->capacity * BLOOM_BITS_PER_PATH; nbits <<= 1 );
+    if( bloom->capacity < nbits / BLOOM_BITS_PER_PATH )
+        bloom->capacity = nbits / BLOOM_BITS_PER_PATH;
+    bloom->bits = calloc(nbits / 64, sizeof(uint64_t));
+    if( ! bloom->bits ) return -ENOMEM;
+    bloom->mask = nbits - 1;
+    bloom->count = 0;
+
+    rc = sqlite3_prepare_v2(fs->db, "SELECT path FROM catifs", -1, &query, 0);
     if( rc != SQLITE_OK ) {
-#ifdef DEBUG
-        fprintf(stderr, "getattr cannot bind path in SQL query: %s\n", sqlite3_errmsg(db));
-#endif
-        return -ENOENT;
+        free(bloom->bits);
+        bloom->bits = NULL;
+        return -EIO;
+    }
+    while( (rc = sqlite3_step(query)) == SQLITE_ROW )
+        bloom_add(bloom, (const char *) sqlite3_column_text(query, 0));
+    sqlite3_finalize(query);
+    if( rc != SQLITE_DONE ) {
+        free(bloom->bits);
+        bloom->bits = NULL;
+        return -EIO;
     }
-    rc = sqlite3_step(query);
-    if(  rc == SQLITE_ROW ) {
-        buf->st_dev = sqlite3_column_int(query, 0);
-        buf->st_ino = sqlite3_column_int(query, 1);
-        buf->st_mode = sqlite3_column_int(query, 2);
-        buf->st_nlink = sqlite3_column_int(query, 3);
-        buf->st_uid = sqlite3_column_int(query, 4);
-        buf->st_gid = sqlite3_column_int(query, 5);
-        buf->st_rdev = sqlite3_column_int(query, 6);
-        buf->st_size = sqlite3_column_int(query, 7);
-        buf->st_blksize = sqlite3_column_int(query, 8);
-        buf->st_blocks = sqlite3_column_int(query, 9);
-        buf->st_atim.tv_sec = sqlite3_column_int(query, 10);
-        buf->st_atim.tv_nsec = sqlite3_column_int(query, 11);
-        buf->st_mtim.tv_sec = sqlite3_column_int(query, 12);
-        buf->st_mtim.tv_nsec = sqlite3_column_int(query, 13);
-        buf->st_ctim.tv_sec = sqlite3_column_int(query, 14);
-        buf->st_ctim.tv_nsec = sqlite3_column_int(query, 15);
-        result = 0;
-    } else {
 #ifdef DEBUG
-        fprintf(stderr, "getattr SQL query failed: (%d) %s\n", rc, sqlite3_errmsg(db));
+    fprintf(stderr, "Negative lookup filter: %llu paths, %llu KiB, "
+            "expected false positive rate %.3f%%\n",
+            (unsigned long long) bloom->count,
+            (unsigned long long) (nbits / 8 / 1024),
+            100 * bloom_fp_rate(bloom));
 #endif
-        result = -ENOENT;
+    return 0;
+}
+
+/*
+ * Add a path created by this process to the filter.
+ */
+static void bloom_insert(struct catifs *fs, const char *path)
+{
+    sqlite3_mutex_enter(sqlite3_db_mutex(fs->db));
+    if( ! fs->bloom.bits ) {
+        /* no filter */
+    } else if( fs->bloom.count >= fs->bloom.capacity ) {
+        bloom_build(fs);
+    } else {
+        bloom_add(&fs->bloom, path);
     }
-    rc = sqlite3_finalize(query);
-#ifdef DEBUG
-    if( rc != SQLITE_OK ) {
-        fprintf(stderr, "getattr cannot finalize SQL query: %s\n", sqlite3_errmsg(db));
+    sqlite3_mutex_leave(sqlite3_db_mutex(fs->db));
+}
+
+/*
+ * Return 0 if path is certainly not in the catalogue. Before giving a
+ * negative answer, check that no other connection modified the
+ * database since the filter was built. The filter is shared with the
+ * control socket thread and protected by the mutex of the connection.
+ */
+static int bloom_may_contain(struct catifs *fs, const char *path)
+{
+    struct bloom *bloom = &fs->bloom;
+    int result = 1;
+
+    sqlite3_mutex_enter(sqlite3_db_mutex(fs->db));
+    if( bloom->bits && ! bloom_test(bloom, path) ) {
+        if( bloom_data_version(fs->db, bloom) == bloom->version ||
+            (bloom_build(fs) == 0 && ! bloom_test(bloom, path)) ) {
+            ++bloom->negatives;
+            result = 0;
+        }
     }
-#endif
+    sqlite3_mutex_leave(sqlite3_db_mutex(fs->db));
     return result;
 }
 
-// static int catifs_access(const char *path, int mask)
-// {
-//     sqlite3 *db;
-//     
-//     db = fuse_get_context()->private_data;
-//     
-// 	int res;
-// 
-// 	res = access(path, mask);
-// 	if (res == -1)
-// 		return -errno;
-// 
-// 	return 0;
-// }
+static void bloom_free(struct bloom *bloom)
+{
+    if( bloom->negatives || bloom->false_positives ) {
+        fprintf(stderr, "Negative lookup filter: %llu lookups answered "
+                "without database, %llu false positives (%.3f%%)\n",
+                (unsigned long long) bloom->negatives,
+                (unsigned long long) bloom->false_positives,
+                100.0 * bloom->false_positives /
+                    (bloom->negatives + bloom->false_positives));
+    }
+    free(bloom->bits);
+    bloom->bits = NULL;
+    sqlite3_finalize(bloom->data_version);
+    bloom->data_version = NULL;
+}
+
+
+/*
+ * Group the statements of a modification. Savepoints can be nested in
+ * an enclosing transaction. The (recursive) mutex of the connection is
+ * held until db_end() so that statements of another thread using the
+ * connection (see control_serve()) do not end up in the savepoint.
+ */
+static int db_begin(sqlite3 *db)
+{
+    sqlite3_mutex_enter(sqlite3_db_mutex(db));
+    if( sqlite3_exec(db, "SAVEPOINT catifs", 0, 0, 0) == SQLITE_OK ) return 0;
+    sqlite3_mutex_leave(sqlite3_db_mutex(db));
+    return -EIO;
+}
 
-static int add_path_to_database(sqlite3 *db, const char *from, const char *to)
+static int db_end(sqlite3 *db, int result)
+{
+    if( result != 0 ) sqlite3_exec(db, "ROLLBACK TO catifs", 0, 0, 0);
+    if( sqlite3_exec(db, "RELEASE catifs", 0, 0, 0) != SQLITE_OK && result == 0 ) {
+#ifdef DEBUG
+        fprintf(stderr, "cannot commit modification: %s\n", sqlite3_errmsg(db));
+#endif
+        result = -EIO;
+    }
+    sqlite3_mutex_leave(sqlite3_db_mutex(db));
+    return result;
+}
+
+/*
+ * Execute a modification statement with up to two text parameters.
+ */
+static int db_run(sqlite3 *db, const char *sql, const char *text1, const char *text2)
 {
-    struct stat buf;
-    int rc;
     sqlite3_stmt *query;
     int result;
-    
-    if (stat(from, &buf) == -1)
-        return -errno;
 
-    rc = sqlite3_prepare_v2(db,
-            "INSERT INTO catifs (path, real_path, st_dev, st_mode, "
-            "st_nlink, st_uid, st_gid, st_rdev, st_size, st_blksize, "
-            "st_blocks, st_atim_sec, st_atim_nsec, st_mtim_sec, st_mtim_nsec, "
-            "st_ctim_sec, st_ctim_nsec) VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?);",
-            -1, &query, 0);
-    if( rc != SQLITE_OK ) {
+    if( sqlite3_prepare_v2(db, sql, -1, &query, 0) != SQLITE_OK ) {
 #ifdef DEBUG
-        fprintf(stderr, "symlink cannot prepare SQL query: %s\n", sqlite3_errmsg(db));
+        fprintf(stderr, "cannot prepare SQL query: %s\n", sqlite3_errmsg(db));
 #endif
         return -EIO;
     }
-    
-    sqlite3_bind_text(query, 1, to, -1, SQLITE_STATIC);
-    sqlite3_bind_text(query, 2, from, -1, SQLITE_STATIC);
-    sqlite3_bind_int(query, 3, buf.st_dev);
-    sqlite3_bind_int(query, 4, buf.st_mode);
-    sqlite3_bind_int(query, 5, buf.st_nlink);
-    sqlite3_bind_int(query, 6, buf.st_uid);
-    sqlite3_bind_int(query, 7, buf.st_gid);
-    sqlite3_bind_int(query, 8, buf.st_rdev);
-    sqlite3_bind_int(query, 9, buf.st_size);
-    sqlite3_bind_int(query, 10, buf.st_blksize);
-    sqlite3_bind_int(query, 11, buf.st_blocks);
-    sqlite3_bind_int(query, 12, buf.st_atim.tv_sec);
-    sqlite3_bind_int(query, 13, buf.st_atim.tv_nsec);
-    sqlite3_bind_int(query, 14, buf.st_mtim.tv_sec);
-    sqlite3_bind_int(query, 15, buf.st_mtim.tv_nsec);
-    sqlite3_bind_int(query, 16, buf.st_ctim.tv_sec);
-    sqlite3_bind_int(query, 17, buf.st_ctim.tv_nsec);
-    if ( sqlite3_step(query) == SQLITE_DONE)
+    if( text1 ) sqlite3_bind_text(query, 1, text1, -1, SQLITE_STATIC);
+    if( text2 ) sqlite3_bind_text(query, 2, text2, -1, SQLITE_STATIC);
+    if( sqlite3_step(query) == SQLITE_DONE ) {
         result = 0;
-    else {
+    } else {
 #ifdef DEBUG
-        fprintf(stderr, "symlink insert item in database: %s\n", sqlite3_errmsg(db));
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
 #endif
         result = -EIO;
     }
@@ -254,781 +562,5729 @@ static int add_path_to_database(sqlite3 *db, const char *from, const char *to)
     return result;
 }
 
-// static int catifs_readlink(const char *path, char *buf, size_t size)
-// {
-//     sqlite3 *db;
-//     int rc;
-//     db = fuse_get_context()->private_data;
-//     sqlite3_stmt *query;
-//     int result;
-//     
-//     rc = sqlite3_prepare_v2(db,
-//             "SELECT real_path FROM catifs WHERE path=?1",
-//             -1, &query, 0);
-//     if( rc != SQLITE_OK ) {
-//         return -EIO;
-//     }
-//     
-//     sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
-//     if( sqlite3_step(query) == SQLITE_ROW ) {
-//         strncpy(buf, (const char *) sqlite3_column_text(query, 0), size-1);
-//         result = 0;
-//     } else {
-//         result = -ENOENT;
-//     }
-//     sqlite3_finalize(query);
-//     return result;
-// }
-
-
-// static int catifs_opendir(const char *path, struct fuse_file_info *fi)
-// {s
-//     return 0;
-// }
-
-static inline struct xmp_dirp *get_dirp(struct fuse_file_info *fi)
+/*
+ * Append a change of path to catifs_changes, called in the savepoint of
+ * the change.
+ */
+static int change_log(sqlite3 *db, int op, const char *path, const char *target)
 {
-	return (struct xmp_dirp *) (uintptr_t) fi->fh;
+    sqlite3_stmt *query;
+    int result;
+
+    if( sqlite3_prepare_v2(db,
+            "INSERT INTO catifs_changes (time, op, path, target) "
+            "VALUES (strftime('%s', 'now'), ?1, ?2, ?3)",
+            -1, &query, 0) != SQLITE_OK ) {
+#ifdef DEBUG
+        fprintf(stderr, "cannot prepare SQL query: %s\n", sqlite3_errmsg(db));
+#endif
+        return -EIO;
+    }
+    sqlite3_bind_int(query, 1, op);
+    sqlite3_bind_text(query, 2, path, -1, SQLITE_STATIC);
+    if( target ) sqlite3_bind_text(query, 3, target, -1, SQLITE_STATIC);
+    result = sqlite3_step(query) == SQLITE_DONE ? 0 : -EIO;
+    sqlite3_finalize(query);
+    return result;
 }
 
-static int catifs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		          off_t offset, struct fuse_file_info *fi,
-		          enum fuse_readdir_flags flags)
+/*
+ * Add size, files and dirs to the aggregates of all the ancestors of
+ * path (use negative values to remove an entry).
+ */
+static int tree_update(sqlite3 *db, const char *path,
+                       sqlite3_int64 size, int files, int dirs)
 {
-    (void) fi;
     sqlite3_stmt *query;
-    int rc;
-    sqlite3 *db;
-    struct stat stbuf;
-#ifdef DEBUG
-    int count = 0;
-#endif
-    
-    db = fuse_get_context()->private_data;
-    rc = sqlite3_prepare_v2(db,
-            "SELECT st_dev, st_ino, st_mode, st_nlink, st_uid, st_gid, "
-            "st_rdev, st_size, st_blksize, st_blocks, st_atim_sec, "
-            "st_atim_nsec, st_mtim_sec, st_mtim_nsec, st_ctim_sec, "
-            "st_ctim_nsec, path FROM catifs WHERE "
-            "path GLOB (?1 || '/*') AND instr(substr(path,length(?1)+2), '/') == 0",
-            -1, &query, 0);
-    if( rc != SQLITE_OK ) {
+    int result;
+
+    if( sqlite3_prepare_v2(db,
+            "WITH RECURSIVE up(dir) AS (\n"
+            "  SELECT " PARENT("?1") "\n"
+            "  UNION ALL\n"
+            "  SELECT " PARENT("dir") " FROM up WHERE dir != ''\n"
+            ")\n"
+            "INSERT INTO catifs_tree (path, size, files, dirs)\n"
+            "  SELECT CASE dir WHEN '' THEN '/' ELSE dir END, ?2, ?3, ?4 FROM up WHERE 1\n"
+            "ON CONFLICT (path) DO UPDATE SET size = size + excluded.size,\n"
+            "  files = files + excluded.files, dirs = dirs + excluded.dirs",
+            -1, &query, 0) != SQLITE_OK ) {
 #ifdef DEBUG
-        fprintf(stderr, "readdir cannot prepare SQL query: %s\n", sqlite3_errmsg(db));
+        fprintf(stderr, "tree_update cannot prepare SQL query: %s\n", sqlite3_errmsg(db));
 #endif
         return -EIO;
     }
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(query, 2, size);
+    sqlite3_bind_int(query, 3, files);
+    sqlite3_bind_int(query, 4, dirs);
+    result = sqlite3_step(query) == SQLITE_DONE ? 0 : -EIO;
+    sqlite3_finalize(query);
+    return result;
+}
 
-    if( strcmp(path, "/")==0 ){
-        path = "";
-    }
-    rc = sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
-    if( rc != SQLITE_OK ) {
-#ifdef DEBUG
-        fprintf(stderr, "readdir bind path to SQL query: %s\n", sqlite3_errmsg(db));
-#endif
-        sqlite3_finalize(query);
+/*
+ * Read the recursive aggregates of directory path.
+ */
+static int tree_get(sqlite3 *db, const char *path, sqlite3_int64 *size,
+                    sqlite3_int64 *files, sqlite3_int64 *dirs)
+{
+    sqlite3_stmt *query;
+    int result;
+
+    *size = *files = *dirs = 0;
+    if( sqlite3_prepare_v2(db,
+            "SELECT size, files, dirs FROM catifs_tree WHERE path=?1",
+            -1, &query, 0) != SQLITE_OK )
         return -EIO;
-    }
-    filler(buf, ".", NULL, 0, 0);
-    filler(buf, "..", NULL, 0, 0);
-#ifdef DEBUG
-    char *sql = sqlite3_expanded_sql(query);
-    fprintf(stderr, "readdir using SQL query: %s ; %s\n", path, sql);
-    sqlite3_free(sql);
-#endif
-    const int dir_len = strlen(path)+1;
-    for( rc = sqlite3_step(query); rc == SQLITE_ROW; rc = sqlite3_step(query) ) {
-        stbuf.st_dev = sqlite3_column_int(query, 0);
-        stbuf.st_ino = sqlite3_column_int(query, 1);
-        stbuf.st_mode = sqlite3_column_int(query, 2);
-        stbuf.st_nlink = sqlite3_column_int(query, 3);
-        stbuf.st_uid = sqlite3_column_int(query, 4);
-        stbuf.st_gid = sqlite3_column_int(query, 5);
-        stbuf.st_rdev = sqlite3_column_int(query, 6);
-        stbuf.st_size = sqlite3_column_int(query, 7);
-        stbuf.st_blksize = sqlite3_column_int(query, 8);
-        stbuf.st_blocks = sqlite3_column_int(query, 9);
-        stbuf.st_atim.tv_sec = sqlite3_column_int(query, 10);
-        stbuf.st_atim.tv_nsec = sqlite3_column_int(query, 11);
-        stbuf.st_mtim.tv_sec = sqlite3_column_int(query, 12);
-        stbuf.st_mtim.tv_nsec = sqlite3_column_int(query, 13);
-        stbuf.st_ctim.tv_sec = sqlite3_column_int(query, 14);
-        stbuf.st_ctim.tv_nsec = sqlite3_column_int(query, 15);
-        filler(buf, ((const char *) sqlite3_column_text(query, 16)) + dir_len, &stbuf, 0, 0);
-#ifdef DEBUG
-        fprintf(stderr, "readdir ->: %s\n", ((const char *) sqlite3_column_text(query, 16)) + dir_len);
-        ++count;
-#endif
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    result = sqlite3_step(query);
+    if( result == SQLITE_ROW ) {
+        *size = sqlite3_column_int64(query, 0);
+        *files = sqlite3_column_int64(query, 1);
+        *dirs = sqlite3_column_int64(query, 2);
+        result = 0;
+    } else {
+        result = result == SQLITE_DONE ? -ENOENT : -EIO;
     }
     sqlite3_finalize(query);
-    if ( rc != SQLITE_DONE ) {
-#ifdef DEBUG
-        fprintf(stderr, "readdir cannot query database: %s (%d)\n", sqlite3_errmsg(db), rc);
-#endif
+    return result;
+}
+
+/*
+ * Get rowid, mode and size of the catalogue entry for path.
+ */
+static int path_entry(sqlite3 *db, const char *path, sqlite3_int64 *rowid,
+                      mode_t *mode, sqlite3_int64 *size)
+{
+    sqlite3_stmt *query;
+    int result;
+
+    if( sqlite3_prepare_v2(db,
+            "SELECT rowid, st_mode, st_size FROM catifs WHERE path=?1",
+            -1, &query, 0) != SQLITE_OK )
         return -EIO;
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    result = sqlite3_step(query);
+    if( result == SQLITE_ROW ) {
+        if( rowid ) *rowid = sqlite3_column_int64(query, 0);
+        if( mode ) *mode = sqlite3_column_int(query, 1);
+        if( size ) *size = sqlite3_column_int64(query, 2);
+        result = 0;
     } else {
-#ifdef DEBUG
-        fprintf(stderr, "readdir successful: %d entries\n", count);
-#endif
-        return 0;
+        result = result == SQLITE_DONE ? -ENOENT : -EIO;
     }
+    sqlite3_finalize(query);
+    return result;
 }
 
-// static int catifs_releasedir(const char *path, struct fuse_file_info *fi)
-// {
-// }
 
-// static int catifs_mknod(const char *path, mode_t mode, dev_t rdev)
-// {
-//     return 0;
-// }
+/*
+ * Return the shard of path and set local to the path in this shard: the
+ * shard with the longest prefix of path, else the first shard merged at
+ * the root. No query is made, lookups in the other shards merged at the
+ * root go through route_next(). Return NULL if path is only an ancestor
+ * of shard prefixes.
+ */
+static struct catifs *route(const char *path, const char **local)
+{
+    struct catifs_mount *mount = get_mount();
+    struct catifs_shard *shard, *best = NULL, *root = NULL;
+    int i;
 
-static int catifs_mkdir(const char *path, mode_t mode)
+    for( i=0; i<mount->count; i++ ) {
+        shard = &mount->shards[i];
+        if( shard->prefix_len == 0 ) {
+            if( ! root ) root = shard;
+        } else if( strncmp(path, shard->prefix, shard->prefix_len) == 0 &&
+                   (path[shard->prefix_len] == '/' || path[shard->prefix_len] == 0) &&
+                   (! best || shard->prefix_len > best->prefix_len) ) {
+            best = shard;
+        }
+    }
+    if( best ) {
+        *local = path[best->prefix_len] ? path + best->prefix_len : "/";
+        return &best->fs;
+    }
+    *local = path;
+    return root ? &root->fs : NULL;
+}
+
+/*
+ * Return the shard merged at the root after fs (the path in the shard is
+ * the same), NULL if there is none or fs has a prefix.
+ */
+static struct catifs *route_next(const struct catifs *fs)
 {
-    char template[] = "/tmp/catifs.XXXXXX";
-    sqlite3 *db;
-    int result;
-    int rc;
-    sqlite3_stmt *query;
-    
-    db = fuse_get_context()->private_data;
+    struct catifs_mount *mount = get_mount();
+    int i;
 
-    char *dir_name = mkdtemp(template);
-    if ( ! dir_name ) {
-#ifdef DEBUG
-        fprintf(stderr, "mkdir cannot create temporary directory\n");
-#endif
-        return -errno;
+    for( i=0; i<mount->count && &mount->shards[i].fs != fs; i++ );
+    if( i == mount->count || mount->shards[i].prefix_len != 0 ) return NULL;
+    for( ++i; i<mount->count; i++ )
+        if( mount->shards[i].prefix_len == 0 ) return &mount->shards[i].fs;
+    return NULL;
+}
+
+/*
+ * Shard of an entry to modify or create: as route() but, among the
+ * shards merged at the root, the first one containing path or else its
+ * parent directory (the first one if none does).
+ */
+static struct catifs *route_entry(const char *path, const char **local)
+{
+    struct catifs *fs = route(path, local), *other;
+    const char *slash;
+    char *parent;
+
+    if( ! fs || ! route_next(fs) || strcmp(*local, "/") == 0 ) return fs;
+    for( other = fs; other; other = route_next(other) ) {
+        if( bloom_may_contain(other, *local) &&
+            path_entry(other->db, *local, NULL, NULL, NULL) == 0 )
+            return other;
     }
-    add_path_to_database(db, dir_name, path);
-    rmdir(dir_name);
-    rc = sqlite3_prepare_v2(db,
-            "UPDATE catifs SET real_path=NULL, st_mode=?2 WHERE path=?1",
-//             "UPDATE catifs SET real_path=NULL WHERE path=?1",
-            -1, &query, 0);
-    
-    if( rc != SQLITE_OK ) {
-#ifdef DEBUG
-        fprintf(stderr, "mkdir cannot prepare SQL query: %s\n", sqlite3_errmsg(db));
-#endif
-        return -EIO;
+    slash = strrchr(*local, '/');
+    if( slash == *local ) return fs;
+    parent = strndup(*local, slash - *local);
+    for( other = fs; parent && other; other = route_next(other) ) {
+        if( path_entry(other->db, parent, NULL, NULL, NULL) == 0 ) break;
     }
-    rc = sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
-    if( rc != SQLITE_OK ) {
-#ifdef DEBUG
-        fprintf(stderr, "mkdir bind path to SQL query: %s\n", sqlite3_errmsg(db));
-#endif
-        sqlite3_finalize(query);
-        return -EIO;
+    free(parent);
+    return other ? other : fs;
+}
+
+/* Database of an entry to modify (see route_entry()) */
+static sqlite3 *route_db(const char **path)
+{
+    struct catifs *fs = route_entry(*path, path);
+    return fs ? fs->db : NULL;
+}
+
+/*
+ * Return 1 if path is a strict ancestor of the prefix of a shard.
+ */
+static int is_prefix_ancestor(const char *path)
+{
+    struct catifs_mount *mount = get_mount();
+    size_t len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+    int i;
+
+    for( i=0; i<mount->count; i++ ) {
+        const struct catifs_shard *shard = &mount->shards[i];
+        if( shard->prefix_len > len && strncmp(shard->prefix, path, len) == 0 &&
+            shard->prefix[len] == '/' )
+            return 1;
     }
-    rc = sqlite3_bind_int(query, 2, mode|S_IFDIR);
-    if( rc != SQLITE_OK ) {
-#ifdef DEBUG
-        fprintf(stderr, "mkdir bind mode to SQL query: %s\n", sqlite3_errmsg(db));
-#endif
-        sqlite3_finalize(query);
-        return -EIO;
+    return 0;
+}
+
+
+/*
+ * Stat fields of catalogue rows are stored either in one INT column per
+ * field (default schema) or, in compact databases (see
+ * compact_database()), as st_ino (alias of rowid), st_mode and st_size
+ * columns plus a "stat" BLOB holding the other fields. st_mode and
+ * st_size stay columns so that SQL (aggregates, add_dir_to_db.py) can
+ * use them.
+ *
+ * The BLOB starts with a format byte followed by the fields below, in
+ * this order, as zigzag LEB128 varints. Each field is 64-bit clean and
+ * a typical record is about 40 bytes.
+ */
+#define STAT_COLUMNS \
+    "st_dev, st_ino, st_mode, st_nlink, st_uid, st_gid, " \
+    "st_rdev, st_size, st_blksize, st_blocks, st_atim_sec, " \
+    "st_atim_nsec, st_mtim_sec, st_mtim_nsec, st_ctim_sec, " \
+    "st_ctim_nsec"
+#define STAT_COMPACT_COLUMNS "st_ino, st_mode, st_size, stat"
+#define STAT_NCOLUMNS(fs) ((fs)->compact ? 4 : 16)
+#define STAT_SELECT(fs, rest) \
+    ((fs)->compact ? "SELECT " STAT_COMPACT_COLUMNS rest : "SELECT " STAT_COLUMNS rest)
+
+#define STAT_RECORD_FORMAT 1
+#define STAT_RECORD_FIELDS 13
+#define STAT_RECORD_MAX (1 + 10 * STAT_RECORD_FIELDS)
+
+/*
+ * Row insertion and update, ?1 is the path, ?2 the absolute real path
+ * and stat fields start at ?3 (see stat_bind()).
+ */
+static const char *stat_insert[2] = {
+    "INSERT INTO catifs (path, real_path, volume, st_dev, st_mode, "
+    "st_nlink, st_uid, st_gid, st_rdev, st_size, st_blksize, "
+    "st_blocks, st_atim_sec, st_atim_nsec, st_mtim_sec, st_mtim_nsec, "
+    "st_ctim_sec, st_ctim_nsec) VALUES (?1," VOLUME_RELATIVE("?2") "," VOLUME_OF("?2") ","
+    "?3,?4,?5,?6,?7,?8,?9,?10,?11,?12,?13,?14,?15,?16,?17)",
+    "INSERT INTO catifs (path, real_path, volume, st_mode, st_size, stat) "
+    "VALUES (?1," VOLUME_RELATIVE("?2") "," VOLUME_OF("?2") ",?3,?4,?5)",
+};
+static const char *stat_update[2] = {
+    "UPDATE catifs SET st_dev=?3, st_mode=?4, st_nlink=?5, st_uid=?6, "
+    "st_gid=?7, st_rdev=?8, st_size=?9, st_blksize=?10, st_blocks=?11, "
+    "st_atim_sec=?12, st_atim_nsec=?13, st_mtim_sec=?14, st_mtim_nsec=?15, "
+    "st_ctim_sec=?16, st_ctim_nsec=?17 WHERE path=?1",
+    "UPDATE catifs SET st_mode=?3, st_size=?4, stat=?5 WHERE path=?1",
+};
+
+/*
+ * Insertion of an entry without backing file (directory or symbolic
+ * link), ?1 is the path, ?2 the target of a symbolic link and stat
+ * fields start at ?3. Nothing is inserted if the path exists.
+ */
+static const char *entry_insert[2] = {
+    "INSERT OR IGNORE INTO catifs (path, link_target, st_dev, st_mode, "
+    "st_nlink, st_uid, st_gid, st_rdev, st_size, st_blksize, "
+    "st_blocks, st_atim_sec, st_atim_nsec, st_mtim_sec, st_mtim_nsec, "
+    "st_ctim_sec, st_ctim_nsec) VALUES (?1,?2,"
+    "?3,?4,?5,?6,?7,?8,?9,?10,?11,?12,?13,?14,?15,?16,?17)",
+    "INSERT OR IGNORE INTO catifs (path, link_target, st_mode, st_size, stat) "
+    "VALUES (?1,?2,?3,?4,?5)",
+};
+
+static unsigned char *varint_put(unsigned char *p, int64_t value)
+{
+    uint64_t v = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+
+    while( v >= 0x80 ) {
+        *p++ = (unsigned char) v | 0x80;
+        v >>= 7;
     }
-    
-    if ( sqlite3_step(query) == SQLITE_DONE)
-        result = 0;
-    else {
-#ifdef DEBUG
-        fprintf(stderr, "mkdir cannot modify database: %s\n", sqlite3_errmsg(db));
-#endif
-        result = -EIO;
+    *p++ = (unsigned char) v;
+    return p;
+}
+
+static const unsigned char *varint_get(const unsigned char *p,
+                                       const unsigned char *end, int64_t *value)
+{
+    uint64_t v = 0;
+    int shift = 0;
+
+    while( p < end && shift < 64 ) {
+        v |= (uint64_t) (*p & 0x7f) << shift;
+        if( ! (*p++ & 0x80) ) {
+            *value = (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+            return p;
+        }
+        shift += 7;
     }
-    
-    rc = sqlite3_finalize(query);
-    if ( rc != SQLITE_OK ) {
-#ifdef DEBUG
-        fprintf(stderr, "mkdir cannot delete query: %s\n", sqlite3_errmsg(db));
-#endif
-        return -EIO;
+    return NULL;
+}
+
+/*
+ * Encode the stat fields that are not columns in compact databases.
+ */
+static int stat_pack(const int64_t fields[STAT_RECORD_FIELDS],
+                     unsigned char record[STAT_RECORD_MAX])
+{
+    unsigned char *p = record;
+    int i;
+
+    *p++ = STAT_RECORD_FORMAT;
+    for( i=0; i<STAT_RECORD_FIELDS; i++ )
+        p = varint_put(p, fields[i]);
+    return p - record;
+}
+
+static int stat_pack_buf(const struct stat *buf, unsigned char record[STAT_RECORD_MAX])
+{
+    int64_t fields[STAT_RECORD_FIELDS] = {
+        buf->st_dev, buf->st_nlink, buf->st_uid, buf->st_gid, buf->st_rdev,
+        buf->st_blksize, buf->st_blocks,
+        buf->st_atim.tv_sec, buf->st_atim.tv_nsec,
+        buf->st_mtim.tv_sec, buf->st_mtim.tv_nsec,
+        buf->st_ctim.tv_sec, buf->st_ctim.tv_nsec,
+    };
+    return stat_pack(fields, record);
+}
+
+static int stat_unpack(const void *record, int size, struct stat *buf)
+{
+    const unsigned char *p = record;
+    const unsigned char *end = p + size;
+    int64_t fields[STAT_RECORD_FIELDS];
+    int i;
+
+    if( size < 1 || *p++ != STAT_RECORD_FORMAT ) return -EIO;
+    for( i=0; i<STAT_RECORD_FIELDS; i++ ) {
+        p = varint_get(p, end, &fields[i]);
+        if( ! p ) return -EIO;
     }
-    return result;
+    buf->st_dev = fields[0];
+    buf->st_nlink = fields[1];
+    buf->st_uid = fields[2];
+    buf->st_gid = fields[3];
+    buf->st_rdev = fields[4];
+    buf->st_blksize = fields[5];
+    buf->st_blocks = fields[6];
+    buf->st_atim.tv_sec = fields[7];
+    buf->st_atim.tv_nsec = fields[8];
+    buf->st_mtim.tv_sec = fields[9];
+    buf->st_mtim.tv_nsec = fields[10];
+    buf->st_ctim.tv_sec = fields[11];
+    buf->st_ctim.tv_nsec = fields[12];
+    return 0;
 }
 
-static int catifs_unlink(const char *path)
+/*
+ * Fill buf from the STAT_SELECT() columns of query starting at col.
+ */
+static int stat_decode(const struct catifs *fs, sqlite3_stmt *query, int col,
+                       struct stat *buf)
+{
+    if( fs->compact ) {
+        buf->st_ino = sqlite3_column_int64(query, col);
+        buf->st_mode = sqlite3_column_int64(query, col + 1);
+        buf->st_size = sqlite3_column_int64(query, col + 2);
+        return stat_unpack(sqlite3_column_blob(query, col + 3),
+                           sqlite3_column_bytes(query, col + 3), buf);
+    }
+    buf->st_dev = sqlite3_column_int64(query, col);
+    buf->st_ino = sqlite3_column_int64(query, col + 1);
+    buf->st_mode = sqlite3_column_int64(query, col + 2);
+    buf->st_nlink = sqlite3_column_int64(query, col + 3);
+    buf->st_uid = sqlite3_column_int64(query, col + 4);
+    buf->st_gid = sqlite3_column_int64(query, col + 5);
+    buf->st_rdev = sqlite3_column_int64(query, col + 6);
+    buf->st_size = sqlite3_column_int64(query, col + 7);
+    buf->st_blksize = sqlite3_column_int64(query, col + 8);
+    buf->st_blocks = sqlite3_column_int64(query, col + 9);
+    buf->st_atim.tv_sec = sqlite3_column_int64(query, col + 10);
+    buf->st_atim.tv_nsec = sqlite3_column_int64(query, col + 11);
+    buf->st_mtim.tv_sec = sqlite3_column_int64(query, col + 12);
+    buf->st_mtim.tv_nsec = sqlite3_column_int64(query, col + 13);
+    buf->st_ctim.tv_sec = sqlite3_column_int64(query, col + 14);
+    buf->st_ctim.tv_nsec = sqlite3_column_int64(query, col + 15);
+    return 0;
+}
+
+/*
+ * Bind the stat fields of stat_insert or stat_update.
+ */
+static int stat_bind(const struct catifs *fs, sqlite3_stmt *query,
+                     const struct stat *buf)
+{
+    unsigned char record[STAT_RECORD_MAX];
+
+    if( fs->compact ) {
+        sqlite3_bind_int64(query, 3, buf->st_mode);
+        sqlite3_bind_int64(query, 4, buf->st_size);
+        return sqlite3_bind_blob(query, 5, record, stat_pack_buf(buf, record),
+                                 SQLITE_TRANSIENT) == SQLITE_OK ? 0 : -EIO;
+    }
+    sqlite3_bind_int64(query, 3, buf->st_dev);
+    sqlite3_bind_int64(query, 4, buf->st_mode);
+    sqlite3_bind_int64(query, 5, buf->st_nlink);
+    sqlite3_bind_int64(query, 6, buf->st_uid);
+    sqlite3_bind_int64(query, 7, buf->st_gid);
+    sqlite3_bind_int64(query, 8, buf->st_rdev);
+    sqlite3_bind_int64(query, 9, buf->st_size);
+    sqlite3_bind_int64(query, 10, buf->st_blksize);
+    sqlite3_bind_int64(query, 11, buf->st_blocks);
+    sqlite3_bind_int64(query, 12, buf->st_atim.tv_sec);
+    sqlite3_bind_int64(query, 13, buf->st_atim.tv_nsec);
+    sqlite3_bind_int64(query, 14, buf->st_mtim.tv_sec);
+    sqlite3_bind_int64(query, 15, buf->st_mtim.tv_nsec);
+    sqlite3_bind_int64(query, 16, buf->st_ctim.tv_sec);
+    return sqlite3_bind_int64(query, 17, buf->st_ctim.tv_nsec) == SQLITE_OK ? 0 : -EIO;
+}
+
+/*
+ * Read the stat fields of the catalogue entry for path.
+ */
+static int load_stat(const struct catifs *fs, const char *path, struct stat *buf)
 {
-    sqlite3 *db;
-    int rc;
     sqlite3_stmt *query;
     int result;
-    
-    db = fuse_get_context()->private_data;
-    rc = sqlite3_prepare_v2(db,
-            "DELETE FROM catifs WHERE path=?1",
-            -1, &query, 0);
-    if( rc != SQLITE_OK ) {
-        return -EIO;
-    }
-    
-    rc = sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
-    if( rc != SQLITE_OK ) {
+
+    if( sqlite3_prepare_v2(fs->db, STAT_SELECT(fs, " FROM catifs WHERE path=?1"),
+                           -1, &query, 0) != SQLITE_OK ) {
+#ifdef DEBUG
+        fprintf(stderr, "getattr cannot prepare SQL query: %s\n", sqlite3_errmsg(fs->db));
+#endif
         return -EIO;
     }
-    rc = sqlite3_step(query);
-    if( rc == SQLITE_DONE ) {
-        result = 0;
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    result = sqlite3_step(query);
+    if( result == SQLITE_ROW ) {
+        result = stat_decode(fs, query, 0, buf);
     } else {
 #ifdef DEBUG
-        fprintf(stderr, "unlink cannot remove path: %s\n", sqlite3_errmsg(db));
+        fprintf(stderr, "getattr SQL query failed: (%d) %s\n", result, sqlite3_errmsg(fs->db));
 #endif
-        result = -ENOENT;
+        result = result == SQLITE_DONE ? -ENOENT : -EIO;
     }
     sqlite3_finalize(query);
     return result;
 }
 
-
-static int catifs_rename(const char *from, const char *to, unsigned int flags)
+/*
+ * Write all the stat fields of the catalogue entry for path.
+ */
+static int store_stat(const struct catifs *fs, const char *path, const struct stat *buf)
 {
-    sqlite3 *db;
-    int rc;
     sqlite3_stmt *query;
     int result;
-    
-    db = fuse_get_context()->private_data;
-    rc = sqlite3_prepare_v2(db,
-            "UPDATE catifs SET path = ?2 || substr(path, ?3) WHERE path=?1 OR path GLOB ?1 || '/*'",
-            -1, &query, 0);
-    if( rc != SQLITE_OK ) {
-        return -EIO;
-    }
-    
-    rc = sqlite3_bind_text(query, 1, from, -1, SQLITE_STATIC);
-    if( rc != SQLITE_OK ) {
-        return -EIO;
-    }
-    rc = sqlite3_bind_text(query, 2, to, -1, SQLITE_STATIC);
-    if( rc != SQLITE_OK ) {
-        return -EIO;
-    }
-    rc = sqlite3_bind_int(query, 3, strlen(from)+1);
-    if( rc != SQLITE_OK ) {
-        return -EIO;
-    }
-    rc = sqlite3_step(query);
-    if( rc == SQLITE_DONE ) {
-        result = 0;
-    } else {
+
+    if( sqlite3_prepare_v2(fs->db, stat_update[fs->compact], -1, &query, 0) != SQLITE_OK ) {
 #ifdef DEBUG
-        fprintf(stderr, "rename cannot rename path(s): %s\n", sqlite3_errmsg(db));
+        fprintf(stderr, "cannot prepare SQL query: %s\n", sqlite3_errmsg(fs->db));
 #endif
-        result = -ENOENT;
+        return -EIO;
+    }
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    result = stat_bind(fs, query, buf);
+    if( result == 0 ) {
+        if( sqlite3_step(query) != SQLITE_DONE )
+            result = -EIO;
+        else if( sqlite3_changes(fs->db) == 0 )
+            result = -ENOENT;
     }
     sqlite3_finalize(query);
     return result;
 }
 
-// static int catifs_link(const char *from, const char *to)
-// {
-// }
 
-static int catifs_chmod(const char *path, mode_t mode,
-		        struct fuse_file_info *fi)
+/*
+ * Content hash of backing files used to find duplicates. Data is
+ * processed in 64 byte stripes by 8 independent 64-bit lanes (the
+ * accumulation scheme of XXH3) so that the compiler vectorizes the
+ * inner loop. Hashes are only used to find candidates: files are
+ * compared byte by byte before being deduplicated.
+ */
+#define HASH_LANES 8
+#define HASH_STRIPE (8 * HASH_LANES)
+#define HASH_BLOCK_STRIPES 16
+#define HASH_BUFFER_SIZE (1 << 20)
+
+static const uint64_t hash_secret[HASH_LANES] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL,
+    0x1f67b3b7a4a44072ULL, 0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL,
+    0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+struct content_hash {
+    uint64_t acc[HASH_LANES];
+    uint64_t length;
+    int stripes;
+};
+
+static void content_hash_init(struct content_hash *h)
 {
-    sqlite3 *db;
-    int rc;
-    sqlite3_stmt *query;
-    int result;
-    
-    db = fuse_get_context()->private_data;
-    rc = sqlite3_prepare_v2(db,
-            "UPDATE catifs SET st_mode=?2 WHERE path=?1",
-            -1, &query, 0);
-    if( rc != SQLITE_OK ) {
-        return -EIO;
+    static const uint64_t init[HASH_LANES] = {
+        0xc2b2ae3dULL, 0x9e3779b185ebca87ULL, 0xc2b2ae3d27d4eb4fULL,
+        0x165667b19e3779f9ULL, 0x85ebca77c2b2ae63ULL, 0x85ebca77ULL,
+        0x27d4eb2f165667c5ULL, 0x9e3779b1ULL,
+    };
+    memcpy(h->acc, init, sizeof(init));
+    h->length = 0;
+    h->stripes = 0;
+}
+
+static inline void content_hash_stripe(uint64_t *restrict acc,
+                                       const unsigned char *restrict p)
+{
+    uint64_t data[HASH_LANES];
+    int i;
+
+    memcpy(data, p, sizeof(data));
+    for( i=0; i<HASH_LANES; i++ ) {
+        uint64_t key = data[i] ^ hash_secret[i];
+        acc[i ^ 1] += data[i];
+        acc[i] += (key & 0xffffffffULL) * (key >> 32);
     }
-    
-    rc = sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
-    if( rc != SQLITE_OK ) {
-        return -EIO;
+}
+
+static inline void content_hash_scramble(uint64_t *acc)
+{
+    int i;
+
+    for( i=0; i<HASH_LANES; i++ ) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= hash_secret[(i + 3) % HASH_LANES];
+        acc[i] *= 0x9e3779b1ULL;
     }
-    rc = sqlite3_bind_int(query, 2, mode);
-    if( rc != SQLITE_OK ) {
+}
+
+/*
+ * Hash size bytes, size must be a multiple of HASH_STRIPE except for
+ * the last call.
+ */
+static void content_hash_update(struct content_hash *h,
+                                const unsigned char *data, size_t size)
+{
+    unsigned char last[HASH_STRIPE];
+
+    h->length += size;
+    for( ; size >= HASH_STRIPE; data += HASH_STRIPE, size -= HASH_STRIPE ) {
+        content_hash_stripe(h->acc, data);
+        if( ++h->stripes == HASH_BLOCK_STRIPES ) {
+            content_hash_scramble(h->acc);
+            h->stripes = 0;
+        }
+    }
+    if( size ) {
+        memset(last, 0, sizeof(last));
+        memcpy(last, data, size);
+        content_hash_stripe(h->acc, last);
+    }
+}
+
+static uint64_t content_hash_final(const struct content_hash *h)
+{
+    uint64_t result = h->length * 0x9e3779b185ebca87ULL;
+    int i;
+
+    for( i=0; i<HASH_LANES; i+=2 ) {
+        __uint128_t m = (__uint128_t) (h->acc[i] ^ hash_secret[i]) *
+                        (h->acc[i + 1] ^ hash_secret[i + 1]);
+        result += (uint64_t) m ^ (uint64_t) (m >> 64);
+    }
+    result ^= result >> 37;
+    result *= 0x165667919e3779f9ULL;
+    result ^= result >> 32;
+    return result;
+}
+
+/*
+ * Hash the content of a file.
+ */
+static int content_hash_file(const char *path, uint64_t *hash)
+{
+    struct content_hash h;
+    unsigned char *buffer;
+    ssize_t size;
+    int fd;
+    int result = 0;
+
+    fd = open(path, O_RDONLY);
+    if( fd == -1 ) return -errno;
+    buffer = malloc(HASH_BUFFER_SIZE);
+    if( ! buffer ) {
+        close(fd);
+        return -ENOMEM;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    content_hash_init(&h);
+    for( ;; ) {
+        size_t filled = 0;
+        /* Fill the buffer so that only the last update has a partial stripe */
+        while( filled < HASH_BUFFER_SIZE ) {
+            size = read(fd, buffer + filled, HASH_BUFFER_SIZE - filled);
+            if( size == -1 ) {
+                if( errno == EINTR ) continue;
+                result = -errno;
+                break;
+            }
+            if( size == 0 ) break;
+            filled += size;
+        }
+        if( result != 0 ) break;
+        content_hash_update(&h, buffer, filled);
+        if( filled < HASH_BUFFER_SIZE ) break;
+    }
+    free(buffer);
+    close(fd);
+    if( result == 0 ) *hash = content_hash_final(&h);
+    return result;
+}
+
+/*
+ * Compare the content of two files.
+ * Return 1 if identical, 0 if different and a negative errno on error.
+ */
+static int same_content(const char *a, const char *b)
+{
+    unsigned char *buffer;
+    ssize_t size_a, size_b;
+    int fd_a, fd_b;
+    int result = 1;
+
+    fd_a = open(a, O_RDONLY);
+    if( fd_a == -1 ) return -errno;
+    fd_b = open(b, O_RDONLY);
+    if( fd_b == -1 ) {
+        result = -errno;
+        close(fd_a);
+        return result;
+    }
+    buffer = malloc(2 * HASH_BUFFER_SIZE);
+    if( ! buffer ) result = -ENOMEM;
+    while( result == 1 ) {
+        size_a = read(fd_a, buffer, HASH_BUFFER_SIZE);
+        size_b = size_a > 0 ? read(fd_b, buffer + HASH_BUFFER_SIZE, size_a) : 0;
+        if( size_a == -1 || size_b == -1 ) {
+            result = -errno;
+        } else if( size_a != size_b ||
+                   memcmp(buffer, buffer + HASH_BUFFER_SIZE, size_a) != 0 ) {
+            result = 0;
+        } else if( size_a == 0 ) {
+            /* both files ended at the same offset */
+            if( read(fd_b, buffer, 1) != 0 ) result = 0;
+            break;
+        }
+    }
+    free(buffer);
+    close(fd_a);
+    close(fd_b);
+    return result;
+}
+
+/*
+ * Copy the content and the mode of file from to a new file to.
+ */
+static int copy_file(const char *from, const char *to)
+{
+    unsigned char *buffer;
+    struct stat buf;
+    ssize_t size, written;
+    int in, out;
+    int result = 0;
+
+    in = open(from, O_RDONLY);
+    if( in == -1 ) return -errno;
+    if( fstat(in, &buf) == -1 ||
+        (out = open(to, O_WRONLY | O_CREAT | O_TRUNC, buf.st_mode & 07777)) == -1 ) {
+        result = -errno;
+        close(in);
+        return result;
+    }
+    buffer = malloc(HASH_BUFFER_SIZE);
+    if( ! buffer ) result = -ENOMEM;
+    while( result == 0 && (size = read(in, buffer, HASH_BUFFER_SIZE)) != 0 ) {
+        if( size == -1 ) {
+            result = -errno;
+            break;
+        }
+        for( written = 0; written < size; ) {
+            ssize_t n = write(out, buffer + written, size - written);
+            if( n == -1 ) {
+                result = -errno;
+                break;
+            }
+            written += n;
+        }
+    }
+    free(buffer);
+    close(in);
+    if( close(out) == -1 && result == 0 ) result = -errno;
+    if( result != 0 ) unlink(to);
+    return result;
+}
+
+
+/*
+ * Backing files compressed in the Zstandard seekable format: a series
+ * of independent zstd frames followed by a skippable frame holding the
+ * compressed and decompressed size of every frame (the seek table).
+ * Reads only decompress the frames they touch and keep the last ones
+ * in a small cache of the file handle.
+ */
+#define COMPRESSION_NONE 0
+#define COMPRESSION_ZSTD_SEEKABLE 1
+
+#define SEEKABLE_MAGIC 0x8F92EAB1U
+#define SEEKABLE_SKIPPABLE_MAGIC 0x184D2A5EU
+#define SEEKABLE_FOOTER_SIZE 9
+#define SEEKABLE_CHECKSUM_FLAG 0x80
+#define SEEKABLE_FRAME_SIZE (256 << 10) /* frames written by compress_file() */
+#define SEEKABLE_LEVEL 3
+#define SEEKABLE_CACHE_FRAMES 4
+
+struct seekable_frame {
+    uint32_t frame;     /* UINT32_MAX if the slot is empty */
+    uint64_t used;      /* value of seekable.clock when last used */
+    size_t size;
+    void *data;
+};
+
+struct seekable {
+    uint32_t frames;
+    uint64_t *offset;   /* compressed offset of each frame, then end of frames */
+    uint64_t *position; /* decompressed offset of each frame, then total size */
+    ZSTD_DCtx *dctx;
+    void *input;
+    size_t input_size;
+    uint64_t clock;
+    struct seekable_frame cache[SEEKABLE_CACHE_FRAMES];
+};
+
+static inline uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline unsigned char *put_le32(unsigned char *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+    return p + 4;
+}
+
+static void seekable_free(struct seekable *z)
+{
+    int i;
+
+    if( ! z ) return;
+    for( i=0; i<SEEKABLE_CACHE_FRAMES; i++ )
+        free(z->cache[i].data);
+    ZSTD_freeDCtx(z->dctx);
+    free(z->input);
+    free(z->offset);
+    free(z->position);
+    free(z);
+}
+
+/*
+ * Read the seek table of a file. Return -EINVAL if the file is not in
+ * the seekable format.
+ */
+static int seekable_open(int fd, struct seekable **result)
+{
+    unsigned char footer[SEEKABLE_FOOTER_SIZE];
+    unsigned char *table = NULL;
+    struct seekable *z;
+    struct stat buf;
+    uint64_t table_size, entry_size;
+    uint32_t i;
+
+    *result = NULL;
+    if( fstat(fd, &buf) == -1 ) return -errno;
+    if( buf.st_size < 8 + SEEKABLE_FOOTER_SIZE ) return -EINVAL;
+    if( pread(fd, footer, sizeof(footer), buf.st_size - sizeof(footer)) != sizeof(footer) )
         return -EIO;
+    if( get_le32(footer + 5) != SEEKABLE_MAGIC || (footer[4] & 0x7c) != 0 )
+        return -EINVAL;
+    entry_size = (footer[4] & SEEKABLE_CHECKSUM_FLAG) ? 12 : 8;
+    table_size = 8 + get_le32(footer) * entry_size + SEEKABLE_FOOTER_SIZE;
+    if( table_size > (uint64_t) buf.st_size ) return -EINVAL;
+
+    z = calloc(1, sizeof(*z));
+    if( ! z ) return -ENOMEM;
+    z->frames = get_le32(footer);
+    z->offset = malloc((z->frames + 1) * sizeof(uint64_t));
+    z->position = malloc((z->frames + 1) * sizeof(uint64_t));
+    table = malloc(table_size);
+    if( ! z->offset || ! z->position || ! table ) {
+        free(table);
+        seekable_free(z);
+        return -ENOMEM;
     }
-    rc = sqlite3_step(query);
-    if( rc == SQLITE_DONE ) {
+    if( pread(fd, table, table_size, buf.st_size - table_size) != table_size ) {
+        free(table);
+        seekable_free(z);
+        return -EIO;
+    }
+    if( get_le32(table) != SEEKABLE_SKIPPABLE_MAGIC ||
+        get_le32(table + 4) != table_size - 8 ) {
+        free(table);
+        seekable_free(z);
+        return -EINVAL;
+    }
+    z->offset[0] = z->position[0] = 0;
+    for( i=0; i<z->frames; i++ ) {
+        const unsigned char *entry = table + 8 + i * entry_size;
+        z->offset[i + 1] = z->offset[i] + get_le32(entry);
+        z->position[i + 1] = z->position[i] + get_le32(entry + 4);
+        if( get_le32(entry) > z->input_size ) z->input_size = get_le32(entry);
+    }
+    free(table);
+    if( z->offset[z->frames] != buf.st_size - table_size ) {
+        seekable_free(z);
+        return -EINVAL;
+    }
+    for( i=0; i<SEEKABLE_CACHE_FRAMES; i++ )
+        z->cache[i].frame = UINT32_MAX;
+    *result = z;
+    return 0;
+}
+
+static inline uint64_t seekable_size(const struct seekable *z)
+{
+    return z->position[z->frames];
+}
+
+/*
+ * Return the decompressed content of a frame from the cache, reading
+ * and decompressing it if needed.
+ */
+static const void *seekable_frame(int fd, struct seekable *z, uint32_t frame, int *error)
+{
+    struct seekable_frame *slot = &z->cache[0];
+    size_t compressed = z->offset[frame + 1] - z->offset[frame];
+    size_t size = z->position[frame + 1] - z->position[frame];
+    size_t decompressed;
+    int i;
+
+    for( i=0; i<SEEKABLE_CACHE_FRAMES; i++ ) {
+        if( z->cache[i].frame == frame ) {
+            z->cache[i].used = ++z->clock;
+            return z->cache[i].data;
+        }
+        if( z->cache[i].used < slot->used ) slot = &z->cache[i];
+    }
+    if( ! z->dctx ) z->dctx = ZSTD_createDCtx();
+    if( ! z->input ) z->input = malloc(z->input_size);
+    if( size > slot->size ) {
+        free(slot->data);
+        slot->data = malloc(size);
+        slot->size = slot->data ? size : 0;
+    }
+    slot->frame = UINT32_MAX;
+    if( ! z->dctx || ! z->input || ! slot->data ) {
+        *error = -ENOMEM;
+        return NULL;
+    }
+    if( pread(fd, z->input, compressed, z->offset[frame]) != compressed ) {
+        *error = -EIO;
+        return NULL;
+    }
+    decompressed = ZSTD_decompressDCtx(z->dctx, slot->data, size, z->input, compressed);
+    if( ZSTD_isError(decompressed) || decompressed != size ) {
+#ifdef DEBUG
+        fprintf(stderr, "cannot decompress frame %u: %s\n", frame,
+                ZSTD_getErrorName(decompressed));
+#endif
+        *error = -EIO;
+        return NULL;
+    }
+    slot->frame = frame;
+    slot->used = ++z->clock;
+    return slot->data;
+}
+
+/*
+ * Index of the last frame starting at or before offset.
+ */
+static uint32_t seekable_find(const struct seekable *z, uint64_t offset)
+{
+    uint32_t low = 0, high = z->frames;
+
+    while( high - low > 1 ) {
+        uint32_t middle = (low + high) / 2;
+        if( z->position[middle] <= offset ) low = middle;
+        else high = middle;
+    }
+    return low;
+}
+
+/*
+ * Offset in the compressed file of the frame holding offset.
+ */
+static uint64_t seekable_offset(const struct seekable *z, uint64_t offset)
+{
+    if( offset >= seekable_size(z) ) return z->offset[z->frames];
+    return z->offset[seekable_find(z, offset)];
+}
+
+/*
+ * pread() of the decompressed content.
+ */
+static ssize_t seekable_pread(int fd, struct seekable *z, char *buf, size_t size, off_t offset)
+{
+    uint32_t low;
+    size_t done = 0;
+    int error = 0;
+
+    if( offset >= seekable_size(z) ) return 0;
+    if( size > seekable_size(z) - offset ) size = seekable_size(z) - offset;
+    low = seekable_find(z, offset);
+    while( done < size ) {
+        const char *data = seekable_frame(fd, z, low, &error);
+        size_t start = offset + done - z->position[low];
+        size_t count = z->position[low + 1] - z->position[low] - start;
+
+        if( ! data ) return done ? done : error;
+        if( count > size - done ) count = size - done;
+        memcpy(buf + done, data + start, count);
+        done += count;
+        ++low;
+    }
+    return done;
+}
+
+/*
+ * Return in size the decompressed size of path if it is in the
+ * seekable format.
+ */
+static int seekable_probe(const char *path, uint64_t *size)
+{
+    struct seekable *z;
+    int fd;
+    int result;
+
+    fd = open(path, O_RDONLY);
+    if( fd == -1 ) return -errno;
+    result = seekable_open(fd, &z);
+    if( result == 0 ) {
+        *size = seekable_size(z);
+        seekable_free(z);
+    }
+    close(fd);
+    return result;
+}
+
+static ssize_t read_full(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+    ssize_t count;
+
+    while( done < size ) {
+        count = read(fd, (char *) buf + done, size - done);
+        if( count == -1 ) {
+            if( errno == EINTR ) continue;
+            return -1;
+        }
+        if( count == 0 ) break;
+        done += count;
+    }
+    return done;
+}
+
+static int write_full(int fd, const void *buf, size_t size)
+{
+    size_t done = 0;
+    ssize_t count;
+
+    while( done < size ) {
+        count = write(fd, (const char *) buf + done, size - done);
+        if( count == -1 ) {
+            if( errno == EINTR ) continue;
+            return -errno;
+        }
+        done += count;
+    }
+    return 0;
+}
+
+/*
+ * Write a compressed copy of from in the seekable format.
+ */
+static int compress_file(const char *from, const char *to)
+{
+    unsigned char *input = NULL, *output = NULL, *table = NULL, *entry;
+    size_t output_size = ZSTD_compressBound(SEEKABLE_FRAME_SIZE);
+    size_t table_size = 0;
+    uint32_t frames = 0;
+    ZSTD_CCtx *cctx = NULL;
+    struct stat buf;
+    ssize_t size;
+    size_t compressed;
+    int in, out;
+    int result = 0;
+
+    in = open(from, O_RDONLY);
+    if( in == -1 ) return -errno;
+    if( fstat(in, &buf) == -1 ||
+        (out = open(to, O_WRONLY | O_CREAT | O_TRUNC, buf.st_mode & 07777)) == -1 ) {
+        result = -errno;
+        close(in);
+        return result;
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    input = malloc(SEEKABLE_FRAME_SIZE);
+    output = malloc(output_size);
+    table_size = 8 * (buf.st_size / SEEKABLE_FRAME_SIZE + 1);
+    table = malloc(8 + table_size + SEEKABLE_FOOTER_SIZE);
+    cctx = ZSTD_createCCtx();
+    if( ! input || ! output || ! table || ! cctx ) result = -ENOMEM;
+    if( result == 0 ) {
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, SEEKABLE_LEVEL);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    }
+    while( result == 0 && (size = read_full(in, input, SEEKABLE_FRAME_SIZE)) != 0 ) {
+        if( size == -1 ) {
+            result = -errno;
+            break;
+        }
+        if( 8 * (frames + 1) > table_size ) {
+            /* the file grew since fstat() */
+            table_size *= 2;
+            entry = realloc(table, 8 + table_size + SEEKABLE_FOOTER_SIZE);
+            if( ! entry ) {
+                result = -ENOMEM;
+                break;
+            }
+            table = entry;
+        }
+        compressed = ZSTD_compress2(cctx, output, output_size, input, size);
+        if( ZSTD_isError(compressed) ) {
+            result = -EIO;
+            break;
+        }
+        result = write_full(out, output, compressed);
+        entry = table + 8 + 8 * frames++;
+        entry = put_le32(entry, compressed);
+        put_le32(entry, size);
+    }
+    if( result == 0 ) {
+        entry = table + 8 + 8 * frames;
+        put_le32(table, SEEKABLE_SKIPPABLE_MAGIC);
+        put_le32(table + 4, 8 * frames + SEEKABLE_FOOTER_SIZE);
+        entry = put_le32(entry, frames);
+        *entry++ = 0;   /* no checksums in the table, frames have their own */
+        put_le32(entry, SEEKABLE_MAGIC);
+        result = write_full(out, table, 8 + 8 * frames + SEEKABLE_FOOTER_SIZE);
+    }
+    ZSTD_freeCCtx(cctx);
+    free(input);
+    free(output);
+    free(table);
+    close(in);
+    if( close(out) == -1 && result == 0 ) result = -errno;
+    if( result != 0 ) unlink(to);
+    return result;
+}
+
+
+/*
+ * Stop the thread serving the control sockets (see control_start()).
+ */
+static void control_join(struct catifs_mount *mount)
+{
+    if( ! mount->control_running ) return;
+    if( write(mount->control_pipe[1], "", 1) == 1 )
+        pthread_join(mount->control, NULL);
+    mount->control_running = 0;
+}
+
+static void *catifs_init(struct fuse_conn_info *conn,
+		         struct fuse_config *cfg)
+{
+    (void) conn;
+
+    /* Pick up changes from lower filesystem right away. This is
+        also necessary for better hardlink support. When the kernel
+        calls the unlink() handler, it does not know the inode of
+        the to-be-removed entry and can therefore not invalidate
+        the cache of the associated inode - resulting in an
+        incorrect st_nlink value being reported for any remaining
+        hardlinks to this inode. */
+    cfg->entry_timeout = 0;
+    cfg->attr_timeout = 0;
+    cfg->negative_timeout = 0;
+
+    /* Used by the control socket thread to invalidate entries */
+    ((struct catifs_mount *) fuse_get_context()->private_data)->fuse =
+        fuse_get_context()->fuse;
+    return fuse_get_context()->private_data;
+}
+
+static void catifs_destroy(void *private_data)
+{
+    struct catifs_mount *mount = private_data;
+    int i;
+#ifdef debug
+    fpfrinf(stderr, "Closing database\n");
+#endif
+    control_join(mount);
+    for( i=0; i<mount->count; i++ ) {
+        bloom_free(&mount->shards[i].fs.bloom);
+        sqlite3_close(mount->shards[i].fs.db);
+    }
+}
+
+static int cati_getattr(const char *path, struct stat *buf,
+			struct fuse_file_info *fi)
+{
+    (void) fi;
+    struct catifs *fs;
+    const char *local;
+    int result;
+    
+    memset(buf, 0, sizeof(*buf));
+    fs = route(path, &local);
+    if( strcmp(path, "/")==0 || (fs && strcmp(local, "/")==0) ){
+        buf->st_mode = S_IFDIR | 0755;
+        buf->st_nlink = 2;
+        return 0;
+    }
+    /* Shards merged at the root are tried in order */
+    for( result = -ENOENT; fs && result == -ENOENT; fs = route_next(fs) ) {
+        if( ! bloom_may_contain(fs, local) ) continue;
+        result = load_stat(fs, local, buf);
+        if( result == -ENOENT && fs->bloom.bits ) {
+            ++fs->bloom.false_positives;
+        }
+    }
+    if( result == -ENOENT && is_prefix_ancestor(path) ) {
+        /* Directory only existing as part of the prefix of a shard */
+        buf->st_mode = S_IFDIR | 0755;
+        buf->st_nlink = 2;
         result = 0;
-    } else {
+    }
+    return result;
+}
+
+// static int catifs_access(const char *path, int mask)
+// {
+//     sqlite3 *db;
+//     
+//     db = get_catifs()->db;
+//     
+// 	int res;
+// 
+// 	res = access(path, mask);
+// 	if (res == -1)
+// 		return -errno;
+// 
+// 	return 0;
+// }
+
+static int add_path_to_database(struct catifs *fs, const char *from, const char *to)
+{
+    sqlite3 *db = fs->db;
+    struct stat buf;
+    int rc;
+    sqlite3_stmt *query;
+    int result;
+    int compression = COMPRESSION_NONE;
+    uint64_t size = 0;
+    
+    if (stat(from, &buf) == -1)
+        return -errno;
+    if( S_ISREG(buf.st_mode) && seekable_probe(from, &size) == 0 ) {
+        /* The catalogue gives the decompressed size */
+        buf.st_size = size;
+        compression = COMPRESSION_ZSTD_SEEKABLE;
+    }
+
+    if( db_begin(db) != 0 ) return -EIO;
+    rc = sqlite3_prepare_v2(db, stat_insert[fs->compact], -1, &query, 0);
+    if( rc != SQLITE_OK ) {
 #ifdef DEBUG
-        fprintf(stderr, "chmod SQL error: %s\n", sqlite3_errmsg(db));
+        fprintf(stderr, "symlink cannot prepare SQL query: %s\n", sqlite3_errmsg(db));
 #endif
-        result = -ENOENT;
+        return db_end(db, -EIO);
+    }
+    
+    sqlite3_bind_text(query, 1, to, -1, SQLITE_STATIC);
+    sqlite3_bind_text(query, 2, from, -1, SQLITE_STATIC);
+    stat_bind(fs, query, &buf);
+    if ( sqlite3_step(query) == SQLITE_DONE)
+        result = 0;
+    else {
+#ifdef DEBUG
+        fprintf(stderr, "symlink insert item in database: %s\n", sqlite3_errmsg(db));
+#endif
+        result = -EIO;
+    }
+    sqlite3_finalize(query);
+    if( result == 0 && compression != COMPRESSION_NONE ) {
+        rc = sqlite3_prepare_v2(db,
+                "UPDATE catifs SET compression=?2 WHERE path=?1", -1, &query, 0);
+        if( rc != SQLITE_OK ) {
+            result = -EIO;
+        } else {
+            sqlite3_bind_text(query, 1, to, -1, SQLITE_STATIC);
+            sqlite3_bind_int(query, 2, compression);
+            if( sqlite3_step(query) != SQLITE_DONE ) result = -EIO;
+            sqlite3_finalize(query);
+        }
+    }
+    if( result == 0 ) {
+        if( S_ISDIR(buf.st_mode) )
+            result = tree_update(db, to, 0, 0, 1);
+        else
+            result = tree_update(db, to, buf.st_size, 1, 0);
+    }
+    if( result == 0 ) result = change_log(db, CHANGE_ADD, to, NULL);
+    result = db_end(db, result);
+    if( result == 0 ) bloom_insert(fs, to);
+    return result;
+}
+
+/*
+ * Stat fields of a new entry without backing file.
+ */
+static void entry_stat(struct stat *buf, mode_t mode, off_t size, uid_t uid, gid_t gid)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(buf, 0, sizeof(*buf));
+    buf->st_mode = mode;
+    buf->st_nlink = S_ISDIR(mode) ? 2 : 1;
+    buf->st_uid = uid;
+    buf->st_gid = gid;
+    buf->st_size = size;
+    buf->st_blksize = 4096;
+    buf->st_atim = buf->st_mtim = buf->st_ctim = now;
+}
+
+/*
+ * Add an entry that only exists in the catalogue (a directory, or a
+ * symbolic link to target) with a single INSERT. Return -EEXIST if path
+ * exists.
+ */
+static int add_entry(struct catifs *fs, const char *path, const struct stat *buf,
+                     const char *target)
+{
+    sqlite3 *db = fs->db;
+    sqlite3_stmt *query;
+    int result = 0;
+
+    if( db_begin(db) != 0 ) return -EIO;
+    if( sqlite3_prepare_v2(db, entry_insert[fs->compact], -1, &query, 0) != SQLITE_OK ) {
+#ifdef DEBUG
+        fprintf(stderr, "cannot prepare SQL query: %s\n", sqlite3_errmsg(db));
+#endif
+        return db_end(db, -EIO);
+    }
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    if( target ) sqlite3_bind_text(query, 2, target, -1, SQLITE_STATIC);
+    stat_bind(fs, query, buf);
+    if( sqlite3_step(query) != SQLITE_DONE )
+        result = -EIO;
+    else if( sqlite3_changes(db) == 0 )
+        result = -EEXIST;
+    sqlite3_finalize(query);
+    if( result == 0 ) {
+        if( S_ISDIR(buf->st_mode) )
+            result = tree_update(db, path, 0, 0, 1);
+        else
+            result = tree_update(db, path, buf->st_size, 1, 0);
+    }
+    if( result == 0 ) result = change_log(db, CHANGE_ADD, path, NULL);
+    result = db_end(db, result);
+    if( result == 0 ) bloom_insert(fs, path);
+    return result;
+}
+
+/*
+ * Create the directory path and its missing ancestors (mkdir -p) in one
+ * transaction. Existing directories are not an error.
+ */
+static int make_dirs(struct catifs *fs, const char *path, mode_t mode, uid_t uid, gid_t gid)
+{
+    struct stat buf;
+    char *dir, *slash;
+    size_t len = strlen(path);
+    mode_t existing;
+    int result = 0;
+
+    while( len > 1 && path[len - 1] == '/' ) --len;
+    if( path[0] != '/' || memmem(path, len, "//", 2) ) return -EINVAL;
+    dir = strndup(path, len);
+    if( ! dir ) return -ENOMEM;
+    entry_stat(&buf, S_IFDIR | (mode & 07777), 0, uid, gid);
+    if( db_begin(fs->db) != 0 ) {
+        free(dir);
+        return -EIO;
+    }
+    for( slash = dir; slash && result == 0; ) {
+        slash = strchr(slash + 1, '/');
+        if( slash ) *slash = 0;
+        if( dir[1] ) {
+            result = add_entry(fs, dir, &buf, NULL);
+            if( result == -EEXIST ) {
+                result = path_entry(fs->db, dir, NULL, &existing, NULL);
+                if( result == 0 && ! S_ISDIR(existing) ) result = -ENOTDIR;
+            }
+        }
+        if( slash ) *slash = '/';
+    }
+    free(dir);
+    return db_end(fs->db, result);
+}
+
+/*
+ * Directory handle stored in fuse_file_info. Entries are listed in path
+ * order with a keyset cursor: each readdir call resumes after the last
+ * path given to filler, so the listing is never built in memory and no
+ * read transaction is kept open between calls. Each batch seeks to
+ * the next child on idx_catifs_parent. The offset given to filler for an
+ * entry is its rowid + 2 (1 and 2 are "." and "..").
+ */
+struct catifs_dir {
+    struct catifs *fs;
+    sqlite3_stmt *query;
+    char *lower;        /* "<path>/", lower bound of the listing */
+    char *upper;        /* "<path>0", upper bound of the listing */
+    off_t offset;       /* offset of the last entry given to filler */
+    char *last;         /* path of the last entry given to filler */
+    size_t last_size;
+    int has_row;        /* query is on the next entry (see dir_merge_next()) */
+    /* Directory merged from several shards (query is NULL): the cursors
+       of the shards are merged by name with the names of the shard
+       prefixes below the directory. last is a name and offsets are
+       consecutive from 3. */
+    struct catifs_dir **parts;
+    size_t count;
+    char **prefixes;    /* sorted */
+    size_t prefix_count;
+    size_t prefix_next; /* first prefix not merged yet */
+    char *name;         /* name of the entry given by dir_merge_next() */
+    size_t name_size;
+};
+
+static void dir_free(struct catifs_dir *dir)
+{
+    size_t i;
+
+    if( ! dir ) return;
+    sqlite3_finalize(dir->query);
+    free(dir->lower);
+    free(dir->upper);
+    free(dir->last);
+    for( i=0; i<dir->count; i++ )
+        dir_free(dir->parts[i]);
+    free(dir->parts);
+    for( i=0; i<dir->prefix_count; i++ )
+        free(dir->prefixes[i]);
+    free(dir->prefixes);
+    free(dir->name);
+    free(dir);
+}
+
+static struct catifs_dir *dir_open(struct catifs *fs, const char *path)
+{
+    struct catifs_dir *dir;
+    size_t len;
+    int rc;
+
+    if( strcmp(path, "/")==0 ){
+        path = "";
+    }
+    dir = calloc(1, sizeof(struct catifs_dir));
+    if( ! dir ) return NULL;
+    dir->fs = fs;
+    len = strlen(path);
+    dir->lower = malloc(len + 2);
+    dir->upper = malloc(len + 2);
+    if( ! dir->lower || ! dir->upper ) {
+        dir_free(dir);
+        return NULL;
+    }
+    memcpy(dir->lower, path, len);
+    strcpy(dir->lower + len, "/");
+    memcpy(dir->upper, path, len);
+    strcpy(dir->upper + len, "0"); /* '0' is the character after '/' */
+
+    /* A range of idx_catifs_parent, the bounds on path are also used by
+       the history of snapshots (see snapshot_open()) */
+    rc = sqlite3_prepare_v2(fs->db,
+            STAT_SELECT(fs, ", path, rowid FROM catifs WHERE "
+                PARENT("path") " = ?3 AND path > ?1 AND path < ?2 ORDER BY path"),
+            -1, &dir->query, 0);
+    if( rc != SQLITE_OK ) {
+#ifdef DEBUG
+        fprintf(stderr, "opendir cannot prepare SQL query: %s\n", sqlite3_errmsg(fs->db));
+#endif
+        dir_free(dir);
+        return NULL;
+    }
+    sqlite3_bind_text(dir->query, 2, dir->upper, -1, SQLITE_STATIC);
+    sqlite3_bind_text(dir->query, 3, dir->lower, len, SQLITE_STATIC);
+    return dir;
+}
+
+/*
+ * Remember the path of the last entry given to filler.
+ */
+static int dir_set_last(struct catifs_dir *dir, const char *path, off_t offset)
+{
+    size_t size = strlen(path) + 1;
+
+    if( size > dir->last_size ) {
+        char *last = realloc(dir->last, size);
+        if( ! last ) return -ENOMEM;
+        dir->last = last;
+        dir->last_size = size;
+    }
+    memcpy(dir->last, path, size);
+    dir->offset = offset;
+    return 0;
+}
+
+/*
+ * Find the path to resume the listing after the entry at offset. If the
+ * row of offset was removed (or its rowid reused by another path) the
+ * listing resumes after the last entry given to filler, -ENOENT is
+ * returned if there is none.
+ */
+static int dir_seek(sqlite3 *db, struct catifs_dir *dir, off_t offset)
+{
+    sqlite3_stmt *query;
+    const char *path;
+    size_t len = strlen(dir->lower);
+    int result = -ENOENT;
+
+    if( offset <= 2 ) return dir_set_last(dir, dir->lower, offset);
+    if( dir->last && dir->offset == offset ) return 0;
+    if( sqlite3_prepare_v2(db, "SELECT path FROM catifs WHERE rowid=?1",
+                           -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    sqlite3_bind_int64(query, 1, offset - 2);
+    if( sqlite3_step(query) == SQLITE_ROW ) {
+        path = (const char *) sqlite3_column_text(query, 0);
+        /* Only a child of this directory */
+        if( strncmp(path, dir->lower, len) == 0 && path[len] && ! strchr(path + len, '/') )
+            result = dir_set_last(dir, path, offset);
+    }
+    sqlite3_finalize(query);
+    if( result == -ENOENT && dir->last ) result = 0;
+    return result;
+}
+
+static int dir_name_compare(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Open a directory of the mount. A directory found in a single shard
+ * is listed with a cursor (see dir_open()). A directory present in
+ * several shards merged at the root, or containing shard prefixes, has
+ * a cursor per shard merged by name (see dir_merge_next()).
+ */
+static struct catifs_dir *dir_open_union(const char *path)
+{
+    struct catifs_mount *mount = get_mount();
+    struct catifs_dir *dir, *part;
+    struct catifs *fs;
+    const char *local;
+    size_t len, i, k;
+    size_t count = 0, prefixes = 0;
+
+    fs = route(path, &local);
+    len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+    for( i=0; i<mount->count; i++ ) {
+        const struct catifs_shard *shard = &mount->shards[i];
+        if( shard->prefix_len > len && strncmp(shard->prefix, path, len) == 0 &&
+            shard->prefix[len] == '/' )
+            ++prefixes;
+        else if( shard->prefix_len == 0 )
+            ++count;
+    }
+    /* route() only changes the path of shards with a prefix */
+    if( fs && local != path ) count = 1;
+    if( count + prefixes == 1 && fs ) return dir_open(fs, local);
+
+    dir = calloc(1, sizeof(*dir));
+    if( ! dir ) return NULL;
+    dir->parts = calloc(count + 1, sizeof(*dir->parts));
+    dir->prefixes = calloc(prefixes + 1, sizeof(*dir->prefixes));
+    if( ! dir->parts || ! dir->prefixes ) {
+        dir_free(dir);
+        return NULL;
+    }
+    for( i=0; i<mount->count && dir->count<count; i++ ) {
+        if( fs && local != path )
+            part = dir_open(fs, local);
+        else if( mount->shards[i].prefix_len == 0 )
+            part = dir_open(&mount->shards[i].fs, path);
+        else
+            continue;
+        if( ! part ) {
+            dir_free(dir);
+            return NULL;
+        }
+        dir->parts[dir->count++] = part;
+    }
+    for( i=0; i<mount->count; i++ ) {
+        const struct catifs_shard *shard = &mount->shards[i];
+        if( shard->prefix_len > len && strncmp(shard->prefix, path, len) == 0 &&
+            shard->prefix[len] == '/' ) {
+            char *name = strndup(shard->prefix + len + 1, strcspn(shard->prefix + len + 1, "/"));
+            if( ! name ) {
+                dir_free(dir);
+                return NULL;
+            }
+            dir->prefixes[dir->prefix_count++] = name;
+        }
+    }
+    /* Several prefixes below the same entry give one name */
+    qsort(dir->prefixes, dir->prefix_count, sizeof(*dir->prefixes), dir_name_compare);
+    for( i=0, k=0; i<dir->prefix_count; i++ ) {
+        if( k > 0 && strcmp(dir->prefixes[i], dir->prefixes[k - 1]) == 0 )
+            free(dir->prefixes[i]);
+        else
+            dir->prefixes[k++] = dir->prefixes[i];
+    }
+    dir->prefix_count = k;
+    return dir;
+}
+
+/*
+ * End the statements of the shards of a merged directory so that they
+ * do not hold a read transaction between two calls.
+ */
+static void dir_merge_reset(struct catifs_dir *dir)
+{
+    size_t i;
+
+    for( i=0; i<dir->count; i++ ) {
+        sqlite3_reset(dir->parts[i]->query);
+        dir->parts[i]->has_row = 0;
+    }
+}
+
+/*
+ * Position the shards of a merged directory on their first entry after
+ * the name dir->last, or on their first entry if it is NULL.
+ */
+static int dir_merge_start(struct catifs_dir *dir)
+{
+    struct catifs_dir *part;
+    char *after;
+    size_t i;
+    int rc;
+
+    for( i=0; i<dir->count; i++ ) {
+        part = dir->parts[i];
+        after = sqlite3_mprintf("%s%s", part->lower, dir->last ? dir->last : "");
+        if( ! after ) return -ENOMEM;
+        sqlite3_reset(part->query);
+        sqlite3_bind_text(part->query, 1, after, -1, sqlite3_free);
+        rc = sqlite3_step(part->query);
+        if( rc != SQLITE_ROW && rc != SQLITE_DONE ) {
+#ifdef DEBUG
+            fprintf(stderr, "readdir cannot list shard: %s\n", sqlite3_errmsg(part->fs->db));
+#endif
+            return -EIO;
+        }
+        part->has_row = rc == SQLITE_ROW;
+    }
+    dir->prefix_next = 0;
+    while( dir->last && dir->prefix_next < dir->prefix_count &&
+           strcmp(dir->prefixes[dir->prefix_next], dir->last) <= 0 )
+        ++dir->prefix_next;
+    return 0;
+}
+
+static inline const char *dir_part_name(const struct catifs_dir *part)
+{
+    return (const char *) sqlite3_column_text(part->query, STAT_NCOLUMNS(part->fs)) +
+           strlen(part->lower);
+}
+
+/*
+ * Next entry of a merged directory: its name is copied to dir->name,
+ * fs and rowid give its row (fs is NULL for a shard prefix). On
+ * duplicate names the first shard of the command line wins, then the
+ * shard prefixes. Return 1, 0 at the end of the listing or -errno.
+ */
+static int dir_merge_next(struct catifs_dir *dir, struct stat *st,
+                          struct catifs **fs, sqlite3_int64 *rowid)
+{
+    struct catifs_dir *part, *best = NULL;
+    const char *name = NULL;
+    size_t i, size;
+    int rc;
+
+    for( i=0; i<dir->count; i++ ) {
+        part = dir->parts[i];
+        if( part->has_row && (! name || strcmp(dir_part_name(part), name) < 0) ) {
+            best = part;
+            name = dir_part_name(part);
+        }
+    }
+    if( dir->prefix_next < dir->prefix_count &&
+        (! name || strcmp(dir->prefixes[dir->prefix_next], name) < 0) ) {
+        best = NULL;
+        name = dir->prefixes[dir->prefix_next];
+    }
+    if( ! name ) return 0;
+    size = strlen(name) + 1;
+    if( size > dir->name_size ) {
+        char *grown = realloc(dir->name, size);
+        if( ! grown ) return -ENOMEM;
+        dir->name = grown;
+        dir->name_size = size;
+    }
+    memcpy(dir->name, name, size);
+    if( best ) {
+        stat_decode(best->fs, best->query, 0, st);
+        *fs = best->fs;
+        *rowid = sqlite3_column_int64(best->query, STAT_NCOLUMNS(best->fs) + 1);
+    } else {
+        memset(st, 0, sizeof(*st));
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        *fs = NULL;
+        *rowid = 0;
+    }
+    /* Move every shard on this name to its next entry */
+    for( i=0; i<dir->count; i++ ) {
+        part = dir->parts[i];
+        if( ! part->has_row || strcmp(dir_part_name(part), dir->name) != 0 ) continue;
+        rc = sqlite3_step(part->query);
+        if( rc != SQLITE_ROW && rc != SQLITE_DONE ) return -EIO;
+        part->has_row = rc == SQLITE_ROW;
+    }
+    if( dir->prefix_next < dir->prefix_count &&
+        strcmp(dir->prefixes[dir->prefix_next], dir->name) == 0 )
+        ++dir->prefix_next;
+    return 1;
+}
+
+/*
+ * Find the name of the entry at offset in a merged directory. Offsets
+ * other than the one of the last entry given are found by listing the
+ * directory from the start. Return -ENOENT if the listing is shorter.
+ */
+static int dir_merge_seek(struct catifs_dir *dir, off_t offset)
+{
+    struct catifs *fs;
+    sqlite3_int64 rowid;
+    struct stat st;
+    int result;
+
+    if( dir->last && dir->offset == offset ) return 0;
+    free(dir->last);
+    dir->last = NULL;
+    dir->last_size = 0;
+    dir->offset = 2;
+    if( offset <= 2 ) return 0;
+    result = dir_merge_start(dir);
+    while( result == 0 && dir->offset < offset ) {
+        result = dir_merge_next(dir, &st, &fs, &rowid);
+        if( result == 1 )
+            result = dir_set_last(dir, dir->name, dir->offset + 1);
+        else if( result == 0 )
+            result = -ENOENT;
+    }
+    dir_merge_reset(dir);
+    return result;
+}
+
+static inline struct catifs_dir *get_dirp(struct fuse_file_info *fi)
+{
+	return (struct catifs_dir *) (uintptr_t) fi->fh;
+}
+
+static int catifs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    struct catifs_dir *dir;
+
+    dir = dir_open_union(path);
+    if( ! dir ) return -EIO;
+    fi->fh = (uintptr_t) dir;
+    return 0;
+}
+
+static int catifs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		          off_t offset, struct fuse_file_info *fi,
+		          enum fuse_readdir_flags flags)
+{
+    struct catifs *fs;
+    struct catifs_dir *dir;
+    sqlite3_stmt *query;
+    int rc;
+    sqlite3 *db;
+    struct stat stbuf;
+    int result = 0;
+#ifdef DEBUG
+    int count = 0;
+#endif
+    
+    dir = fi ? get_dirp(fi) : NULL;
+    if( ! dir ) {
+        /* No handle from opendir, list the directory in a single call */
+        dir = dir_open_union(path);
+        if( ! dir ) return -EIO;
+    }
+    fs = dir->fs;
+    query = dir->query;
+
+    if( offset < 1 && filler(buf, ".", NULL, 1, 0) ) goto done;
+    if( offset < 2 && filler(buf, "..", NULL, 2, 0) ) goto done;
+    if( ! query ) {
+        struct catifs *part;
+        sqlite3_int64 rowid;
+
+        result = dir_merge_seek(dir, offset);
+        if( result == 0 ) result = dir_merge_start(dir);
+        while( result == 0 && (result = dir_merge_next(dir, &stbuf, &part, &rowid)) == 1 ) {
+            if( filler(buf, dir->name, &stbuf, dir->offset + 1, 0) ) {
+                /* Buffer is full, next call resumes after dir->last */
+                result = 0;
+                break;
+            }
+            result = dir_set_last(dir, dir->name, dir->offset + 1);
+        }
+        /* Offset past the end of the listing */
+        if( result == -ENOENT ) result = 0;
+        dir_merge_reset(dir);
+        goto done;
+    }
+    db = fs->db;
+    result = dir_seek(db, dir, offset);
+    if( result == -ENOENT ) {
+        /* Unknown offset without a previous batch on this handle */
+        result = 0;
+        goto done;
+    }
+    if( result != 0 ) goto done;
+    rc = sqlite3_bind_text(query, 1, dir->last, -1, SQLITE_TRANSIENT);
+    if( rc != SQLITE_OK ) {
+#ifdef DEBUG
+        fprintf(stderr, "readdir bind path to SQL query: %s\n", sqlite3_errmsg(db));
+#endif
+        result = -EIO;
+        goto done;
+    }
+#ifdef DEBUG
+    char *sql = sqlite3_expanded_sql(query);
+    fprintf(stderr, "readdir using SQL query: %s ; %s\n", path, sql);
+    sqlite3_free(sql);
+#endif
+    memset(&stbuf, 0, sizeof(stbuf));
+    const int dir_len = strlen(dir->lower);
+    for( rc = sqlite3_step(query); rc == SQLITE_ROW; rc = sqlite3_step(query) ) {
+        const int ncolumns = STAT_NCOLUMNS(fs);
+        const char *entry = (const char *) sqlite3_column_text(query, ncolumns);
+        off_t entry_offset = sqlite3_column_int64(query, ncolumns + 1) + 2;
+
+        stat_decode(fs, query, 0, &stbuf);
+        if( filler(buf, entry + dir_len, &stbuf, entry_offset, 0) ) {
+            /* Buffer is full, next call resumes after dir->last */
+            rc = SQLITE_DONE;
+            break;
+        }
+        result = dir_set_last(dir, entry, entry_offset);
+        if( result != 0 ) break;
+#ifdef DEBUG
+        fprintf(stderr, "readdir ->: %s\n", entry + dir_len);
+        ++count;
+#endif
+    }
+    if ( rc != SQLITE_DONE ) {
+#ifdef DEBUG
+        fprintf(stderr, "readdir cannot query database: %s (%d)\n", sqlite3_errmsg(db), rc);
+#endif
+        result = -EIO;
+    } else {
+#ifdef DEBUG
+        fprintf(stderr, "readdir successful: %d entries\n", count);
+#endif
+    }
+done:
+    /* Release the read transaction until the next batch */
+    if( query ) sqlite3_reset(query);
+    if( ! fi || dir != get_dirp(fi) ) dir_free(dir);
+    return result;
+}
+
+static int catifs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+    dir_free(get_dirp(fi));
+    fi->fh = 0;
+    return 0;
+}
+
+/*
+ * Directory pages of CATIFS_IOC_DIR_PAGE (see cati_fs_ioctl.h). An
+ * entry is written after the last complete one and only counted once
+ * it is complete, an entry that does not fit is left for the next page.
+ */
+struct dir_page_writer {
+    struct catifs_dir_page *page;
+    unsigned char *p;       /* end of the entry being written */
+    int full;               /* the entry being written does not fit */
+};
+
+static void page_put(struct dir_page_writer *w, int64_t value)
+{
+    if( w->full || w->page->data + sizeof(w->page->data) - w->p < 10 ) {
+        w->full = 1;
+        return;
+    }
+    w->p = varint_put(w->p, value);
+}
+
+/* extra is 1 for attribute names (0 ends the list of attributes) */
+static void page_put_text(struct dir_page_writer *w, const void *text, int size, int extra)
+{
+    page_put(w, size + extra);
+    if( w->full || w->page->data + sizeof(w->page->data) - w->p < size ) {
+        w->full = 1;
+        return;
+    }
+    memcpy(w->p, text, size);
+    w->p += size;
+}
+
+static void page_entry_start(struct dir_page_writer *w, const char *name, const struct stat *st)
+{
+    unsigned char record[STAT_RECORD_MAX];
+    int size = stat_pack_buf(st, record);
+
+    w->p = w->page->data + w->page->size;
+    w->full = 0;
+    page_put_text(w, name, strlen(name), 0);
+    page_put(w, st->st_ino);
+    page_put(w, st->st_mode);
+    page_put(w, st->st_size);
+    if( w->full || w->page->data + sizeof(w->page->data) - w->p < size ) {
+        w->full = 1;
+        return;
+    }
+    memcpy(w->p, record, size);
+    w->p += size;
+}
+
+/* Return 0 if the entry is in the page */
+static int page_entry_end(struct dir_page_writer *w, off_t offset)
+{
+    page_put(w, 0);
+    if( w->full ) return -E2BIG;
+    w->page->size = w->p - w->page->data;
+    w->page->count++;
+    w->page->cursor = offset;
+    return 0;
+}
+
+/*
+ * Attributes of an entry of a directory merged from several shards.
+ */
+static int page_entry_attrs(struct dir_page_writer *w, struct catifs *fs, sqlite3_int64 rowid)
+{
+    sqlite3_stmt *query;
+
+    if( ! fs ) return 0;
+    if( sqlite3_prepare_v2(fs->db, "SELECT name, value FROM catifs_attrs WHERE st_ino=?1",
+                           -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    sqlite3_bind_int64(query, 1, rowid);
+    while( sqlite3_step(query) == SQLITE_ROW ) {
+        page_put_text(w, sqlite3_column_blob(query, 0), sqlite3_column_bytes(query, 0), 1);
+        page_put_text(w, sqlite3_column_blob(query, 1), sqlite3_column_bytes(query, 1), 0);
+    }
+    sqlite3_finalize(query);
+    return 0;
+}
+
+/*
+ * Entries of a directory merged from several shards, the cursor is an
+ * offset of catifs_readdir().
+ */
+static int dir_page_merged(struct catifs_dir *dir, struct dir_page_writer *w)
+{
+    struct catifs *fs;
+    sqlite3_int64 rowid;
+    struct stat st;
+    int result;
+
+    result = dir_merge_seek(dir, w->page->cursor);
+    if( result == 0 ) result = dir_merge_start(dir);
+    while( result == 0 && (result = dir_merge_next(dir, &st, &fs, &rowid)) == 1 ) {
+        page_entry_start(w, dir->name, &st);
+        result = page_entry_attrs(w, fs, rowid);
+        if( result == 0 ) result = page_entry_end(w, dir->offset + 1);
+        if( result == 0 ) result = dir_set_last(dir, dir->name, dir->offset + 1);
+    }
+    if( result == 0 || result == -ENOENT ) {
+        w->page->flags |= CATIFS_DIR_PAGE_END;
+        result = 0;
+    }
+    dir_merge_reset(dir);
+    return result;
+}
+
+#define DIR_PAGE_SELECT(columns) \
+    "SELECT c.*, a.name, a.value FROM (SELECT " columns ", path, rowid AS row_id " \
+    "FROM catifs WHERE " PARENT("path") " = ?3 AND path > ?1 AND path < ?2) c " \
+    "LEFT JOIN catifs_attrs a ON a.st_ino = c.row_id ORDER BY c.path"
+
+/*
+ * Entries of a directory of a single shard, with their attributes, from
+ * one query. Rows of an entry are consecutive, one per attribute. The
+ * cursor is the offset of catifs_readdir() (rowid + 2).
+ */
+static int dir_page_query(struct catifs_dir *dir, struct dir_page_writer *w)
+{
+    struct catifs *fs = dir->fs;
+    const int ncolumns = STAT_NCOLUMNS(fs);
+    const size_t len = strlen(dir->lower);
+    sqlite3_stmt *query;
+    sqlite3_int64 rowid, current = 0;
+    struct stat st;
+    char *entry = NULL;     /* path of the current entry */
+    int rc, result;
+
+    result = dir_seek(fs->db, dir, w->page->cursor);
+    if( result == -ENOENT ) {
+        /* Unknown cursor without a previous page on this handle */
+        w->page->flags |= CATIFS_DIR_PAGE_END;
+        return 0;
+    }
+    if( result != 0 ) return result;
+    if( sqlite3_prepare_v2(fs->db,
+            fs->compact ? DIR_PAGE_SELECT(STAT_COMPACT_COLUMNS) : DIR_PAGE_SELECT(STAT_COLUMNS),
+            -1, &query, 0) != SQLITE_OK ) {
+#ifdef DEBUG
+        fprintf(stderr, "ioctl cannot prepare SQL query: %s\n", sqlite3_errmsg(fs->db));
+#endif
+        return -EIO;
+    }
+    /* dir->last is updated while the query runs */
+    sqlite3_bind_text(query, 1, dir->last, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(query, 2, dir->upper, -1, SQLITE_STATIC);
+    sqlite3_bind_text(query, 3, dir->lower, len - 1, SQLITE_STATIC);
+    memset(&st, 0, sizeof(st));
+    while( (rc = sqlite3_step(query)) == SQLITE_ROW ) {
+        rowid = sqlite3_column_int64(query, ncolumns + 1);
+        if( rowid != current ) {
+            if( current && (result = page_entry_end(w, current + 2)) != 0 ) break;
+            /* The next page resumes after the last complete entry */
+            if( current && (result = dir_set_last(dir, entry, current + 2)) != 0 ) break;
+            current = rowid;
+            free(entry);
+            entry = strdup((const char *) sqlite3_column_text(query, ncolumns));
+            if( ! entry ) {
+                result = -ENOMEM;
+                break;
+            }
+            stat_decode(fs, query, 0, &st);
+            page_entry_start(w, entry + len, &st);
+        }
+        if( sqlite3_column_type(query, ncolumns + 2) != SQLITE_NULL ) {
+            page_put_text(w, sqlite3_column_blob(query, ncolumns + 2),
+                          sqlite3_column_bytes(query, ncolumns + 2), 1);
+            page_put_text(w, sqlite3_column_blob(query, ncolumns + 3),
+                          sqlite3_column_bytes(query, ncolumns + 3), 0);
+        }
+    }
+    if( rc == SQLITE_DONE ) {
+        if( current ) result = page_entry_end(w, current + 2);
+        if( current && result == 0 ) result = dir_set_last(dir, entry, current + 2);
+        if( result == 0 ) w->page->flags |= CATIFS_DIR_PAGE_END;
+    } else if( rc != SQLITE_ROW ) {
+        result = -EIO;
+    }
+    sqlite3_finalize(query);
+    free(entry);
+    return result;
+}
+
+static int catifs_ioctl(const char *path, int cmd, void *arg,
+                        struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+    struct dir_page_writer w;
+    struct catifs_dir *dir;
+    int result;
+
+    if( (unsigned int) cmd != CATIFS_IOC_DIR_PAGE ) return -ENOTTY;
+    /* The handle of a file is not a struct catifs_dir */
+    if( ! (flags & FUSE_IOCTL_DIR) ) return -ENOTTY;
+    if( flags & FUSE_IOCTL_COMPAT ) return -ENOSYS;
+    dir = fi ? get_dirp(fi) : NULL;
+    if( ! dir ) return -EBADF;
+    w.page = data;
+    w.page->count = 0;
+    w.page->size = 0;
+    w.page->flags = 0;
+    w.page->reserved = 0;
+    if( dir->query )
+        result = dir_page_query(dir, &w);
+    else
+        result = dir_page_merged(dir, &w);
+    /* A full page is not an error, the next one starts at cursor */
+    if( result == -E2BIG && w.page->count > 0 ) result = 0;
+    return result;
+}
+
+// static int catifs_mknod(const char *path, mode_t mode, dev_t rdev)
+// {
+//     return 0;
+// }
+
+/*
+ * Directories only exist in the catalogue, their row is built in memory.
+ */
+static int catifs_mkdir(const char *path, mode_t mode)
+{
+    struct fuse_context *context = fuse_get_context();
+    struct catifs *fs;
+    struct stat buf;
+
+    fs = route_entry(path, &path);
+    if( ! fs ) return -EEXIST;
+    entry_stat(&buf, S_IFDIR | (mode & 07777), 0, context->uid, context->gid);
+    return add_entry(fs, path, &buf, NULL);
+}
+
+/*
+ * Return -ENOTEMPTY if directory path has a child in the catalogue (on
+ * idx_catifs_parent), 0 otherwise.
+ */
+static int dir_empty(sqlite3 *db, const char *path)
+{
+    sqlite3_stmt *query;
+    int result;
+
+    if( sqlite3_prepare_v2(db,
+            "SELECT 1 FROM catifs WHERE " PARENT("path") " = ?1 LIMIT 1",
+            -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    result = sqlite3_step(query);
+    result = result == SQLITE_ROW ? -ENOTEMPTY : result == SQLITE_DONE ? 0 : -EIO;
+    sqlite3_finalize(query);
+    return result;
+}
+
+/*
+ * Remove a file or an empty directory from the catalogue. The entry and
+ * the children of a directory are checked in the same transaction as
+ * the removal.
+ */
+static int remove_path(struct catifs *fs, const char *path)
+{
+    sqlite3 *db = fs->db;
+    int result;
+    mode_t mode;
+    sqlite3_int64 size;
+    
+    if( db_begin(db) != 0 ) {
+        return -EIO;
+    }
+    result = path_entry(db, path, NULL, &mode, &size);
+    if( result == 0 && S_ISDIR(mode) ) {
+        result = dir_empty(db, path);
+    }
+    if( result != 0 ) {
+        return db_end(db, result);
+    }
+    result = db_run(db,
+            "DELETE FROM catifs_attrs WHERE st_ino IN "
+            "(SELECT rowid FROM catifs WHERE path=?1)",
+            path, NULL);
+    if( result == 0 ) {
+        result = db_run(db, "DELETE FROM catifs_tree WHERE path=?1", path, NULL);
+    }
+    if( result == 0 ) {
+        result = db_run(db, "DELETE FROM catifs WHERE path=?1", path, NULL);
+    }
+    if( result == 0 ) {
+        if( S_ISDIR(mode) )
+            result = tree_update(db, path, 0, 0, -1);
+        else
+            result = tree_update(db, path, -size, -1, 0);
+    }
+    if( result == 0 ) {
+        result = change_log(db, CHANGE_REMOVE, path, NULL);
+    }
+#ifdef DEBUG
+    if( result != 0 ) {
+        fprintf(stderr, "unlink cannot remove path: %s\n", sqlite3_errmsg(db));
+    }
+#endif
+    return db_end(db, result);
+}
+
+static int catifs_unlink(const char *path)
+{
+    struct catifs *fs;
+    mode_t mode;
+    int result;
+
+    fs = route_entry(path, &path);
+    if( ! fs || strcmp(path, "/") == 0 ) return -EISDIR;
+    result = path_entry(fs->db, path, NULL, &mode, NULL);
+    if( result != 0 ) return result;
+    if( S_ISDIR(mode) ) return -EISDIR;
+    return remove_path(fs, path);
+}
+
+static int catifs_rmdir(const char *path)
+{
+    struct catifs *fs;
+    mode_t mode;
+    int result;
+
+    fs = route_entry(path, &path);
+    if( ! fs || strcmp(path, "/") == 0 ) return -EBUSY;
+    result = path_entry(fs->db, path, NULL, &mode, NULL);
+    if( result != 0 ) return result;
+    if( ! S_ISDIR(mode) ) return -ENOTDIR;
+    return remove_path(fs, path);
+}
+
+/*
+ * Insert path and all its descendants in the negative lookup filter.
+ */
+static void bloom_insert_tree(struct catifs *fs, const char *path)
+{
+    sqlite3_stmt *query;
+
+    if( ! fs->bloom.bits ) return;
+    if( sqlite3_prepare_v2(fs->db,
+            "SELECT path FROM catifs "
+            "WHERE path=?1 OR (path > ?1 || '/' AND path < ?1 || '0')",
+            -1, &query, 0) != SQLITE_OK ) {
+        bloom_build(fs);
+        return;
+    }
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    while( sqlite3_step(query) == SQLITE_ROW )
+        bloom_insert(fs, (const char *) sqlite3_column_text(query, 0));
+    sqlite3_finalize(query);
+}
+
+static int catifs_rename(const char *from, const char *to, unsigned int flags)
+{
+    struct catifs *fs;
+    sqlite3 *db;
+    int result;
+    mode_t mode;
+    sqlite3_int64 size, files, dirs;
+    
+    fs = route_entry(from, &from);
+    if( ! fs || strcmp(from, "/") == 0 ) return -EBUSY;
+    if( route_entry(to, &to) != fs ) return -EXDEV;
+    db = fs->db;
+    result = path_entry(db, from, NULL, &mode, &size);
+    if( result != 0 ) {
+        return result;
+    }
+    if( S_ISDIR(mode) ) {
+        if( tree_get(db, from, &size, &files, &dirs) != 0 ) {
+            size = files = dirs = 0;
+        }
+        ++dirs;
+    } else {
+        files = 1;
+        dirs = 0;
+    }
+    if( db_begin(db) != 0 ) {
+        return -EIO;
+    }
+    result = db_run(db,
+            "UPDATE catifs SET path = ?2 || substr(path, length(?1) + 1) "
+            "WHERE path=?1 OR (path > ?1 || '/' AND path < ?1 || '0')",
+            from, to);
+    if( result == 0 ) {
+        result = db_run(db,
+                "UPDATE catifs_tree SET path = ?2 || substr(path, length(?1) + 1) "
+                "WHERE path=?1 OR (path > ?1 || '/' AND path < ?1 || '0')",
+                from, to);
+    }
+    if( result == 0 ) {
+        result = tree_update(db, from, -size, -files, -dirs);
+    }
+    if( result == 0 ) {
+        result = tree_update(db, to, size, files, dirs);
+    }
+    if( result == 0 ) {
+        result = change_log(db, CHANGE_RENAME, from, to);
+    }
+#ifdef DEBUG
+    if( result != 0 ) {
+        fprintf(stderr, "rename cannot rename path(s): %s\n", sqlite3_errmsg(db));
+    }
+#endif
+    result = db_end(db, result);
+    if( result == 0 ) {
+        bloom_insert_tree(fs, to);
+    }
+    return result;
+}
+
+static int catifs_chmod(const char *path, mode_t mode,
+		        struct fuse_file_info *fi)
+{
+    sqlite3 *db;
+    int rc;
+    sqlite3_stmt *query;
+    int result;
+    struct catifs *fs;
+    
+    fs = route_entry(path, &path);
+    if( ! fs ) return -EPERM;
+    db = fs->db;
+    if( db_begin(db) != 0 ) {
+        return -EIO;
+    }
+    rc = sqlite3_prepare_v2(db,
+            "UPDATE catifs SET st_mode=?2 WHERE path=?1",
+            -1, &query, 0);
+    if( rc != SQLITE_OK ) {
+        return db_end(db, -EIO);
+    }
+    
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_int(query, 2, mode);
+    rc = sqlite3_step(query);
+    if( rc == SQLITE_DONE && sqlite3_changes(db) > 0 ) {
+        result = change_log(db, CHANGE_MODE, path, NULL);
+    } else {
+#ifdef DEBUG
+        fprintf(stderr, "chmod SQL error: %s\n", sqlite3_errmsg(db));
+#endif
+        result = -ENOENT;
+    }
+    sqlite3_finalize(query);
+    return db_end(db, result);
+}
+
+static int catifs_chown(const char *path, uid_t uid, gid_t gid,
+		     struct fuse_file_info *fi)
+{
+    struct catifs *fs;
+    struct stat buf;
+    int result;
+    
+    fs = route_entry(path, &path);
+    if( ! fs ) return -EPERM;
+    if( db_begin(fs->db) != 0 ) {
+        return -EIO;
+    }
+    result = load_stat(fs, path, &buf);
+    if( result == 0 ) {
+        if( uid != (uid_t) -1 ) buf.st_uid = uid;
+        if( gid != (gid_t) -1 ) buf.st_gid = gid;
+        result = store_stat(fs, path, &buf);
+    }
+    if( result == 0 ) {
+        result = change_log(fs->db, CHANGE_OWNER, path, NULL);
+    }
+#ifdef DEBUG
+    if( result != 0 ) {
+        fprintf(stderr, "chmown SQL error: %s\n", sqlite3_errmsg(fs->db));
+    }
+#endif
+    return db_end(fs->db, result);
+}
+
+// static int catifs_truncate(const char *path, off_t size,
+// 			 struct fuse_file_info *fi)
+// {
+// 	return 0;
+// }
+
+
+static void set_time(struct timespec *dst, const struct timespec *src)
+{
+    if( src->tv_nsec == UTIME_NOW )
+        clock_gettime(CLOCK_REALTIME, dst);
+    else if( src->tv_nsec != UTIME_OMIT )
+        *dst = *src;
+}
+
+static int catifs_utimens(const char *path, const struct timespec ts[2],
+		          struct fuse_file_info *fi)
+{
+    struct catifs *fs;
+    struct stat buf;
+    int result;
+    
+    if (ts[0].tv_nsec == UTIME_OMIT && ts[1].tv_nsec == UTIME_OMIT) {
+        return 0;
+    }
+    fs = route_entry(path, &path);
+    if( ! fs ) return -EPERM;
+    if( db_begin(fs->db) != 0 ) {
+        return -EIO;
+    }
+    result = load_stat(fs, path, &buf);
+    if( result == 0 ) {
+        set_time(&buf.st_atim, &ts[0]);
+        set_time(&buf.st_mtim, &ts[1]);
+        result = store_stat(fs, path, &buf);
+    }
+    if( result == 0 ) {
+        result = change_log(fs->db, CHANGE_TIMES, path, NULL);
+    }
+#ifdef DEBUG
+    if( result != 0 ) {
+        fprintf(stderr, "utimens SQL error: %s\n", sqlite3_errmsg(fs->db));
+    }
+#endif
+    return db_end(fs->db, result);
+}
+
+
+const char *real_path(sqlite3 *db, const char *path)
+{
+    const char * sql;
+    int rc;
+    sqlite3_stmt *query;
+    const char *result = NULL;
+    
+    sql = "SELECT v.prefix || c.real_path, c.real_path FROM catifs c "
+          "LEFT JOIN catifs_volumes v ON v.id = c.volume WHERE c.path=?";
+    rc = sqlite3_prepare_v2(db,
+            sql,
+            -1, &query, 0);
+    if( rc != SQLITE_OK ) {
+#ifdef DEBUG
+        fprintf(stderr, "getattr cannot prepare SQL query: %s\n", sqlite3_errmsg(db));
+#endif
+        return result;
+    }
+    
+    rc = sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    if( rc != SQLITE_OK ) {
+#ifdef DEBUG
+        fprintf(stderr, "getattr cannot bind path in SQL query: %s\n", sqlite3_errmsg(db));
+#endif
+        return result;
+    }
+    rc = sqlite3_step(query);
+    if(  rc == SQLITE_ROW ) {
+        const char *rpath = (const char *) sqlite3_column_text(query, 0);
+        if( ! rpath ) rpath = (const char *) sqlite3_column_text(query, 1);
+        if( rpath ) result = strndup(rpath, 4096);
+    } else {
+#ifdef DEBUG
+        fprintf(stderr, "getattr SQL query failed: (%d) %s\n", rc, sqlite3_errmsg(db));
+#endif
+    }
+    rc = sqlite3_finalize(query);
+#ifdef DEBUG
+    if( rc != SQLITE_OK ) {
+        fprintf(stderr, "getattr cannot finalize SQL query: %s\n", sqlite3_errmsg(db));
+    }
+#endif
+    return result;
+}
+
+static int catifs_symlink(const char *target, const char *path)
+{
+    struct fuse_context *context = fuse_get_context();
+    struct catifs *fs;
+    struct stat buf;
+
+    fs = route_entry(path, &path);
+    if( ! fs ) return -EEXIST;
+    entry_stat(&buf, S_IFLNK | 0777, strlen(target), context->uid, context->gid);
+    return add_entry(fs, path, &buf, target);
+}
+
+/*
+ * Target of a symbolic link created in the mount, or of the backing
+ * link of a symbolic link imported from the backing storage.
+ */
+static int catifs_readlink(const char *path, char *buf, size_t size)
+{
+    struct catifs *fs;
+    sqlite3_stmt *query;
+    const char *rpath;
+    ssize_t n;
+    int backing = 0;
+    int result;
+
+    /* -EINVAL for ancestors of shard prefixes, shards merged at the root
+       are tried in order */
+    result = -EINVAL;
+    for( fs = route(path, &path); fs; fs = route_next(fs) ) {
+        if( sqlite3_prepare_v2(fs->db, "SELECT st_mode, link_target FROM catifs WHERE path=?1",
+                               -1, &query, 0) != SQLITE_OK )
+            return -EIO;
+        sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+        result = sqlite3_step(query);
+        if( result != SQLITE_DONE ) break;
+        sqlite3_finalize(query);
+        result = -ENOENT;
+    }
+    if( ! fs ) return result;
+    if( result != SQLITE_ROW ) {
+        result = -EIO;
+    } else if( ! S_ISLNK(sqlite3_column_int(query, 0)) ) {
+        result = -EINVAL;
+    } else if( sqlite3_column_type(query, 1) != SQLITE_NULL ) {
+        snprintf(buf, size, "%s", (const char *) sqlite3_column_text(query, 1));
+        result = 0;
+    } else {
+        backing = 1;
+        result = 0;
+    }
+    sqlite3_finalize(query);
+    if( ! backing ) return result;
+    rpath = real_path(fs->db, path);
+    if( ! rpath ) return -ENOENT;
+    n = readlink(rpath, buf, size - 1);
+    free((char *) rpath);
+    if( n == -1 ) return -errno;
+    buf[n] = 0;
+    return 0;
+}
+
+/*
+ * Hard links are not supported: a row is both the inode and the name of
+ * an entry, a second name would be a copy drifting from the first one.
+ */
+static int catifs_link(const char *from, const char *to)
+{
+    (void) from;
+    (void) to;
+    return -EPERM;
+}
+
+
+/*
+ * Write a private copy of the shared backing file at origin (empty if
+ * truncate is set) with the mode of the shared file.
+ */
+static int unshare_copy(const char *path, const char *shared, const char *origin, int truncate)
+{
+    const char *slash = strrchr(origin, '/');
+    char *dir = slash ? strndup(origin, slash == origin ? 1 : slash - origin) : NULL;
+    struct stat buf;
+    int fd, result = 0;
+
+    if( ! dir ) {
+        result = -EINVAL;
+    } else if( stat(dir, &buf) == -1 || ! S_ISDIR(buf.st_mode) ) {
+        result = -ENOENT;
+    } else if( ! truncate ) {
+        result = copy_file(shared, origin);
+    } else if( stat(shared, &buf) == -1 ) {
+        result = -errno;
+    } else if( (fd = open(origin, O_WRONLY | O_CREAT | O_TRUNC, buf.st_mode & 07777)) == -1 ) {
+        result = -errno;
+    } else {
+        close(fd);
+    }
+    if( result != 0 )
+        fprintf(stderr, "Cannot copy %s to %s before writing %s: %s\n", shared, origin,
+                path, strerror(-result));
+    free(dir);
+    return result;
+}
+
+/*
+ * Called before path is opened for writing: give a private copy of the
+ * backing file to a row sharing it since "cati_fs dedup" and forget the
+ * content hash that is about to become stale. The first row of a group
+ * of duplicates keeps its own file (no dedup_origin): the other rows
+ * sharing it are moved first to a copy written back to the origin of
+ * the first of them, which owns it again.
+ */
+static int unshare_backing(struct catifs *fs, const char *path, int flags)
+{
+    sqlite3_stmt *query;
+    char *shared = NULL, *origin = NULL;
+    int others = 0, result = 0;
+
+    if( ! fs->hashing ) return 0;
+    /* Rows sharing a file have the same hash (on idx_catifs_hash) */
+    if( sqlite3_prepare_v2(fs->db,
+            "SELECT v.prefix || c.real_path, c.real_path, "
+            "  coalesce(c.dedup_origin, o.dedup_origin), c.dedup_origin IS NULL "
+            "FROM catifs c LEFT JOIN catifs_volumes v ON v.id = c.volume "
+            "LEFT JOIN catifs o ON c.dedup_origin IS NULL AND o.content_hash = c.content_hash "
+            "  AND o.st_size = c.st_size AND o.real_path = c.real_path "
+            "  AND o.volume IS c.volume AND o.rowid != c.rowid "
+            "WHERE c.path=?1 AND (c.dedup_origin IS NOT NULL OR o.rowid IS NOT NULL) "
+            "ORDER BY o.rowid LIMIT 1",
+            -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    if( sqlite3_step(query) == SQLITE_ROW ) {
+        const char *rpath = (const char *) sqlite3_column_text(query, 0);
+        if( ! rpath ) rpath = (const char *) sqlite3_column_text(query, 1);
+        const char *copy = (const char *) sqlite3_column_text(query, 2);
+        shared = strdup(rpath);
+        origin = copy ? strdup(copy) : NULL;
+        others = sqlite3_column_int(query, 3);
+    }
+    sqlite3_finalize(query);
+    /* Rows sharing a file all have an origin, except the first one */
+    if( others && ! origin ) result = -EIO;
+    if( origin ) {
+#ifdef DEBUG
+        fprintf(stderr, "copy on write %s: %s -> %s\n", path, shared, origin);
+#endif
+        /* The other rows keep the content */
+        result = unshare_copy(path, shared, origin, ! others && (flags & O_TRUNC));
+    }
+    if( result == 0 && db_begin(fs->db) != 0 ) result = -EIO;
+    if( result != 0 ) goto done;
+    if( others ) {
+        result = db_run(fs->db,
+                "UPDATE catifs SET real_path = " VOLUME_RELATIVE("?2") ", "
+                "  volume = " VOLUME_OF("?2") ", dedup_origin = nullif(dedup_origin, ?2) "
+                "WHERE rowid IN (SELECT o.rowid FROM catifs c JOIN catifs o "
+                "  ON o.content_hash = c.content_hash AND o.st_size = c.st_size "
+                "  AND o.real_path = c.real_path AND o.volume IS c.volume "
+                "  AND o.rowid != c.rowid WHERE c.path=?1)",
+                path, origin);
+    }
+    if( result == 0 ) {
+        result = db_run(fs->db,
+                "UPDATE catifs SET content_hash=NULL, "
+                "  real_path = CASE WHEN dedup_origin IS NULL THEN real_path "
+                "    ELSE " VOLUME_RELATIVE("dedup_origin") " END, "
+                "  volume = CASE WHEN dedup_origin IS NULL THEN volume "
+                "    ELSE " VOLUME_OF("dedup_origin") " END, "
+                "  dedup_origin=NULL "
+                "WHERE path=?1",
+                path, NULL);
+    }
+    result = db_end(fs->db, result);
+done:
+    free(shared);
+    free(origin);
+    return result;
+}
+
+/*
+ * Readahead of backing files. Each handle tracks whether its reads are
+ * sequential. After PREFETCH_TRIGGER sequential reads, the chunks of
+ * the PREFETCH_CHUNKS * PREFETCH_CHUNK bytes following the reader are
+ * read by the threads of a pool while the reader consumes the previous
+ * ones, hiding the latency of network storage. Random reads go straight
+ * to the backing file.
+ */
+#define PREFETCH_CHUNK (1 << 20)
+#define PREFETCH_CHUNKS 4
+#define PREFETCH_TRIGGER 2
+#define PREFETCH_THREADS 4
+
+enum { CHUNK_EMPTY, CHUNK_QUEUED, CHUNK_READING, CHUNK_READY };
+
+struct prefetch_chunk {
+    struct prefetch_chunk *next;    /* in the queue of the pool */
+    struct catifs_file *file;
+    int state;
+    off_t offset;
+    ssize_t size;                   /* bytes read or -errno */
+    char *data;
+};
+
+struct prefetch_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;          /* a chunk was queued or stop was set */
+    pthread_cond_t ready;           /* a chunk was read */
+    struct prefetch_chunk *head, *tail;
+    pthread_t *threads;
+    int count;
+    int stop;
+};
+
+/*
+ * Read cache of backing files on a local directory. Backing files are
+ * copied there by chunks of CACHE_CHUNK bytes on first read, in files
+ * named after the key of the backing file and the chunk index. The key
+ * hashes the real path with the mtime and size stored in the catalogue,
+ * so chunks of a modified file are never found again and age out. The
+ * least recently used chunks are removed when the cache exceeds its
+ * size limit. Chunks left by a previous mount are reused.
+ */
+#define CACHE_CHUNK (1 << 20)
+#define CACHE_SIZE 1024 /* default size limit in MiB */
+
+struct cache_entry {
+    uint64_t key;
+    uint64_t chunk;
+    size_t size;
+    struct cache_entry *older, *newer;
+    struct cache_entry *bucket;     /* next entry of the same bucket */
+};
+
+struct read_cache {
+    char *dir;
+    uint64_t limit;
+    uint64_t used;
+    pthread_mutex_t lock;
+    struct cache_entry **buckets;
+    size_t bucket_mask;
+    struct cache_entry *newest, *oldest;
+};
+
+/*
+ * File handle stored in fuse_file_info.
+ */
+struct catifs_file {
+    struct catifs *fs;          /* shard of the entry */
+    int fd;
+    struct seekable *seekable;  /* decompressed view of fd, NULL if not compressed */
+    off_t size;                 /* size of the backing file when opened */
+    unsigned latency;
+    struct read_cache *cache;   /* NULL if reads do not go through the cache */
+    uint64_t cache_key;
+    /* Access pattern, see prefetch_track() */
+    struct prefetch_pool *pool; /* NULL if readahead threads are disabled */
+    off_t next;                 /* offset following the last read */
+    int sequential;             /* number of consecutive sequential reads */
+    int prefetching;            /* chunks were queued */
+    struct prefetch_chunk chunks[PREFETCH_CHUNKS];
+};
+
+/*
+ * pread() of a backing file. latency (microseconds) is added to every
+ * call to emulate network storage in benchmarks.
+ */
+static ssize_t backing_pread(int fd, char *buf, size_t size, off_t offset, unsigned latency)
+{
+    size_t done = 0;
+    ssize_t count;
+
+    if( latency ) usleep(latency);
+    while( done < size ) {
+        count = pread(fd, buf + done, size - done, offset + done);
+        if( count == -1 ) {
+            if( errno == EINTR ) continue;
+            return done ? done : -errno;
+        }
+        if( count == 0 ) break;
+        done += count;
+    }
+    return done;
+}
+
+static inline struct cache_entry **cache_bucket(struct read_cache *cache,
+                                                uint64_t key, uint64_t chunk)
+{
+    return &cache->buckets[(key ^ (chunk * 0x9e3779b97f4a7c15ULL)) & cache->bucket_mask];
+}
+
+/*
+ * Name of the file of a chunk, to be freed with sqlite3_free().
+ */
+static char *cache_name(const struct read_cache *cache, uint64_t key, uint64_t chunk)
+{
+    return sqlite3_mprintf("%s/%016llx-%llu", cache->dir,
+                           (unsigned long long) key, (unsigned long long) chunk);
+}
+
+/*
+ * Key of the backing file rpath, whose catalogue entry is st.
+ */
+static uint64_t cache_key(const char *rpath, const struct stat *st)
+{
+    struct content_hash h;
+    char *s = sqlite3_mprintf("%s\t%lld.%09ld\t%lld", rpath, (long long) st->st_mtim.tv_sec,
+                              st->st_mtim.tv_nsec, (long long) st->st_size);
+
+    content_hash_init(&h);
+    if( s ) content_hash_update(&h, (const unsigned char *) s, strlen(s));
+    sqlite3_free(s);
+    return content_hash_final(&h);
+}
+
+/* The functions below are called with the lock of the cache held */
+
+static struct cache_entry *cache_find(struct read_cache *cache, uint64_t key, uint64_t chunk)
+{
+    struct cache_entry *entry = *cache_bucket(cache, key, chunk);
+
+    while( entry && (entry->key != key || entry->chunk != chunk) ) entry = entry->bucket;
+    return entry;
+}
+
+static void cache_unlink(struct read_cache *cache, struct cache_entry *entry)
+{
+    if( entry->older ) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+    if( entry->newer ) entry->newer->older = entry->older;
+    else cache->newest = entry->older;
+}
+
+static void cache_touch(struct read_cache *cache, struct cache_entry *entry)
+{
+    cache_unlink(cache, entry);
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if( cache->newest ) cache->newest->newer = entry;
+    else cache->oldest = entry;
+    cache->newest = entry;
+}
+
+/*
+ * Remove the least recently used chunks until the cache fits its limit.
+ */
+static void cache_evict(struct read_cache *cache)
+{
+    struct cache_entry *entry, **p;
+    char *name;
+
+    while( cache->used > cache->limit && (entry = cache->oldest) ) {
+        name = cache_name(cache, entry->key, entry->chunk);
+        if( name ) unlink(name);
+        sqlite3_free(name);
+        for( p = cache_bucket(cache, entry->key, entry->chunk); *p != entry; p = &(*p)->bucket );
+        *p = entry->bucket;
+        cache_unlink(cache, entry);
+        cache->used -= entry->size;
+        free(entry);
+    }
+}
+
+static void cache_insert(struct read_cache *cache, uint64_t key, uint64_t chunk, size_t size)
+{
+    struct cache_entry *entry = cache_find(cache, key, chunk);
+    struct cache_entry **bucket;
+
+    if( entry ) {
+        cache_touch(cache, entry);
+        return;
+    }
+    entry = calloc(1, sizeof(*entry));
+    if( ! entry ) return;
+    entry->key = key;
+    entry->chunk = chunk;
+    entry->size = size;
+    bucket = cache_bucket(cache, key, chunk);
+    entry->bucket = *bucket;
+    *bucket = entry;
+    entry->older = cache->newest;
+    if( cache->newest ) cache->newest->newer = entry;
+    else cache->oldest = entry;
+    cache->newest = entry;
+    cache->used += size;
+    cache_evict(cache);
+}
+
+struct cache_file {
+    uint64_t key;
+    uint64_t chunk;
+    size_t size;
+    time_t mtime;
+};
+
+static int cache_file_compare(const void *a, const void *b)
+{
+    const struct cache_file *x = a, *y = b;
+
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/*
+ * Open the cache in dir (created if needed) with a size limit in bytes.
+ * Chunks already in dir are kept, oldest first for eviction.
+ */
+static struct read_cache *cache_open(const char *dir, uint64_t limit)
+{
+    struct read_cache *cache;
+    struct cache_file *files = NULL, *grown;
+    size_t count = 0, allocated = 0, buckets = 1024, i;
+    unsigned long long key, chunk;
+    struct dirent *de;
+    struct stat st;
+    char *name;
+    DIR *d;
+    int length;
+
+    if( mkdir(dir, 0700) == -1 && errno != EEXIST ) {
+        fprintf(stderr, "Cannot create cache directory %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+    d = opendir(dir);
+    if( ! d ) {
+        fprintf(stderr, "Cannot open cache directory %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+    cache = calloc(1, sizeof(*cache));
+    if( ! cache ) {
+        closedir(d);
+        return NULL;
+    }
+    while( buckets * CACHE_CHUNK < limit ) buckets *= 2;
+    cache->buckets = calloc(buckets, sizeof(*cache->buckets));
+    cache->dir = strdup(dir);
+    if( ! cache->buckets || ! cache->dir ) {
+        free(cache->buckets);
+        free(cache->dir);
+        free(cache);
+        closedir(d);
+        return NULL;
+    }
+    cache->bucket_mask = buckets - 1;
+    cache->limit = limit;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    while( (de = readdir(d)) ) {
+        if( de->d_name[0] == '.' && de->d_name[1] && strcmp(de->d_name, "..") != 0 ) {
+            /* Chunk being written when a previous mount stopped */
+            name = sqlite3_mprintf("%s/%s", dir, de->d_name);
+            if( name ) unlink(name);
+            sqlite3_free(name);
+            continue;
+        }
+        length = 0;
+        if( sscanf(de->d_name, "%16llx-%llu%n", &key, &chunk, &length) != 2 ||
+            de->d_name[length] )
+            continue;
+        name = sqlite3_mprintf("%s/%s", dir, de->d_name);
+        if( name && stat(name, &st) == 0 && S_ISREG(st.st_mode) ) {
+            if( count == allocated ) {
+                allocated = allocated ? 2 * allocated : 256;
+                grown = realloc(files, allocated * sizeof(*files));
+                if( ! grown ) {
+                    sqlite3_free(name);
+                    break;
+                }
+                files = grown;
+            }
+            files[count].key = key;
+            files[count].chunk = chunk;
+            files[count].size = st.st_size;
+            files[count].mtime = st.st_mtime;
+            ++count;
+        }
+        sqlite3_free(name);
+    }
+    closedir(d);
+    qsort(files, count, sizeof(*files), cache_file_compare);
+    for( i=0; i<count; i++ )
+        cache_insert(cache, files[i].key, files[i].chunk, files[i].size);
+    free(files);
+    return cache;
+}
+
+static void cache_close(struct read_cache *cache)
+{
+    struct cache_entry *entry, *older;
+
+    if( ! cache ) return;
+    for( entry = cache->newest; entry; entry = older ) {
+        older = entry->older;
+        free(entry);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache->dir);
+    free(cache);
+}
+
+/*
+ * Read a chunk of the backing file of a handle, store it in the cache
+ * and copy size bytes from start in buf.
+ */
+static ssize_t cache_fill(struct read_cache *cache, struct catifs_file *file,
+                          uint64_t chunk, char *buf, size_t start, size_t size)
+{
+    char *data, *name, *temporary;
+    ssize_t count;
+    int fd;
+
+    data = malloc(CACHE_CHUNK);
+    if( ! data ) return -ENOMEM;
+    count = backing_pread(file->fd, data, CACHE_CHUNK, chunk * CACHE_CHUNK, file->latency);
+    if( count <= 0 ) {
+        free(data);
+        return count;
+    }
+    name = cache_name(cache, file->cache_key, chunk);
+    temporary = sqlite3_mprintf("%s/.%016llx-%llu.XXXXXX", cache->dir,
+                                (unsigned long long) file->cache_key,
+                                (unsigned long long) chunk);
+    if( name && temporary && (fd = mkstemp(temporary)) != -1 ) {
+        /* A chunk that cannot be stored is still returned */
+        if( write_full(fd, data, count) == 0 && close(fd) == 0 &&
+            rename(temporary, name) == 0 ) {
+            pthread_mutex_lock(&cache->lock);
+            cache_insert(cache, file->cache_key, chunk, count);
+            pthread_mutex_unlock(&cache->lock);
+        } else {
+            unlink(temporary);
+        }
+    }
+    sqlite3_free(name);
+    sqlite3_free(temporary);
+    if( start >= (size_t) count ) {
+        count = 0;
+    } else {
+        count -= start;
+        if( (size_t) count > size ) count = size;
+        memcpy(buf, data + start, count);
+    }
+    free(data);
+    return count;
+}
+
+/*
+ * pread() of the backing file of a handle through the cache.
+ */
+static ssize_t cache_pread(struct read_cache *cache, struct catifs_file *file,
+                           char *buf, size_t size, off_t offset)
+{
+    struct cache_entry *entry;
+    uint64_t chunk;
+    size_t done = 0, start, length = 0;
+    ssize_t count;
+    char *name;
+    int fd;
+
+    /* The cache is only used by read only handles */
+    if( offset >= file->size ) return 0;
+    if( size > (size_t) (file->size - offset) ) size = file->size - offset;
+    while( done < size ) {
+        chunk = (offset + done) / CACHE_CHUNK;
+        start = (offset + done) % CACHE_CHUNK;
+        pthread_mutex_lock(&cache->lock);
+        entry = cache_find(cache, file->cache_key, chunk);
+        if( entry ) {
+            cache_touch(cache, entry);
+            length = entry->size;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        count = -1;
+        if( entry ) {
+            if( start >= length ) break;
+            name = cache_name(cache, file->cache_key, chunk);
+            if( name && (fd = open(name, O_RDONLY)) != -1 ) {
+                count = backing_pread(fd, buf + done, length - start < size - done ?
+                                      length - start : size - done, start, 0);
+                close(fd);
+            }
+            sqlite3_free(name);
+        }
+        if( count <= 0 ) {
+            /* Not cached, or removed since it was found */
+            count = cache_fill(cache, file, chunk, buf + done, start, size - done);
+            if( count < 0 ) return done ? done : count;
+        }
+        if( count == 0 ) break;
+        done += count;
+    }
+    return done;
+}
+
+/*
+ * pread() of the backing file of a handle.
+ */
+static ssize_t backing_read(struct catifs_file *file, char *buf, size_t size, off_t offset)
+{
+    if( file->cache )
+        return cache_pread(file->cache, file, buf, size, offset);
+    return backing_pread(file->fd, buf, size, offset, file->latency);
+}
+
+static void *prefetch_worker(void *arg)
+{
+    struct prefetch_pool *pool = arg;
+    struct prefetch_chunk *chunk;
+
+    pthread_mutex_lock(&pool->lock);
+    for( ;; ) {
+        while( ! pool->head && ! pool->stop )
+            pthread_cond_wait(&pool->queued, &pool->lock);
+        if( pool->stop ) break;
+        chunk = pool->head;
+        pool->head = chunk->next;
+        if( ! pool->head ) pool->tail = NULL;
+        chunk->state = CHUNK_READING;
+        pthread_mutex_unlock(&pool->lock);
+
+        posix_fadvise(chunk->file->fd, chunk->offset, PREFETCH_CHUNK, POSIX_FADV_WILLNEED);
+        chunk->size = backing_read(chunk->file, chunk->data, PREFETCH_CHUNK, chunk->offset);
+
+        pthread_mutex_lock(&pool->lock);
+        chunk->state = CHUNK_READY;
+        pthread_cond_broadcast(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static struct prefetch_pool *prefetch_start(int threads)
+{
+    struct prefetch_pool *pool;
+    int i;
+
+    if( threads <= 0 ) return NULL;
+    pool = calloc(1, sizeof(*pool));
+    if( ! pool ) return NULL;
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    if( ! pool->threads ) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    for( i=0; i<threads; i++ ) {
+        if( pthread_create(&pool->threads[i], NULL, prefetch_worker, pool) != 0 ) break;
+        pool->count++;
+    }
+    return pool;
+}
+
+static void prefetch_stop(struct prefetch_pool *pool)
+{
+    int i;
+
+    if( ! pool ) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+    for( i=0; i<pool->count; i++ )
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->queued);
+    pthread_cond_destroy(&pool->ready);
+    free(pool->threads);
+    free(pool);
+}
+
+/*
+ * Record a read of the handle. When reads are sequential, queue the
+ * chunks of the window following the reader (or let the kernel read
+ * them ahead if there are no prefetch threads or the file is
+ * compressed).
+ */
+static void prefetch_track(struct catifs_file *file, size_t size, off_t offset)
+{
+    struct prefetch_pool *pool = file->pool;
+    struct prefetch_chunk *chunk, *slot;
+    off_t start, end, position;
+    int i;
+
+    if( offset == file->next ) ++file->sequential;
+    else file->sequential = 0;
+    file->next = offset + size;
+    if( file->sequential < PREFETCH_TRIGGER ) return;
+
+    start = (offset + size) / PREFETCH_CHUNK * PREFETCH_CHUNK;
+    end = start + PREFETCH_CHUNKS * PREFETCH_CHUNK;
+    if( file->seekable ) {
+        start = seekable_offset(file->seekable, start);
+        end = seekable_offset(file->seekable, end);
+        posix_fadvise(file->fd, start, end - start, POSIX_FADV_WILLNEED);
+        return;
+    }
+    if( end > file->size ) end = file->size;
+    if( ! pool ) {
+        if( end > start ) posix_fadvise(file->fd, start, end - start, POSIX_FADV_WILLNEED);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    for( position = start; position < end; position += PREFETCH_CHUNK ) {
+        slot = NULL;
+        for( i=0; i<PREFETCH_CHUNKS; i++ ) {
+            chunk = &file->chunks[i];
+            if( chunk->state != CHUNK_EMPTY && chunk->offset == position ) break;
+            /* Free slots: empty or read chunks outside of the window */
+            if( ! slot && (chunk->state == CHUNK_EMPTY ||
+                           (chunk->state == CHUNK_READY &&
+                            (chunk->offset + PREFETCH_CHUNK <= offset || chunk->offset >= end))) )
+                slot = chunk;
+        }
+        if( i < PREFETCH_CHUNKS ) continue;
+        if( ! slot ) break;
+        if( ! slot->data && ! (slot->data = malloc(PREFETCH_CHUNK)) ) break;
+        slot->file = file;
+        slot->offset = position;
+        slot->state = CHUNK_QUEUED;
+        slot->next = NULL;
+        if( pool->tail ) pool->tail->next = slot;
+        else pool->head = slot;
+        pool->tail = slot;
+        file->prefetching = 1;
+        pthread_cond_signal(&pool->queued);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Remove a queued chunk from the queue of the pool, the lock is held.
+ */
+static void prefetch_dequeue(struct prefetch_pool *pool, struct prefetch_chunk *chunk)
+{
+    struct prefetch_chunk **p, *previous = NULL;
+
+    for( p = &pool->head; *p; previous = *p, p = &(*p)->next ) {
+        if( *p == chunk ) {
+            *p = chunk->next;
+            if( pool->tail == chunk ) pool->tail = previous;
+            chunk->state = CHUNK_EMPTY;
+            return;
+        }
+    }
+}
+
+/*
+ * pread() of a handle with queued chunks. The part of the request that
+ * is not in a chunk is read from the backing file. A chunk still in the
+ * queue is read right away instead of waiting for a thread.
+ */
+static ssize_t prefetch_read(struct catifs_file *file, char *buf, size_t size, off_t offset)
+{
+    struct prefetch_pool *pool = file->pool;
+    struct prefetch_chunk *chunk = NULL;
+    size_t done = 0, count;
+    off_t position;
+    ssize_t result;
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    while( done < size ) {
+        position = offset + done;
+        for( i=0; i<PREFETCH_CHUNKS; i++ ) {
+            chunk = &file->chunks[i];
+            if( chunk->state != CHUNK_EMPTY && chunk->offset <= position &&
+                position < chunk->offset + PREFETCH_CHUNK )
+                break;
+        }
+        if( i == PREFETCH_CHUNKS ) break;
+        if( chunk->state == CHUNK_QUEUED ) {
+            prefetch_dequeue(pool, chunk);
+            chunk->state = CHUNK_READING;
+            pthread_mutex_unlock(&pool->lock);
+            chunk->size = backing_read(file, chunk->data, PREFETCH_CHUNK, chunk->offset);
+            pthread_mutex_lock(&pool->lock);
+            chunk->state = CHUNK_READY;
+        }
+        while( chunk->state == CHUNK_READING )
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        if( chunk->size < 0 ) {
+            chunk->state = CHUNK_EMPTY;
+            break;
+        }
+        if( position >= chunk->offset + chunk->size ) {
+            /* end of file */
+            pthread_mutex_unlock(&pool->lock);
+            return done;
+        }
+        count = chunk->offset + chunk->size - position;
+        if( count > size - done ) count = size - done;
+        memcpy(buf + done, chunk->data + (position - chunk->offset), count);
+        done += count;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if( done < size ) {
+        result = backing_read(file, buf + done, size - done, offset + done);
+        if( result < 0 ) return done ? done : result;
+        done += result;
+    }
+    return done;
+}
+
+/*
+ * Forget the chunks of a handle before it is closed.
+ */
+static void prefetch_release(struct catifs_file *file)
+{
+    struct prefetch_pool *pool = file->pool;
+    int i;
+
+    if( file->prefetching ) {
+        pthread_mutex_lock(&pool->lock);
+        for( i=0; i<PREFETCH_CHUNKS; i++ ) {
+            if( file->chunks[i].state == CHUNK_QUEUED )
+                prefetch_dequeue(pool, &file->chunks[i]);
+            while( file->chunks[i].state == CHUNK_READING )
+                pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    for( i=0; i<PREFETCH_CHUNKS; i++ )
+        free(file->chunks[i].data);
+}
+
+/*
+ * pread() of the content of a handle.
+ */
+static ssize_t file_pread(struct catifs_file *file, char *buf, size_t size, off_t offset)
+{
+    if( file->seekable )
+        return seekable_pread(file->fd, file->seekable, buf, size, offset);
+    if( file->prefetching )
+        return prefetch_read(file, buf, size, offset);
+    return backing_read(file, buf, size, offset);
+}
+
+static inline struct catifs_file *get_filep(struct fuse_file_info *fi)
+{
+	return (struct catifs_file *) (uintptr_t) fi->fh;
+}
+
+static int backing_compression(sqlite3 *db, const char *path)
+{
+    sqlite3_stmt *query;
+    int result = -ENOENT;
+
+    if( sqlite3_prepare_v2(db, "SELECT compression FROM catifs WHERE path=?1",
+                           -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    if( sqlite3_step(query) == SQLITE_ROW )
+        result = sqlite3_column_int(query, 0);
+    sqlite3_finalize(query);
+    return result;
+}
+
+/*
+ * Open the backing file of path and store a new handle in fi. Compressed
+ * backing files are read only.
+ */
+static int open_backing(const char *path, struct fuse_file_info *fi, int create, mode_t mode)
+{
+    struct catifs_mount *mount = get_mount();
+    struct catifs *fs;
+    struct catifs_file *file;
+    struct stat st, row;
+    const char *rpath;
+    int writing = (fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC);
+    int compression;
+    int result = 0;
+
+    fs = writing ? route_entry(path, &path) : route(path, &path);
+    if( ! fs ) return -EISDIR;
+    while( (compression = backing_compression(fs->db, path)) == -ENOENT && ! writing &&
+           route_next(fs) )
+        fs = route_next(fs);
+    if( compression < 0 ) return compression;
+    if( compression != COMPRESSION_NONE && writing ) return -EROFS;
+    if( writing ) {
+        result = unshare_backing(fs, path, fi->flags);
+        if( result != 0 ) return result;
+    }
+    rpath = real_path(fs->db, path);
+    if( ! rpath ) return -ENOENT;
+    file = calloc(1, sizeof(*file));
+    if( ! file ) {
+        free((char *) rpath);
+        return -ENOMEM;
+    }
+    if( create )
+        file->fd = open(rpath, fi->flags, mode);
+    else
+        file->fd = open(rpath, fi->flags);
+    if( file->fd == -1 ) {
+        result = -errno;
+    } else if( fstat(file->fd, &st) == -1 ) {
+        result = -errno;
+    } else if( compression == COMPRESSION_ZSTD_SEEKABLE ) {
+        result = seekable_open(file->fd, &file->seekable);
+        if( result == -EINVAL ) result = -EIO;
+    } else if( compression != COMPRESSION_NONE ) {
+        result = -EIO;
+    }
+    if( result != 0 ) {
+        if( file->fd != -1 ) close(file->fd);
+        free(file);
+    } else {
+        file->fs = fs;
+        file->size = st.st_size;
+        file->pool = writing ? NULL : mount->prefetch;
+        file->latency = mount->latency;
+        file->next = -1;
+        if( mount->cache && ! writing && ! file->seekable && load_stat(fs, path, &row) == 0 ) {
+            file->cache = mount->cache;
+            file->cache_key = cache_key(rpath, &row);
+        }
+        fi->fh = (uintptr_t) file;
+#ifdef DEBUG
+        fprintf(stderr, "open %s = %s, %d\n", path, rpath, file->fd);
+#endif
+    }
+    free((char *) rpath);
+    return result;
+}
+
+static int catifs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    return open_backing(path, fi, 1, mode);
+}
+
+static int catifs_open(const char *path, struct fuse_file_info *fi)
+{
+    return open_backing(path, fi, 0, 0);
+}
+
+static int catifs_read(const char *path, char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    struct catifs_file *file = get_filep(fi);
+    (void) path;
+    prefetch_track(file, size, offset);
+    return file_pread(file, buf, size, offset);
+}
+
+static int catifs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                           size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct catifs_file *file = get_filep(fi);
+    struct fuse_bufvec *src;
+    ssize_t res;
+
+    (void) path;
+
+    src = malloc(sizeof(struct fuse_bufvec));
+    if (src == NULL) return -ENOMEM;
+    *src = FUSE_BUFVEC_INIT(size);
+
+    prefetch_track(file, size, offset);
+    if( file->seekable || file->prefetching || file->cache || file->latency ) {
+        /* Decompressed, prefetched or cached data is given in memory, freed by FUSE */
+        src->buf[0].mem = malloc(size);
+        if( src->buf[0].mem == NULL ) {
+            free(src);
+            return -ENOMEM;
+        }
+        res = file_pread(file, src->buf[0].mem, size, offset);
+        if( res < 0 ) {
+            free(src->buf[0].mem);
+            free(src);
+            return res;
+        }
+        src->buf[0].size = res;
+    } else {
+        src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        src->buf[0].fd = file->fd;
+        src->buf[0].pos = offset;
+    }
+
+    *bufp = src;
+
+    return 0;
+}
+
+static int catifs_write(const char *path, const char *buf, size_t size,
+                        off_t offset, struct fuse_file_info *fi)
+{
+    (void) path;
+    int res;
+    
+#ifdef DEBUG
+    fprintf(stderr, "write %d %ld %ld\n", get_filep(fi)->fd, offset, size);
+#endif
+    res = pwrite(get_filep(fi)->fd, buf, size, offset);
+    if (res == -1) res = -errno;
+    return res;
+}
+
+static int catifs_write_buf(const char *path, struct fuse_bufvec *buf,
+                            off_t offset, struct fuse_file_info *fi)
+{
+    (void) path;
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+
+    fprintf(stderr, "write buf\n");
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = get_filep(fi)->fd;
+    dst.buf[0].pos = offset;
+
+    return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+
+/*
+ * Statistics of the storage written through path: its backing file, else
+ * the first volume of the catalogue, else the one of the database file.
+ */
+static int backing_statvfs(sqlite3 *db, const char *path, struct statvfs *vfs)
+{
+    sqlite3_stmt *query;
+    const char *target = strcmp(path, "/") != 0 ? real_path(db, path) : NULL;
+    const char *file;
+    int result = -1;
+
+    if( target ) {
+        result = statvfs(target, vfs);
+        free((char *) target);
+    }
+    if( result != 0 &&
+        sqlite3_prepare_v2(db, "SELECT prefix FROM catifs_volumes ORDER BY id LIMIT 1",
+                           -1, &query, 0) == SQLITE_OK ) {
+        if( sqlite3_step(query) == SQLITE_ROW )
+            result = statvfs((const char *) sqlite3_column_text(query, 0), vfs);
+        sqlite3_finalize(query);
+    }
+    file = sqlite3_db_filename(db, "main");
+    if( result != 0 && file && *file ) result = statvfs(file, vfs);
+    return result;
+}
+
+/*
+ * Report the size and the number of entries of the catalogue below path
+ * from the recursive aggregates: a directory without aggregates is empty
+ * and a file reports its own size. A path that does not exist reports
+ * the root of its shard, the root of the mount the sum of all shards.
+ */
+static int catifs_statfs(const char *path, struct statvfs *buf)
+{
+    struct catifs_mount *mount = get_mount();
+    struct statvfs vfs;
+    struct catifs *fs, *other;
+    const char *local;
+    sqlite3_int64 size, files, dirs;
+    sqlite3_int64 shard_size, shard_files, shard_dirs;
+    mode_t mode;
+    int i, result = -ENOENT;
+
+    fs = route(path, &local);
+    if( fs && strcmp(local, "/") != 0 ) {
+        /* The first shard merged at the root containing path */
+        for( other = fs; other && result == -ENOENT; other = route_next(other) ) {
+            result = path_entry(other->db, local, NULL, &mode, &size);
+            if( result == 0 ) fs = other;
+        }
+        if( result == 0 && S_ISDIR(mode) ) {
+            result = tree_get(fs->db, local, &size, &files, &dirs);
+            if( result == -ENOENT ) result = 0;
+        } else if( result == 0 ) {
+            files = 1;
+            dirs = 0;
+        } else if( result == -ENOENT ) {
+            result = tree_get(fs->db, "/", &size, &files, &dirs);
+            if( result == -ENOENT ) result = 0;
+        }
+        if( result != 0 ) return -EIO;
+    } else {
+        size = files = dirs = 0;
+        for( i=0; i<mount->count; i++ ) {
+            if( tree_get(mount->shards[i].fs.db, "/", &shard_size, &shard_files,
+                         &shard_dirs) == -EIO )
+                return -EIO;
+            size += shard_size;
+            files += shard_files;
+            dirs += shard_dirs;
+        }
+    }
+    memset(buf, 0, sizeof(*buf));
+    buf->f_bsize = 4096;
+    buf->f_frsize = 4096;
+    buf->f_blocks = (size + 4095) / 4096;
+    buf->f_files = files + dirs;
+    buf->f_namemax = 255;
+    /* Free space is the one of the backing storage, so that the mount
+       does not look full to df and to tools checking before writing */
+    if( fs && backing_statvfs(fs->db, local, &vfs) == 0 ) {
+        buf->f_bfree = (sqlite3_int64) vfs.f_bfree * vfs.f_frsize / buf->f_frsize;
+        buf->f_bavail = (sqlite3_int64) vfs.f_bavail * vfs.f_frsize / buf->f_frsize;
+        buf->f_ffree = vfs.f_ffree;
+        buf->f_favail = vfs.f_favail;
+        buf->f_blocks += buf->f_bfree;
+        buf->f_files += buf->f_ffree;
+    }
+    return 0;
+}
+
+static int catifs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int res;
+
+    (void) path;
+    /* This is called from every close on an open file, so call the
+       close on the underlying filesystem.	But since flush may be
+       called multiple times for an open file, this must not really
+       close the file.  This is important if used on a network
+       filesystem like NFS which flush the data/metadata on close() */
+    res = close(dup(get_filep(fi)->fd));
+    if (res == -1) return -errno;
+    return 0;
+}
+
+/*
+ * Store the new size and times of a file modified through the mount.
+ */
+static int write_back(struct catifs *fs, const char *path, int fd)
+{
+    struct stat real, buf;
+    int result;
+
+    if( fstat(fd, &real) == -1 ) return -errno;
+    if( db_begin(fs->db) != 0 ) return -EIO;
+    result = load_stat(fs, path, &buf);
+    if( result == 0 && real.st_size != buf.st_size ) {
+        result = tree_update(fs->db, path, real.st_size - buf.st_size, 0, 0);
+    }
+    if( result == 0 ) {
+        buf.st_size = real.st_size;
+        buf.st_blocks = real.st_blocks;
+        buf.st_mtim = real.st_mtim;
+        buf.st_ctim = real.st_ctim;
+        result = store_stat(fs, path, &buf);
+    }
+    if( result == 0 ) result = change_log(fs->db, CHANGE_WRITE, path, NULL);
+    return db_end(fs->db, result);
+}
+
+static int catifs_release(const char *path, struct fuse_file_info *fi)
+{
+    struct catifs_file *file = get_filep(fi);
+
+#ifdef DEBUG
+    fprintf(stderr, "close %s %d\n", path, file->fd);
+#endif
+    if( (fi->flags & O_ACCMODE) != O_RDONLY ) {
+        /* The path in the shard of the entry does not depend on the shard */
+        route(path, &path);
+        write_back(file->fs, path, file->fd);
+    }
+    prefetch_release(file);
+    close(file->fd);
+    seekable_free(file->seekable);
+    free(file);
+    fi->fh = 0;
+    return 0;
+}
+
+// static int catifs_fsync(const char *path, int isdatasync,
+// 		     struct fuse_file_info *fi)
+// {
+// 	return 0;
+// }
+
+// #ifdef HAVE_POSIX_FALLOCATE
+// static int catifs_fallocate(const char *path, int mode,
+// 			off_t offset, off_t length, struct fuse_file_info *fi)
+// {
+// }
+// #endif
+
+/*
+ * Extended attributes are stored in catifs_attrs without the "user."
+ * prefix. Read-only "user.catifs.*" attributes give the recursive
+ * aggregates of directories.
+ */
+#define XATTR_USER "user."
+#define XATTR_AGGREGATES "user.catifs."
+
+static const char *aggregate_xattrs[] = {
+    XATTR_AGGREGATES "size",
+    XATTR_AGGREGATES "files",
+    XATTR_AGGREGATES "dirs",
+};
+
+static int xattr_copy(char *value, size_t size, const void *data, size_t len)
+{
+    if( size == 0 ) return len;
+    if( size < len ) return -ERANGE;
+    memcpy(value, data, len);
+    return len;
+}
+
+/*
+ * Return 1 if path is a directory, 0 if it is another entry.
+ */
+static int xattr_is_dir(sqlite3 *db, const char *path, sqlite3_int64 *rowid)
+{
+    mode_t mode;
+    int result;
+
+    *rowid = 0;
+    if( strcmp(path, "/")==0 ) return 1;
+    result = path_entry(db, path, rowid, &mode, NULL);
+    if( result != 0 ) return result;
+    return S_ISDIR(mode) ? 1 : 0;
+}
+
+static int catifs_getxattr(const char *path, const char *name, char *value,
+                           size_t size)
+{
+    struct catifs *fs;
+    sqlite3 *db;
+    sqlite3_stmt *query;
+    sqlite3_int64 rowid, aggregates[3];
+    char number[32];
+    int is_dir;
+    int result;
+    int i;
+
+    fs = route(path, &path);
+    if( ! fs ) return -ENODATA;
+    /* Shards merged at the root are tried in order */
+    while( (is_dir = xattr_is_dir(fs->db, path, &rowid)) == -ENOENT && route_next(fs) )
+        fs = route_next(fs);
+    if( is_dir < 0 ) return is_dir;
+    db = fs->db;
+    if( strncmp(name, XATTR_AGGREGATES, strlen(XATTR_AGGREGATES)) == 0 ) {
+        if( ! is_dir ) return -ENODATA;
+        if( tree_get(db, path, &aggregates[0], &aggregates[1], &aggregates[2]) == -EIO )
+            return -EIO;
+        for( i=0; i<3; i++ ) {
+            if( strcmp(name, aggregate_xattrs[i]) == 0 ) {
+                snprintf(number, sizeof(number), "%lld", (long long) aggregates[i]);
+                return xattr_copy(value, size, number, strlen(number));
+            }
+        }
+        return -ENODATA;
+    }
+    if( strncmp(name, XATTR_USER, strlen(XATTR_USER)) != 0 || ! rowid )
+        return -ENODATA;
+    if( sqlite3_prepare_v2(db,
+            "SELECT value FROM catifs_attrs WHERE st_ino=?1 AND name=?2",
+            -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    sqlite3_bind_int64(query, 1, rowid);
+    sqlite3_bind_text(query, 2, name + strlen(XATTR_USER), -1, SQLITE_STATIC);
+    if( sqlite3_step(query) == SQLITE_ROW ) {
+        result = xattr_copy(value, size, sqlite3_column_blob(query, 0),
+                            sqlite3_column_bytes(query, 0));
+    } else {
+        result = -ENODATA;
+    }
+    sqlite3_finalize(query);
+    return result;
+}
+
+static int catifs_listxattr(const char *path, char *list, size_t size)
+{
+    struct catifs *fs;
+    sqlite3 *db;
+    sqlite3_stmt *query;
+    sqlite3_int64 rowid;
+    size_t len = 0;
+    int is_dir;
+    int i;
+
+    fs = route(path, &path);
+    if( ! fs ) return 0;
+    while( (is_dir = xattr_is_dir(fs->db, path, &rowid)) == -ENOENT && route_next(fs) )
+        fs = route_next(fs);
+    if( is_dir < 0 ) return is_dir;
+    db = fs->db;
+    if( is_dir ) {
+        for( i=0; i<3; i++ ) {
+            size_t n = strlen(aggregate_xattrs[i]) + 1;
+            if( size && len + n <= size ) memcpy(list + len, aggregate_xattrs[i], n);
+            len += n;
+        }
+    }
+    if( rowid ) {
+        if( sqlite3_prepare_v2(db,
+                "SELECT name FROM catifs_attrs WHERE st_ino=?1",
+                -1, &query, 0) != SQLITE_OK )
+            return -EIO;
+        sqlite3_bind_int64(query, 1, rowid);
+        while( sqlite3_step(query) == SQLITE_ROW ) {
+            size_t n = sqlite3_column_bytes(query, 0) + 1;
+            if( size && len + strlen(XATTR_USER) + n <= size ) {
+                memcpy(list + len, XATTR_USER, strlen(XATTR_USER));
+                memcpy(list + len + strlen(XATTR_USER), sqlite3_column_text(query, 0), n);
+            }
+            len += strlen(XATTR_USER) + n;
+        }
+        sqlite3_finalize(query);
+    }
+    if( size && len > size ) return -ERANGE;
+    return len;
+}
+
+/*
+ * Set the attribute name (without the "user." prefix) of path.
+ */
+static int attr_set(sqlite3 *db, const char *path, const char *name, const char *value,
+                    size_t size, int flags)
+{
+    sqlite3_stmt *query;
+    sqlite3_int64 rowid;
+    const char *sql;
+    int result;
+
+    result = xattr_is_dir(db, path, &rowid);
+    if( result < 0 ) return result;
+    if( ! rowid ) return -ENOTSUP;
+    if( flags & XATTR_CREATE )
+        sql = "INSERT INTO catifs_attrs (st_ino, name, value) VALUES (?1, ?2, ?3)";
+    else if( flags & XATTR_REPLACE )
+        sql = "UPDATE catifs_attrs SET value=?3 WHERE st_ino=?1 AND name=?2";
+    else
+        sql = "INSERT OR REPLACE INTO catifs_attrs (st_ino, name, value) VALUES (?1, ?2, ?3)";
+    if( db_begin(db) != 0 ) return -EIO;
+    if( sqlite3_prepare_v2(db, sql, -1, &query, 0) != SQLITE_OK )
+        return db_end(db, -EIO);
+    sqlite3_bind_int64(query, 1, rowid);
+    sqlite3_bind_text(query, 2, name, -1, SQLITE_STATIC);
+    sqlite3_bind_text(query, 3, value, size, SQLITE_STATIC);
+    result = sqlite3_step(query);
+    if( result == SQLITE_DONE ) {
+        result = (flags & XATTR_REPLACE) && sqlite3_changes(db) == 0 ? -ENODATA : 0;
+    } else {
+        result = sqlite3_extended_errcode(db) == SQLITE_CONSTRAINT_PRIMARYKEY ? -EEXIST : -EIO;
+    }
+    sqlite3_finalize(query);
+    if( result == 0 ) result = change_log(db, CHANGE_SET_ATTR, path, name);
+    return db_end(db, result);
+}
+
+static int catifs_setxattr(const char *path, const char *name, const char *value,
+                           size_t size, int flags)
+{
+    sqlite3 *db;
+
+    if( strncmp(name, XATTR_AGGREGATES, strlen(XATTR_AGGREGATES)) == 0 )
+        return -EPERM;
+    if( strncmp(name, XATTR_USER, strlen(XATTR_USER)) != 0 )
+        return -ENOTSUP;
+    db = route_db(&path);
+    if( ! db ) return -ENOTSUP;
+    return attr_set(db, path, name + strlen(XATTR_USER), value, size, flags);
+}
+
+static int catifs_removexattr(const char *path, const char *name)
+{
+    sqlite3 *db;
+    sqlite3_stmt *query;
+    sqlite3_int64 rowid;
+    int result;
+
+    if( strncmp(name, XATTR_AGGREGATES, strlen(XATTR_AGGREGATES)) == 0 )
+        return -EPERM;
+    if( strncmp(name, XATTR_USER, strlen(XATTR_USER)) != 0 )
+        return -ENODATA;
+    db = route_db(&path);
+    if( ! db ) return -ENOTSUP;
+    result = xattr_is_dir(db, path, &rowid);
+    if( result < 0 ) return result;
+    if( ! rowid ) return -ENODATA;
+    if( db_begin(db) != 0 ) return -EIO;
+    if( sqlite3_prepare_v2(db,
+            "DELETE FROM catifs_attrs WHERE st_ino=?1 AND name=?2",
+            -1, &query, 0) != SQLITE_OK )
+        return db_end(db, -EIO);
+    sqlite3_bind_int64(query, 1, rowid);
+    sqlite3_bind_text(query, 2, name + strlen(XATTR_USER), -1, SQLITE_STATIC);
+    if( sqlite3_step(query) == SQLITE_DONE )
+        result = sqlite3_changes(db) ? 0 : -ENODATA;
+    else
+        result = -EIO;
+    sqlite3_finalize(query);
+    if( result == 0 )
+        result = change_log(db, CHANGE_REMOVE_ATTR, path, name + strlen(XATTR_USER));
+    return db_end(db, result);
+}
+
+// #ifdef HAVE_LIBULOCKMGR
+// static int catifs_lock(const char *path, struct fuse_file_info *fi, int cmd,
+// 		    struct flock *lock)
+// {
+// }
+// #endif
+
+// static int catifs_flock(const char *path, struct fuse_file_info *fi, int op)
+// {
+// 	return 0;
+// }
+
+static struct fuse_operations xmp_oper = {
+    .init       = catifs_init,
+    .destroy    = catifs_destroy,
+    .getattr	= cati_getattr,
+//    .access		= catifs_access,
+    .symlink    = catifs_symlink,
+    .readlink   = catifs_readlink,
+    .opendir    = catifs_opendir,
+    .readdir    = catifs_readdir,
+    .releasedir = catifs_releasedir,
+//     .mknod		= catifs_mknod,
+    .mkdir      = catifs_mkdir,
+    .unlink     = catifs_unlink,
+    .rmdir	= catifs_rmdir,
+    .rename     = catifs_rename,
+    .link       = catifs_link,
+    .chmod      = catifs_chmod,
+    .chown      = catifs_chown,
+//     .truncate   = catifs_truncate,
+    .utimens    = catifs_utimens,
+    .create     = catifs_create,
+    .open       = catifs_open,
+    .read       = catifs_read,
+    .read_buf   = catifs_read_buf,
+    .write      = catifs_write,
+// Commented out until I find why writing to a file is not working
+//     .write_buf  = catifs_write_buf,
+    .statfs     = catifs_statfs,
+    .flush      = catifs_flush,
+    .release    = catifs_release,
+//         .fsync      = catifs_fsync,
+// #ifdef HAVE_POSIX_FALLOCATE
+//     .fallocate	= catifs_fallocate,
+// #endif
+    .setxattr   = catifs_setxattr,
+    .getxattr   = catifs_getxattr,
+    .listxattr  = catifs_listxattr,
+    .removexattr = catifs_removexattr,
+    .ioctl      = catifs_ioctl,
+// #ifdef HAVE_LIBULOCKMGR
+// 	.lock		= catifs_lock,
+// #endif
+// 	.flock		= catifs_flock,
+};
+
+
+/*
+ * Control socket "<database>.sock" of a mounted shard. Scanners push
+ * modifications to the running mount instead of opening the database:
+ * they do not compete with the mount for the write lock and the kernel
+ * entries they change are invalidated. A client writes one request per
+ * line, with tab separated fields, then shuts down its side of the
+ * connection:
+ *
+ *     add <real path> <path>
+ *     mkdir <path>                 (and missing ancestors)
+ *     remove <path>
+ *     set-attr <path> <name> <value>
+ *
+ * The batch is applied in a single transaction of the mount connection,
+ * then the server answers one line per request: 0 or -errno. Batches
+ * over CONTROL_MAX_BATCH bytes are dropped, clients split their requests
+ * in batches of CONTROL_CLIENT_BATCH bytes (see control_mkdirs()).
+ */
+#define CONTROL_SUFFIX ".sock"
+#define CONTROL_MAX_BATCH (64 << 20)
+#define CONTROL_CLIENT_BATCH (1 << 20)  /* bytes of requests sent at once by a client */
+#define CONTROL_TIMEOUT 10  /* seconds without data before a client is dropped */
+
+/*
+ * Return the control socket path of a database file in a new string.
+ */
+static char *control_path(const char *database)
+{
+    char *absolute, *path;
+
+    if( strncmp(database, "file:", 5) == 0 ) return NULL;
+    absolute = realpath(database, NULL);
+    if( ! absolute ) return NULL;
+    path = malloc(strlen(absolute) + sizeof(CONTROL_SUFFIX));
+    if( path ) sprintf(path, "%s" CONTROL_SUFFIX, absolute);
+    free(absolute);
+    if( path && strlen(path) >= sizeof(((struct sockaddr_un *) 0)->sun_path) ) {
+        free(path);
+        path = NULL;
+    }
+    return path;
+}
+
+static void control_invalidate(struct catifs_mount *mount, struct catifs_shard *shard,
+                               const char *path)
+{
+    char *full, *slash;
+
+    if( ! mount->fuse ) return;
+    full = malloc(shard->prefix_len + strlen(path) + 1);
+    if( ! full ) return;
+    sprintf(full, "%s%s", shard->prefix, path);
+    fuse_invalidate_path(mount->fuse, full);
+    slash = strrchr(full, '/');
+    if( slash && slash != full ) {
+        *slash = 0;
+        fuse_invalidate_path(mount->fuse, full);
+    }
+    free(full);
+}
+
+/*
+ * Apply one request line, return 0 or -errno.
+ */
+static int control_request(struct catifs *fs, char *line, char **path)
+{
+    char *field[4] = { NULL };
+    int count = 0;
+
+    field[count++] = line;
+    while( count < 4 && (line = strchr(line, '\t')) ) {
+        *line++ = 0;
+        field[count++] = line;
+    }
+    *path = NULL;
+    if( strcmp(field[0], "add") == 0 && count == 3 ) {
+        *path = field[2];
+        return add_path_to_database(fs, field[1], field[2]);
+    } else if( strcmp(field[0], "mkdir") == 0 && count == 2 ) {
+        *path = field[1];
+        return make_dirs(fs, field[1], 0755, getuid(), getgid());
+    } else if( strcmp(field[0], "remove") == 0 && count == 2 ) {
+        *path = field[1];
+        return strcmp(field[1], "/") == 0 ? -EBUSY : remove_path(fs, field[1]);
+    } else if( strcmp(field[0], "set-attr") == 0 && count == 4 ) {
+        *path = field[1];
+        return attr_set(fs->db, field[1], field[2], field[3], strlen(field[3]), 0);
+    }
+    return -EINVAL;
+}
+
+/*
+ * Read a whole batch from a client, apply it and send the results.
+ */
+static void control_batch(struct catifs_mount *mount, struct catifs_shard *shard, int client)
+{
+    struct timeval timeout = { CONTROL_TIMEOUT, 0 };
+    char *batch = NULL, *line, *next, *grown;
+    char **paths = NULL;
+    int *results = NULL;
+    size_t size = 0, allocated = 0, count = 0, i;
+    ssize_t n;
+    char answer[16];
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    for( ;; ) {
+        if( size + 1 >= allocated ) {
+            allocated = allocated ? 2 * allocated : 65536;
+            grown = allocated <= CONTROL_MAX_BATCH ? realloc(batch, allocated) : NULL;
+            if( ! grown ) goto done;
+            batch = grown;
+        }
+        n = read(client, batch + size, allocated - size - 1);
+        if( n == -1 && errno == EINTR ) continue;
+        if( n == -1 ) goto done;
+        if( n == 0 ) break;
+        size += n;
+    }
+    batch[size] = 0;
+    for( line = batch; *line; line = next + 1 ) {
+        next = strchr(line, '\n');
+        if( ! next ) break;
+        ++count;
+    }
+    paths = calloc(count ? count : 1, sizeof(*paths));
+    results = calloc(count ? count : 1, sizeof(*results));
+    if( ! paths || ! results ) goto done;
+
+    if( db_begin(shard->fs.db) != 0 ) goto done;
+    for( i=0, line=batch; i<count; i++, line=next + 1 ) {
+        next = strchr(line, '\n');
+        *next = 0;
+        results[i] = control_request(&shard->fs, line, &paths[i]);
+    }
+    if( db_end(shard->fs.db, 0) != 0 ) {
+        for( i=0; i<count; i++ )
+            if( results[i] == 0 ) results[i] = -EIO;
+    }
+    for( i=0; i<count; i++ ) {
+        if( results[i] == 0 && paths[i] ) control_invalidate(mount, shard, paths[i]);
+        snprintf(answer, sizeof(answer), "%d\n", results[i]);
+        if( write(client, answer, strlen(answer)) == -1 ) break;
+    }
+done:
+    free(batch);
+    free(paths);
+    free(results);
+}
+
+static void *control_serve(void *arg)
+{
+    struct catifs_mount *mount = arg;
+    struct pollfd *fds;
+    int client;
+    int i;
+
+    fds = calloc(mount->count + 1, sizeof(*fds));
+    if( ! fds ) return NULL;
+    fds[0].fd = mount->control_pipe[0];
+    fds[0].events = POLLIN;
+    for( i=0; i<mount->count; i++ ) {
+        fds[i + 1].fd = mount->shards[i].control;
+        fds[i + 1].events = POLLIN;
+    }
+    for( ;; ) {
+        if( poll(fds, mount->count + 1, -1) == -1 ) {
+            if( errno == EINTR ) continue;
+            break;
+        }
+        if( fds[0].revents ) break;
+        for( i=0; i<mount->count; i++ ) {
+            if( ! (fds[i + 1].revents & POLLIN) ) continue;
+            client = accept(fds[i + 1].fd, NULL, NULL);
+            if( client == -1 ) continue;
+            control_batch(mount, &mount->shards[i], client);
+            close(client);
+        }
+    }
+    free(fds);
+    return NULL;
+}
+
+/*
+ * Listen on the control socket of every shard. A socket left by a mount
+ * that is no longer running is replaced.
+ */
+static int control_start(struct catifs_mount *mount)
+{
+    struct sockaddr_un address;
+    int i;
+
+    if( pipe(mount->control_pipe) == -1 ) return -errno;
+    for( i=0; i<mount->count; i++ ) {
+        struct catifs_shard *shard = &mount->shards[i];
+        const char *file = sqlite3_db_filename(shard->fs.db, "main");
+
+        shard->control = -1;
+        shard->control_path = file && *file ? control_path(file) : NULL;
+        if( ! shard->control_path ) continue;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, shard->control_path);
+        shard->control = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if( shard->control != -1 &&
+            connect(shard->control, (struct sockaddr *) &address, sizeof(address)) == 0 ) {
+            fprintf(stderr, "%s is used by another mount\n", shard->control_path);
+            close(shard->control);
+            shard->control = -1;
+            free(shard->control_path);
+            shard->control_path = NULL;
+            continue;
+        }
+        unlink(shard->control_path);
+        if( shard->control == -1 ||
+            bind(shard->control, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+            chmod(shard->control_path, 0600) == -1 ||
+            listen(shard->control, 16) == -1 ) {
+            fprintf(stderr, "Cannot listen on %s: %s\n", shard->control_path, strerror(errno));
+            if( shard->control != -1 ) close(shard->control);
+            shard->control = -1;
+            free(shard->control_path);
+            shard->control_path = NULL;
+        }
+    }
+    if( pthread_create(&mount->control, NULL, control_serve, mount) != 0 )
+        return -EAGAIN;
+    mount->control_running = 1;
+    return 0;
+}
+
+static void control_stop(struct catifs_mount *mount)
+{
+    int i;
+
+    control_join(mount);
+    for( i=0; i<mount->count; i++ ) {
+        struct catifs_shard *shard = &mount->shards[i];
+        if( shard->control != -1 ) {
+            close(shard->control);
+            unlink(shard->control_path);
+        }
+        free(shard->control_path);
+    }
+    close(mount->control_pipe[0]);
+    close(mount->control_pipe[1]);
+}
+
+/*
+ * Send a batch of requests to the control socket of a running mount of
+ * database and store the answers in reply. Return -ENOENT if no mount
+ * is listening.
+ */
+static int control_send(const char *database, const char *requests,
+                        char *reply, size_t size)
+{
+    struct sockaddr_un address;
+    char *path;
+    ssize_t n;
+    size_t done = 0;
+    int fd;
+    int result = 0;
+
+    path = control_path(database);
+    if( ! path ) return -ENOENT;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    free(path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if( fd == -1 ) return -errno;
+    if( connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1 ) {
+        close(fd);
+        return -ENOENT;
+    }
+    result = write_full(fd, requests, strlen(requests));
+    shutdown(fd, SHUT_WR);
+    while( result == 0 && done + 1 < size ) {
+        n = read(fd, reply + done, size - done - 1);
+        if( n == -1 && errno == EINTR ) continue;
+        if( n == -1 ) result = -errno;
+        if( n <= 0 ) break;
+        done += n;
+    }
+    reply[done] = 0;
+    close(fd);
+    return result;
+}
+
+/*
+ * Create directories (and missing ancestors) with a running mount of
+ * database. Paths are sent in batches of at most CONTROL_CLIENT_BATCH
+ * bytes, each applied in its own transaction, and every failure is
+ * reported. Return the number of paths not created or -ENOENT if no
+ * mount is listening (nothing was created).
+ */
+static int control_mkdirs(const char *database, char **paths, size_t count)
+{
+    const size_t requests_max = CONTROL_CLIENT_BATCH / 8;  /* shortest is "mkdir\tx\n" */
+    char *requests, *reply, *answer;
+    size_t first, next, length, i;
+    int failures = 0, result = 0;
+
+    for( i=0; i<count; i++ ) {
+        if( strpbrk(paths[i], "\t\n") || strlen(paths[i]) + 8 > CONTROL_CLIENT_BATCH )
+            return -EINVAL;
+    }
+    requests = malloc(CONTROL_CLIENT_BATCH);
+    /* An answer is at most "-2147483648\n" */
+    reply = malloc(16 * requests_max + 1);
+    if( ! requests || ! reply ) {
+        free(requests);
+        free(reply);
+        return -ENOMEM;
+    }
+    for( first=0; first<count; first=next ) {
+        for( next=first, length=0;
+             next<count && length + strlen(paths[next]) + 8 <= CONTROL_CLIENT_BATCH; next++ )
+            length += sprintf(requests + length, "mkdir\t%s\n", paths[next]);
+        result = control_send(database, requests, reply, 16 * (next - first) + 1);
+        if( result == -ENOENT && first == 0 ) break;
+        if( result != 0 ) {
+            fprintf(stderr, "Cannot send %s ... %s: %s\n", paths[first], paths[next - 1],
+                    strerror(-result));
+            failures += next - first;
+            continue;
+        }
+        for( i=first, answer=reply; i<next; i++ ) {
+            int status = *answer ? atoi(answer) : -EIO;
+            if( status != 0 ) {
+                fprintf(stderr, "Cannot create %s: %s\n", paths[i], strerror(-status));
+                ++failures;
+            }
+            answer += strcspn(answer, "\n");
+            if( *answer ) ++answer;
+        }
+    }
+    free(requests);
+    free(reply);
+    return result == -ENOENT && first == 0 && count ? -ENOENT : failures;
+}
+
+
+/*
+ * Show a help message and quit.
+ */
+static void showHelp(const char *argv0) {
+  fprintf(stderr, "Usage: %s [options] mount <database>[@<prefix>] ... <mount-point>\n", argv0);
+  fprintf(stderr, "Usage: %s [options] add <database> <path> <dest_path>\n", argv0);
+  fprintf(stderr, "Usage: %s [options] mkdir <database> [<path> ...]\n", argv0);
+  fprintf(stderr, "Usage: %s [options] aggregate <database>\n", argv0);
+  fprintf(stderr, "Usage: %s [options] compact <database>\n", argv0);
+  fprintf(stderr, "Usage: %s [options] volume <database> list\n", argv0);
+  fprintf(stderr, "Usage: %s [options] volume <database> add <prefix>\n", argv0);
+  fprintf(stderr, "Usage: %s [options] volume <database> move <prefix> <new_prefix>\n", argv0);
+  fprintf(stderr, "Usage: %s [options] hash <database>\n", argv0);
+  fprintf(stderr, "Usage: %s [options] dedup <database>\n", argv0);
+  fprintf(stderr, "Usage: %s [options] compress <database> [<path>]\n", argv0);
+  fprintf(stderr, "Usage: %s [options] changes <database> [--since <seq>]\n", argv0);
+  fprintf(stderr, "Usage: %s [options] changes <database> --prune <seq>\n", argv0);
+  fprintf(stderr, "Usage: %s [options] snapshot <database> [<name>]\n", argv0);
+  fprintf(stderr, "Usage: %s [options] dump <database> [<file>]\n", argv0);
+  fprintf(stderr, "Usage: %s [options] load <database> [<file>]\n", argv0);
+  fprintf(stderr,
+     "Options:\n"
+     "   -c        Create database if it does not exists\n"
+     "   -C <dir>  Copy backing files in a local cache directory when they are read\n"
+     "   -j <n>    Number of threads used to hash files (default: one per CPU)\n"
+     "   -l <us>   Latency added to every read of a backing file (benchmarks)\n"
+     "   -p <n>    Number of threads reading ahead sequential reads (default: 4, 0 disables)\n"
+     "   -r        Remove backing files that are no longer used after dedup or compress\n"
+     "   -S <n>    Size limit of the cache directory in MiB (default: 1024)\n"
+     "   --snapshot <name>  Mount the snapshot name of the databases read only (the first\n"
+     "             mount of a snapshot computes its aggregates over all the rows)\n"
+  );
+  exit(1);
+}
+
+
+/*
+ * Make st_ino an alias of the rowid in databases created with
+ * "st_ino INT PRIMARY KEY" (a NULL column), so that catifs_attrs and the
+ * history of snapshots, which refer to rows by st_ino, are not moved to
+ * other rows by a VACUUM. Rows are copied with their rowid as st_ino,
+ * other columns, indexes and triggers of catifs are kept.
+ */
+static int upgrade_st_ino(sqlite3 *db)
+{
+    sqlite3_stmt *query;
+    char *columns = NULL, *definitions = NULL, *others = sqlite3_mprintf("");
+    char *sql = NULL;
+    int alias = 0, result = 0;
+
+    if( sqlite3_prepare_v2(db, "SELECT name, type, pk, \"notnull\", dflt_value "
+                           "FROM pragma_table_info('catifs')", -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    while( sqlite3_step(query) == SQLITE_ROW ) {
+        const char *name = (const char *) sqlite3_column_text(query, 0);
+        const char *type = (const char *) sqlite3_column_text(query, 1);
+        const char *value = (const char *) sqlite3_column_text(query, 4);
+
+        if( strcmp(name, "st_ino") == 0 ) {
+            alias = sqlite3_column_int(query, 2) == 1 && sqlite3_stricmp(type, "INTEGER") == 0;
+            definitions = sqlite3_mprintf("%z%s\n  st_ino INTEGER PRIMARY KEY", definitions,
+                                          definitions ? "," : "");
+            continue;
+        }
+        columns = sqlite3_mprintf("%z%s\"%w\"", columns, columns ? ", " : "", name);
+        definitions = sqlite3_mprintf("%z%s\n  \"%w\" %s%s%s%s", definitions,
+                                      definitions ? "," : "", name, type,
+                                      sqlite3_column_int(query, 3) ? " NOT NULL" : "",
+                                      value ? " DEFAULT " : "", value ? value : "");
+    }
+    sqlite3_finalize(query);
+    if( ! alias && columns && definitions &&
+        sqlite3_prepare_v2(db, "SELECT sql FROM sqlite_master WHERE type IN ('index', 'trigger') "
+                           "AND tbl_name='catifs' AND sql IS NOT NULL",
+                           -1, &query, 0) == SQLITE_OK ) {
+        while( sqlite3_step(query) == SQLITE_ROW )
+            others = sqlite3_mprintf("%z%s;\n", others, sqlite3_column_text(query, 0));
+        sqlite3_finalize(query);
+        sql = sqlite3_mprintf(
+            "CREATE TABLE catifs_rowid(%s\n);\n"
+            "INSERT INTO catifs_rowid (st_ino, %s) SELECT rowid, %s FROM catifs ORDER BY rowid;\n"
+            "DROP TABLE catifs;\n"
+            "ALTER TABLE catifs_rowid RENAME TO catifs;\n"
+            "%s",
+            definitions, columns, columns, others);
+        if( ! sql || sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK ) {
+#ifdef DEBUG
+            fprintf(stderr, "cannot make st_ino an alias of rowid: %s\n", sqlite3_errmsg(db));
+#endif
+            result = -EIO;
+        }
+    } else if( ! alias ) {
+        result = -EIO;
+    }
+    sqlite3_free(sql);
+    sqlite3_free(columns);
+    sqlite3_free(definitions);
+    sqlite3_free(others);
+    return result;
+}
+
+/*
+ * Create the tables added after the initial schema in databases
+ * created by an older version or by add_dir_to_db.py.
+ */
+static int upgrade_schema(sqlite3 *db)
+{
+    int result = 0;
+
+    if( db_begin(db) != 0 ) return -EIO;
+    result = upgrade_st_ino(db);
+    if( result == 0 &&
+        sqlite3_exec(db, "SELECT 1 FROM catifs_tree LIMIT 1", 0, 0, 0) != SQLITE_OK ) {
+        if( sqlite3_exec(db, tree_schema, 0, 0, 0) != SQLITE_OK ||
+            sqlite3_exec(db, tree_rebuild, 0, 0, 0) != SQLITE_OK )
+            result = -EIO;
+    }
+    if( result == 0 &&
+        sqlite3_exec(db, "SELECT volume FROM catifs LIMIT 1", 0, 0, 0) != SQLITE_OK ) {
+        if( sqlite3_exec(db, volumes_schema, 0, 0, 0) != SQLITE_OK )
+            result = -EIO;
+    }
+    if( result == 0 &&
+        sqlite3_exec(db, "SELECT compression FROM catifs LIMIT 1", 0, 0, 0) != SQLITE_OK ) {
+        if( sqlite3_exec(db, compression_schema, 0, 0, 0) != SQLITE_OK )
+            result = -EIO;
+    }
+    if( result == 0 &&
+        sqlite3_exec(db, "SELECT 1 FROM catifs_changes LIMIT 1", 0, 0, 0) != SQLITE_OK ) {
+        if( sqlite3_exec(db, changes_schema, 0, 0, 0) != SQLITE_OK )
+            result = -EIO;
+    }
+    if( result == 0 &&
+        sqlite3_exec(db, "SELECT link_target FROM catifs LIMIT 1", 0, 0, 0) != SQLITE_OK ) {
+        if( sqlite3_exec(db, links_schema, 0, 0, 0) != SQLITE_OK )
+            result = -EIO;
+    }
+    if( result == 0 && sqlite3_exec(db, parent_schema, 0, 0, 0) != SQLITE_OK )
+        result = -EIO;
+    return db_end(db, result);
+}
+
+
+static void open_database(struct catifs *fs, const char *dbString, int createFlag) {
+    sqlite3 *db;
+    int flags;
+    int rc;
+    
+    if (createFlag)
+        flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI | SQLITE_OPEN_CREATE;
+    else
+        flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI;
+    rc = sqlite3_open_v2(dbString, &db, flags, 0);
+    if( rc != SQLITE_OK ) {
+        fprintf(stderr, "Cannot open sqlite database: %s\n", dbString);
+        exit(1);
+    }
+    rc = sqlite3_exec(db, "SELECT 1 FROM catifs LIMIT 1", 0, 0, 0);
+    if( rc != SQLITE_OK && createFlag ){
+        rc = sqlite3_exec(db, schema, 0, 0, 0);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "Cannot create database schema: %s\n", sqlite3_errmsg(db));
+            sqlite3_close(db);
+            exit(1);
+        }
+        rc = sqlite3_exec(db, "SELECT 1 FROM catifs LIMIT 1", 0, 0, 0);
+    }
+    if( rc != SQLITE_OK ){
+        fprintf(stderr, "Invalid SQLite database schema: %s\n", dbString);
+        sqlite3_close(db);
+        exit(1);
+    }
+    if( upgrade_schema(db) != 0 ) {
+        fprintf(stderr, "Cannot upgrade database schema: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        exit(1);
+    }
+    fs->db = db;
+    fs->compact = sqlite3_exec(db, "SELECT stat FROM catifs LIMIT 1", 0, 0, 0) == SQLITE_OK;
+    fs->hashing = sqlite3_exec(db, "SELECT content_hash FROM catifs LIMIT 1", 0, 0, 0) == SQLITE_OK;
+}
+
+/*
+ * SQL function catifs_stat_pack(st_dev, st_nlink, ..., st_ctim_nsec)
+ * returning the stat record of compact databases.
+ */
+static void sql_stat_pack(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    int64_t fields[STAT_RECORD_FIELDS];
+    unsigned char record[STAT_RECORD_MAX];
+    int i;
+
+    for( i=0; i<STAT_RECORD_FIELDS; i++ )
+        fields[i] = sqlite3_value_int64(argv[i]);
+    sqlite3_result_blob(context, record, stat_pack(fields, record), SQLITE_TRANSIENT);
+}
+
+/*
+ * Comma separated columns of a history table (without row_id and died)
+ * in cols and prefixed with "OLD." in old, to be freed with
+ * sqlite3_free().
+ */
+static int history_columns(sqlite3 *db, const char *table, char **cols, char **old)
+{
+    sqlite3_stmt *query;
+    const char *name;
+    char *sql = sqlite3_mprintf("PRAGMA main.table_info(%s)", table);
+    int result = 0;
+
+    *cols = *old = NULL;
+    if( ! sql || sqlite3_prepare_v2(db, sql, -1, &query, 0) != SQLITE_OK ) {
+        sqlite3_free(sql);
+        return -EIO;
+    }
+    sqlite3_free(sql);
+    while( sqlite3_step(query) == SQLITE_ROW ) {
+        name = (const char *) sqlite3_column_text(query, 1);
+        if( strcmp(name, "row_id") == 0 || strcmp(name, "died") == 0 ) continue;
+        *cols = *cols ? sqlite3_mprintf("%z, \"%w\"", *cols, name) : sqlite3_mprintf("\"%w\"", name);
+        *old = *old ? sqlite3_mprintf("%z, OLD.\"%w\"", *old, name) : sqlite3_mprintf("OLD.\"%w\"", name);
+        if( ! *cols || ! *old ) result = -ENOMEM;
     }
     sqlite3_finalize(query);
+    if( result == 0 && ! *cols ) result = -EIO;
+    if( result != 0 ) {
+        sqlite3_free(*cols);
+        sqlite3_free(*old);
+    }
     return result;
 }
 
-static int catifs_chown(const char *path, uid_t uid, gid_t gid,
-		     struct fuse_file_info *fi)
+/*
+ * Create the tables and triggers keeping the versions of rows seen by
+ * snapshots. The triggers copy the columns that exist when the first
+ * snapshot is taken.
+ */
+static int snapshot_schema(sqlite3 *db)
 {
-    sqlite3 *db;
-    int rc;
-    sqlite3_stmt *query;
+    char *cols, *old, *attr_cols, *attr_old, *sql;
     int result;
-    
-    db = fuse_get_context()->private_data;
-    if (uid == -1) {
-        rc = sqlite3_prepare_v2(db,
-                "UPDATE catifs SET st_gid=?3 WHERE path=?1",
-                -1, &query, 0);
-    } else if (gid == -1) {
-        rc = sqlite3_prepare_v2(db,
-                "UPDATE catifs SET st_uid=?2 WHERE path=?1",
-                -1, &query, 0);
-    } else {
-        rc = sqlite3_prepare_v2(db,
-                "UPDATE catifs SET st_uid=?2, st_gid=?3 WHERE path=?1",
-                -1, &query, 0);
-    }
-    if( rc != SQLITE_OK ) {
-        return -EIO;
-    }
-    
-    rc = sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
-    if( rc != SQLITE_OK ) {
-        return -EIO;
-    }
-    if (uid != -1) {
-        rc = sqlite3_bind_int(query, 2, uid);
-        if( rc != SQLITE_OK ) {
-            return -EIO;
-        }
-    }
-    if (gid != -1) {
-        rc = sqlite3_bind_int(query, 3, gid);
-        if( rc != SQLITE_OK ) {
-            return -EIO;
-        }
+
+    if( sqlite3_exec(db, snapshots_schema, 0, 0, 0) != SQLITE_OK ) return -EIO;
+    result = history_columns(db, "catifs_history", &cols, &old);
+    if( result != 0 ) return result;
+    result = history_columns(db, "catifs_attrs_history", &attr_cols, &attr_old);
+    if( result != 0 ) {
+        sqlite3_free(cols);
+        sqlite3_free(old);
+        return result;
     }
-    rc = sqlite3_step(query);
-    if( rc == SQLITE_DONE ) {
-        result = 0;
-    } else {
+    sql = sqlite3_mprintf(
+        "CREATE TRIGGER catifs_snapshot_insert AFTER INSERT ON catifs BEGIN\n"
+        "  UPDATE catifs SET generation = " SNAPSHOT_NEXT " WHERE rowid = NEW.rowid;\n"
+        "END;\n"
+        "CREATE TRIGGER catifs_snapshot_update AFTER UPDATE ON catifs\n"
+        "WHEN OLD.generation IS NEW.generation AND OLD.generation <= " SNAPSHOT_LAST " BEGIN\n"
+        "  INSERT INTO catifs_history (row_id, %s, died) VALUES (OLD.rowid, %s, " SNAPSHOT_NEXT ");\n"
+        "  UPDATE catifs SET generation = " SNAPSHOT_NEXT " WHERE rowid = NEW.rowid;\n"
+        "END;\n"
+        "CREATE TRIGGER catifs_snapshot_delete AFTER DELETE ON catifs\n"
+        "WHEN OLD.generation <= " SNAPSHOT_LAST " BEGIN\n"
+        "  INSERT INTO catifs_history (row_id, %s, died) VALUES (OLD.rowid, %s, " SNAPSHOT_NEXT ");\n"
+        "END;\n"
+        /* INSERT OR REPLACE does not fire delete triggers */
+        "CREATE TRIGGER catifs_attrs_snapshot_replace BEFORE INSERT ON catifs_attrs BEGIN\n"
+        "  INSERT INTO catifs_attrs_history (%s, died)\n"
+        "    SELECT %s, " SNAPSHOT_NEXT " FROM catifs_attrs\n"
+        "    WHERE st_ino = NEW.st_ino AND name = NEW.name AND generation <= " SNAPSHOT_LAST ";\n"
+        "END;\n"
+        "CREATE TRIGGER catifs_attrs_snapshot_insert AFTER INSERT ON catifs_attrs BEGIN\n"
+        "  UPDATE catifs_attrs SET generation = " SNAPSHOT_NEXT " WHERE rowid = NEW.rowid;\n"
+        "END;\n"
+        "CREATE TRIGGER catifs_attrs_snapshot_update AFTER UPDATE ON catifs_attrs\n"
+        "WHEN OLD.generation IS NEW.generation AND OLD.generation <= " SNAPSHOT_LAST " BEGIN\n"
+        "  INSERT INTO catifs_attrs_history (%s, died) VALUES (%s, " SNAPSHOT_NEXT ");\n"
+        "  UPDATE catifs_attrs SET generation = " SNAPSHOT_NEXT " WHERE rowid = NEW.rowid;\n"
+        "END;\n"
+        "CREATE TRIGGER catifs_attrs_snapshot_delete AFTER DELETE ON catifs_attrs\n"
+        "WHEN OLD.generation <= " SNAPSHOT_LAST " BEGIN\n"
+        "  INSERT INTO catifs_attrs_history (%s, died) VALUES (%s, " SNAPSHOT_NEXT ");\n"
+        "END;",
+        cols, old, cols, old, attr_cols, attr_cols, attr_cols, attr_old, attr_cols, attr_old);
+    if( ! sql || sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK ) {
 #ifdef DEBUG
-        fprintf(stderr, "chmown SQL error: %s\n", sqlite3_errmsg(db));
+        fprintf(stderr, "cannot create snapshot triggers: %s\n", sqlite3_errmsg(db));
 #endif
-        result = -ENOENT;
+        result = -EIO;
     }
-    sqlite3_finalize(query);
+    sqlite3_free(sql);
+    sqlite3_free(cols);
+    sqlite3_free(old);
+    sqlite3_free(attr_cols);
+    sqlite3_free(attr_old);
     return result;
 }
 
-// static int catifs_truncate(const char *path, off_t size,
-// 			 struct fuse_file_info *fi)
-// {
-// 	return 0;
-// }
-
+static inline int has_snapshots(sqlite3 *db)
+{
+    return sqlite3_exec(db, "SELECT 1 FROM main.catifs_snapshots LIMIT 1", 0, 0, 0) == SQLITE_OK;
+}
 
-static int catifs_utimens(const char *path, const struct timespec ts[2],
-		          struct fuse_file_info *fi)
+/*
+ * Record the current generation of the catalogue under name. The cost
+ * does not depend on the size of the catalogue.
+ */
+static int snapshot_create(sqlite3 *db, const char *name)
 {
-    sqlite3 *db;
-    int rc;
-    sqlite3_stmt *query;
-    int result;
-    
-    db = fuse_get_context()->private_data;
-    if (ts[0].tv_nsec == UTIME_OMIT) {
-        if (ts[1].tv_nsec == UTIME_OMIT) {
-            return 0;
+    int result = 0;
+
+    if( db_begin(db) != 0 ) return -EIO;
+    if( ! has_snapshots(db) ) result = snapshot_schema(db);
+    if( result == 0 ) {
+        result = db_run(db,
+                "INSERT INTO catifs_snapshots (name, generation, time) "
+                "VALUES (?1, coalesce(" SNAPSHOT_NEXT ", 0), strftime('%s', 'now'))",
+                name, NULL);
+        if( result != 0 && sqlite3_extended_errcode(db) == SQLITE_CONSTRAINT_PRIMARYKEY ) {
+            fprintf(stderr, "Snapshot already exists: %s\n", name);
+            result = -EEXIST;
         }
-        rc = sqlite3_prepare_v2(db,
-                "UPDATE catifs SET st_mtim_sec=?4, st_mtim_nsec=?5 WHERE path=?1",
-                -1, &query, 0);
-    } else if (ts[1].tv_nsec == UTIME_OMIT) {
-        rc = sqlite3_prepare_v2(db,
-                "UPDATE catifs SET st_atim_sec=?2, st_atim_nsec=?3 WHERE path=?1",
-                -1, &query, 0);
-    } else {
-        rc = sqlite3_prepare_v2(db,
-                "UPDATE catifs SET st_atim_sec=?2, st_atim_nsec=?3, st_mtim_sec=?4, st_mtim_nsec=?5 WHERE path=?1",
-                -1, &query, 0);
     }
-    if( rc != SQLITE_OK ) {
+    return db_end(db, result);
+}
+
+static int snapshot_list(sqlite3 *db)
+{
+    sqlite3_stmt *query;
+
+    if( ! has_snapshots(db) ) return 0;
+    if( sqlite3_prepare_v2(db,
+            "SELECT name, generation, time FROM catifs_snapshots ORDER BY generation",
+            -1, &query, 0) != SQLITE_OK )
         return -EIO;
+    while( sqlite3_step(query) == SQLITE_ROW ) {
+        printf("%s\t%lld\t%lld\n", sqlite3_column_text(query, 0),
+               sqlite3_column_int64(query, 1), sqlite3_column_int64(query, 2));
     }
-    
-    rc = sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
-    if( rc != SQLITE_OK ) {
-        return -EIO;
+    sqlite3_finalize(query);
+    return 0;
+}
+
+/*
+ * Select list of the columns of main.catifs read from the history table
+ * (NULL for columns added after the first snapshot).
+ */
+static char *history_select(sqlite3 *db, const char *table, const char *history)
+{
+    sqlite3_stmt *query;
+    char *sql, *list = NULL;
+
+    sql = sqlite3_mprintf(
+        "SELECT t.name, h.name IS NOT NULL FROM pragma_table_info(%Q, 'main') t "
+        "LEFT JOIN pragma_table_info(%Q, 'main') h ON h.name = t.name ORDER BY t.cid",
+        table, history);
+    if( ! sql || sqlite3_prepare_v2(db, sql, -1, &query, 0) != SQLITE_OK ) {
+        sqlite3_free(sql);
+        return NULL;
     }
-    if (ts[0].tv_nsec != UTIME_OMIT) {
-        rc = sqlite3_bind_int(query, 2, ts[0].tv_sec);
-        if( rc != SQLITE_OK ) {
-            return -EIO;
-        }
-        rc = sqlite3_bind_int(query, 3, ts[0].tv_nsec);
-        if( rc != SQLITE_OK ) {
-            return -EIO;
-        }
+    sqlite3_free(sql);
+    while( sqlite3_step(query) == SQLITE_ROW ) {
+        const char *name = (const char *) sqlite3_column_text(query, 0);
+        const char *column = sqlite3_column_int(query, 1) ? "\"%w\"" : "NULL AS \"%w\"";
+        char *item = sqlite3_mprintf(column, name);
+
+        list = list ? sqlite3_mprintf("%z, %z", list, item) : item;
+        if( ! list ) break;
     }
-    if (ts[1].tv_nsec != UTIME_OMIT) {
-        rc = sqlite3_bind_int(query, 3, ts[1].tv_sec);
-        if( rc != SQLITE_OK ) {
-            return -EIO;
-        }
-        rc = sqlite3_bind_int(query, 4, ts[1].tv_nsec);
-        if( rc != SQLITE_OK ) {
-            return -EIO;
-        }
+    sqlite3_finalize(query);
+    return list;
+}
+
+/*
+ * Make the connection of fs show the snapshot name: temporary views
+ * named catifs and catifs_attrs hide the tables of the main database,
+ * and the aggregates are computed in a temporary catifs_tree. The
+ * connection is then read only.
+ */
+/*
+ * Aggregates of the snapshot of generation as the temporary catifs_tree.
+ * The first mount of a snapshot computes them over the catalogue and
+ * its history, a pass over all the rows, and stores them in
+ * catifs_snapshots_tree for the next mounts (a snapshot never changes).
+ * A database that cannot be written computes them on every mount.
+ */
+static int snapshot_tree(sqlite3 *db, sqlite3_int64 generation)
+{
+    sqlite3_stmt *query;
+    char *sql;
+    int writable, stored = 0, result = 0;
+
+    if( db_begin(db) != 0 ) return -EIO;
+    writable = sqlite3_exec(db, snapshots_tree_schema, 0, 0, 0) == SQLITE_OK;
+    if( writable ) {
+        if( sqlite3_prepare_v2(db, "SELECT 1 FROM main.catifs_snapshots_tree "
+                               "WHERE generation=?1 LIMIT 1", -1, &query, 0) != SQLITE_OK )
+            return db_end(db, -EIO);
+        sqlite3_bind_int64(query, 1, generation);
+        stored = sqlite3_step(query) == SQLITE_ROW;
+        sqlite3_finalize(query);
     }
-    rc = sqlite3_step(query);
-    if( rc == SQLITE_DONE ) {
-        result = 0;
-    } else {
-#ifdef DEBUG
-        fprintf(stderr, "utimens SQL error: %s\n", sqlite3_errmsg(db));
-#endif
-        result = -ENOENT;
+    /* tree_rebuild fills the temporary catifs_tree from the views of the
+       snapshot */
+    if( stored )
+        sql = sqlite3_mprintf("");
+    else if( writable )
+        sql = sqlite3_mprintf(
+            "CREATE TEMP TABLE catifs_tree AS SELECT * FROM main.catifs_tree WHERE 0;\n"
+            "%s\n"
+            "INSERT INTO main.catifs_snapshots_tree (generation, path, size, files, dirs)\n"
+            "  SELECT %lld, path, size, files, dirs FROM temp.catifs_tree;\n"
+            "DROP TABLE temp.catifs_tree;\n",
+            tree_rebuild, generation);
+    else
+        sql = sqlite3_mprintf(
+            "CREATE TEMP TABLE catifs_tree AS SELECT * FROM main.catifs_tree WHERE 0;\n"
+            "CREATE UNIQUE INDEX temp.idx_catifs_tree_path ON catifs_tree (path);\n"
+            "%s",
+            tree_rebuild);
+    if( sql && writable )
+        sql = sqlite3_mprintf(
+            "%zCREATE TEMP VIEW catifs_tree AS SELECT path, size, files, dirs\n"
+            "  FROM main.catifs_snapshots_tree WHERE generation = %lld;",
+            sql, generation);
+    if( ! sql ) return db_end(db, -ENOMEM);
+    if( sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK ) result = -EIO;
+    sqlite3_free(sql);
+    return db_end(db, result);
+}
+
+static int snapshot_open(struct catifs *fs, const char *name)
+{
+    sqlite3 *db = fs->db;
+    sqlite3_stmt *query;
+    sqlite3_int64 generation = -1;
+    char *columns, *history, *sql;
+    int result = 0;
+
+    if( has_snapshots(db) &&
+        sqlite3_prepare_v2(db, "SELECT generation FROM catifs_snapshots WHERE name=?1",
+                           -1, &query, 0) == SQLITE_OK ) {
+        sqlite3_bind_text(query, 1, name, -1, SQLITE_STATIC);
+        if( sqlite3_step(query) == SQLITE_ROW )
+            generation = sqlite3_column_int64(query, 0);
+        sqlite3_finalize(query);
     }
-    sqlite3_finalize(query);
+    if( generation < 0 ) {
+        fprintf(stderr, "No snapshot named %s\n", name);
+        return -ENOENT;
+    }
+    columns = history_select(db, "catifs", "catifs");
+    history = history_select(db, "catifs", "catifs_history");
+    sql = sqlite3_mprintf(
+        "CREATE TEMP VIEW catifs AS\n"
+        "  SELECT rowid AS rowid, %s FROM main.catifs WHERE generation <= %lld\n"
+        "  UNION ALL\n"
+        "  SELECT row_id, %s FROM main.catifs_history\n"
+        "  WHERE generation <= %lld AND died > %lld;\n"
+        "CREATE TEMP VIEW catifs_attrs AS\n"
+        "  SELECT st_ino, name, value FROM main.catifs_attrs WHERE generation <= %lld\n"
+        "  UNION ALL\n"
+        "  SELECT st_ino, name, value FROM main.catifs_attrs_history\n"
+        "  WHERE generation <= %lld AND died > %lld;",
+        columns, generation, history, generation, generation,
+        generation, generation, generation);
+    if( ! columns || ! history || ! sql || sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK ||
+        snapshot_tree(db, generation) != 0 ||
+        sqlite3_exec(db, "PRAGMA query_only = 1;", 0, 0, 0) != SQLITE_OK ) {
+        fprintf(stderr, "Cannot open snapshot %s: %s\n", name, sqlite3_errmsg(db));
+        result = -EIO;
+    }
+    sqlite3_free(columns);
+    sqlite3_free(history);
+    sqlite3_free(sql);
     return result;
 }
 
-
-const char *real_path(const char *path)
+/*
+ * Convert the catifs table to the compact format. Rowids are kept (they
+ * become st_ino) so catifs_attrs stays valid. Columns that are not stat
+ * fields (e.g. is_dir and is_link from add_dir_to_db.py) and indexes
+ * are copied.
+ */
+static int compact_database(struct catifs *fs)
 {
-    sqlite3 *db;
-    const char * sql;
-    int rc;
+    static const char *stat_columns[] = {
+        "st_dev", "st_ino", "st_mode", "st_nlink", "st_uid", "st_gid",
+        "st_rdev", "st_size", "st_blksize", "st_blocks", "st_atim_sec",
+        "st_atim_nsec", "st_mtim_sec", "st_mtim_nsec", "st_ctim_sec",
+        "st_ctim_nsec", "path", "real_path",
+    };
+    sqlite3 *db = fs->db;
     sqlite3_stmt *query;
-    const char *result = NULL;
-    
-    sql = "SELECT real_path FROM catifs WHERE path=?";
-    db = fuse_get_context()->private_data;
-    rc = sqlite3_prepare_v2(db,
-            sql,
-            -1, &query, 0);
-    if( rc != SQLITE_OK ) {
-#ifdef DEBUG
-        fprintf(stderr, "getattr cannot prepare SQL query: %s\n", sqlite3_errmsg(db));
-#endif
-        return result;
+    char *columns = sqlite3_mprintf("");
+    char *definitions = sqlite3_mprintf("");
+    char *indexes = sqlite3_mprintf("");
+    char *sql = NULL;
+    int result = 0;
+    int i;
+
+    if( fs->compact ) {
+        fprintf(stderr, "Database is already compact\n");
+        return 0;
     }
-    
-    rc = sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
-    if( rc != SQLITE_OK ) {
-#ifdef DEBUG
-        fprintf(stderr, "getattr cannot bind path in SQL query: %s\n", sqlite3_errmsg(db));
-#endif
-        return result;
+    if( has_snapshots(db) ) {
+        /* Rows are rewritten and the triggers would copy the whole table */
+        fprintf(stderr, "Cannot compact a database with snapshots\n");
+        return -EBUSY;
     }
-    rc = sqlite3_step(query);
-    if(  rc == SQLITE_ROW ) {
-        result = strndup((const char *) sqlite3_column_text(query, 0), 4096);
+    sqlite3_create_function(db, "catifs_stat_pack", STAT_RECORD_FIELDS,
+                            SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0,
+                            sql_stat_pack, 0, 0);
+    if( sqlite3_prepare_v2(db, "SELECT name, type FROM pragma_table_info('catifs')",
+                           -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    while( sqlite3_step(query) == SQLITE_ROW ) {
+        const char *name = (const char *) sqlite3_column_text(query, 0);
+        for( i=0; i<sizeof(stat_columns)/sizeof(*stat_columns); i++ )
+            if( strcmp(name, stat_columns[i]) == 0 ) break;
+        if( i < sizeof(stat_columns)/sizeof(*stat_columns) ) continue;
+        columns = sqlite3_mprintf("%z, \"%w\"", columns, name);
+        definitions = sqlite3_mprintf("%z,\n  \"%w\" %s", definitions, name,
+                                      sqlite3_column_text(query, 1));
+    }
+    sqlite3_finalize(query);
+    if( sqlite3_prepare_v2(db, "SELECT sql FROM sqlite_master WHERE type='index' "
+                           "AND tbl_name='catifs' AND sql IS NOT NULL",
+                           -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    while( sqlite3_step(query) == SQLITE_ROW )
+        indexes = sqlite3_mprintf("%z%s;\n", indexes, sqlite3_column_text(query, 0));
+    sqlite3_finalize(query);
+
+    sql = sqlite3_mprintf(
+        "CREATE TABLE catifs_compact(\n"
+        "  path TEXT NOT NULL,\n"
+        "  real_path TEXT,\n"
+        "  st_ino INTEGER PRIMARY KEY,\n"
+        "  st_mode INT,\n"
+        "  st_size INT,\n"
+        "  stat BLOB%s\n"
+        ");\n"
+        "INSERT INTO catifs_compact (path, real_path, st_ino, st_mode, st_size, stat%s)\n"
+        "  SELECT path, real_path, rowid, st_mode, st_size,\n"
+        "    catifs_stat_pack(st_dev, st_nlink, st_uid, st_gid, st_rdev,\n"
+        "      st_blksize, st_blocks, st_atim_sec, st_atim_nsec, st_mtim_sec,\n"
+        "      st_mtim_nsec, st_ctim_sec, st_ctim_nsec)%s\n"
+        "  FROM catifs ORDER BY rowid;\n"
+        "DROP TABLE catifs;\n"
+        "ALTER TABLE catifs_compact RENAME TO catifs;\n"
+        "%s",
+        definitions, columns, columns, indexes);
+    if( db_begin(db) != 0 ) {
+        result = -EIO;
     } else {
-#ifdef DEBUG
-        fprintf(stderr, "getattr SQL query failed: (%d) %s\n", rc, sqlite3_errmsg(db));
-#endif
+        if( sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK ) {
+            fprintf(stderr, "Cannot convert database: %s\n", sqlite3_errmsg(db));
+            result = -EIO;
+        }
+        result = db_end(db, result);
     }
-    rc = sqlite3_finalize(query);
-#ifdef DEBUG
-    if( rc != SQLITE_OK ) {
-        fprintf(stderr, "getattr cannot finalize SQL query: %s\n", sqlite3_errmsg(db));
+    if( result == 0 ) {
+        fs->compact = 1;
+        sqlite3_exec(db, "VACUUM", 0, 0, 0);
     }
-#endif
+    sqlite3_free(sql);
+    sqlite3_free(columns);
+    sqlite3_free(definitions);
+    sqlite3_free(indexes);
     return result;
 }
 
 
-static int catifs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+/*
+ * Dump format, a stream of records after an 8 bytes header ("CATIFS",
+ * 0, version). Integers are zigzag varints (see varint_put()) and texts
+ * are a varint length + 1 (0 for NULL) followed by the bytes.
+ *   'V' id prefix                  volume
+ *   'E' path real_path volume compression st_ino st_mode st_size <stat>
+ *                                  entry, real_path is relative to the
+ *                                  volume (0 for none), st_ino is not
+ *                                  loaded (entries are numbered in path
+ *                                  order) and <stat> is the stat record
+ *                                  of compact databases (see stat_pack())
+ *   'H' content_hash dedup_origin  hash of the previous entry
+ *   'L' link_target                target of the previous entry when it
+ *                                  is a symbolic link of the catalogue
+ *   'A' name value                 attribute of the previous entry
+ *   'Z' entries attributes         end of the stream
+ */
+#define DUMP_MAGIC "CATIFS"
+#define DUMP_VERSION 1
+
+static void dump_int(FILE *out, int64_t value)
 {
-    const char *rpath;
-    int fd;
+    unsigned char buffer[10];
 
-    rpath = real_path(path);
-    fd = open(rpath, fi->flags, mode);
-    if (fd == -1) return -errno;
-    fi->fh = fd;
-    return 0;
+    fwrite(buffer, 1, varint_put(buffer, value) - buffer, out);
 }
 
-static int catifs_open(const char *path, struct fuse_file_info *fi)
+static void dump_text(FILE *out, const void *text, int size)
 {
-    const char *rpath;
-    int fd;
+    dump_int(out, text ? size + 1 : 0);
+    if( text ) fwrite(text, 1, size, out);
+}
 
-    rpath = real_path(path);
-    fd = open(rpath, fi->flags);
-    if (fd == -1) return -errno;
-    fi->fh = fd;
-    fprintf(stderr, "open %s = %s, %ld\n", path, rpath, fi->fh);
-    return 0;
+static void dump_column(FILE *out, sqlite3_stmt *query, int col)
+{
+    dump_text(out, sqlite3_column_type(query, col) == SQLITE_NULL ? NULL :
+                   sqlite3_column_blob(query, col),
+              sqlite3_column_bytes(query, col));
 }
 
-static int catifs_read(const char *path, char *buf, size_t size, off_t offset,
-                       struct fuse_file_info *fi)
+/*
+ * Write the catalogue (catifs, catifs_attrs and catifs_volumes) to out.
+ * Entries are written in rowid order so that attributes are merged from
+ * their primary key order.
+ */
+static int dump_database(struct catifs *fs, FILE *out)
 {
-    int res;
+    sqlite3 *db = fs->db;
+    sqlite3_stmt *query, *attrs;
+    unsigned char record[STAT_RECORD_MAX];
+    sqlite3_int64 entries = 0, attributes = 0, rowid;
+    struct stat buf;
+    int attr, result = 0;
 
-    (void) path;
-    res = pread(fi->fh, buf, size, offset);
-    if (res == -1) res = -errno;
-    return res;
+    fwrite(DUMP_MAGIC, 1, sizeof(DUMP_MAGIC), out);
+    fputc(DUMP_VERSION, out);
+    if( sqlite3_prepare_v2(db, "SELECT id, prefix FROM catifs_volumes ORDER BY id",
+                           -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    while( sqlite3_step(query) == SQLITE_ROW ) {
+        fputc('V', out);
+        dump_int(out, sqlite3_column_int64(query, 0));
+        dump_column(out, query, 1);
+    }
+    sqlite3_finalize(query);
+
+    if( sqlite3_prepare_v2(db,
+            fs->hashing ?
+            (fs->compact ?
+             "SELECT rowid, path, real_path, volume, compression, content_hash, dedup_origin, link_target, "
+             STAT_COMPACT_COLUMNS " FROM catifs ORDER BY rowid" :
+             "SELECT rowid, path, real_path, volume, compression, content_hash, dedup_origin, link_target, "
+             STAT_COLUMNS " FROM catifs ORDER BY rowid") :
+            (fs->compact ?
+             "SELECT rowid, path, real_path, volume, compression, NULL, NULL, link_target, "
+             STAT_COMPACT_COLUMNS " FROM catifs ORDER BY rowid" :
+             "SELECT rowid, path, real_path, volume, compression, NULL, NULL, link_target, "
+             STAT_COLUMNS " FROM catifs ORDER BY rowid"),
+            -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    if( sqlite3_prepare_v2(db, "SELECT st_ino, name, value FROM catifs_attrs ORDER BY st_ino",
+                           -1, &attrs, 0) != SQLITE_OK ) {
+        sqlite3_finalize(query);
+        return -EIO;
+    }
+    attr = sqlite3_step(attrs);
+    while( result == 0 && sqlite3_step(query) == SQLITE_ROW ) {
+        rowid = sqlite3_column_int64(query, 0);
+        memset(&buf, 0, sizeof(buf));
+        if( stat_decode(fs, query, 8, &buf) != 0 ) {
+            fprintf(stderr, "Invalid stat record: %s\n", sqlite3_column_text(query, 1));
+            result = -EIO;
+            break;
+        }
+        fputc('E', out);
+        dump_column(out, query, 1);
+        dump_column(out, query, 2);
+        dump_int(out, sqlite3_column_int64(query, 3));
+        dump_int(out, sqlite3_column_int64(query, 4));
+        dump_int(out, buf.st_ino);
+        dump_int(out, buf.st_mode);
+        dump_int(out, buf.st_size);
+        fwrite(record, 1, stat_pack_buf(&buf, record), out);
+        if( sqlite3_column_type(query, 5) != SQLITE_NULL ) {
+            fputc('H', out);
+            dump_int(out, sqlite3_column_int64(query, 5));
+            dump_column(out, query, 6);
+        }
+        if( sqlite3_column_type(query, 7) != SQLITE_NULL ) {
+            fputc('L', out);
+            dump_column(out, query, 7);
+        }
+        /* Attributes of deleted rows are skipped */
+        while( attr == SQLITE_ROW && sqlite3_column_int64(attrs, 0) < rowid )
+            attr = sqlite3_step(attrs);
+        while( attr == SQLITE_ROW && sqlite3_column_int64(attrs, 0) == rowid ) {
+            fputc('A', out);
+            dump_column(out, attrs, 1);
+            dump_column(out, attrs, 2);
+            ++attributes;
+            attr = sqlite3_step(attrs);
+        }
+        ++entries;
+    }
+    sqlite3_finalize(attrs);
+    sqlite3_finalize(query);
+    fputc('Z', out);
+    dump_int(out, entries);
+    dump_int(out, attributes);
+    if( fflush(out) != 0 || ferror(out) ) {
+        fprintf(stderr, "Cannot write dump: %s\n", strerror(errno));
+        result = -EIO;
+    }
+    if( result == 0 )
+        fprintf(stderr, "%lld entries and %lld attributes dumped\n", entries, attributes);
+    return result;
 }
 
-static int catifs_read_buf(const char *path, struct fuse_bufvec **bufp,
-                           size_t size, off_t offset, struct fuse_file_info *fi)
+static int load_int(FILE *in, int64_t *value)
 {
-    struct fuse_bufvec *src;
+    unsigned char buffer[10];
+    int i, c;
 
-    (void) path;
+    for( i=0; i<10; i++ ) {
+        c = getc_unlocked(in);
+        if( c == EOF ) return -EINVAL;
+        buffer[i] = c;
+        if( ! (c & 0x80) )
+            return varint_get(buffer, buffer + i + 1, value) ? 0 : -EINVAL;
+    }
+    return -EINVAL;
+}
 
-    src = malloc(sizeof(struct fuse_bufvec));
-    if (src == NULL) return -ENOMEM;
-    *src = FUSE_BUFVEC_INIT(size);
+struct load_text {
+    char *data;     /* NULL for a NULL text */
+    int64_t size;
+    char *buffer;
+    size_t allocated;
+};
 
-    src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
-    src->buf[0].fd = fi->fh;
-    src->buf[0].pos = offset;
+static int load_text(FILE *in, struct load_text *text)
+{
+    int64_t size;
+    char *grown;
 
-    *bufp = src;
+    if( load_int(in, &size) != 0 || size < 0 || size > INT_MAX ) return -EINVAL;
+    text->data = NULL;
+    text->size = 0;
+    if( size == 0 ) return 0;
+    text->size = size - 1;
+    if( text->allocated < (size_t) size ) {
+        grown = realloc(text->buffer, size);
+        if( ! grown ) return -ENOMEM;
+        text->buffer = grown;
+        text->allocated = size;
+    }
+    text->data = text->buffer;
+    text->data[text->size] = 0;
+    return fread(text->data, 1, text->size, in) == (size_t) text->size ? 0 : -EINVAL;
+}
 
-    return 0;
+static void bind_load_text(sqlite3_stmt *query, int index, const struct load_text *text)
+{
+    if( text->data ) sqlite3_bind_text(query, index, text->data, text->size, SQLITE_STATIC);
+    else sqlite3_bind_null(query, index);
 }
 
-static int catifs_write(const char *path, const char *buf, size_t size,
-                        off_t offset, struct fuse_file_info *fi)
+/*
+ * Staging tables of load_database(), rank is the position of the entry
+ * in path order and becomes its rowid.
+ */
+static const char load_schema[] =
+  "CREATE TEMP TABLE load_entries(\n"
+  "  seq INTEGER PRIMARY KEY, path TEXT, real_path TEXT, volume INT, compression INT,\n"
+  "  content_hash INT, dedup_origin TEXT, st_ino INT, st_mode INT, st_size INT, st_dev INT,\n"
+  "  st_nlink INT, st_uid INT, st_gid INT, st_rdev INT, st_blksize INT, st_blocks INT,\n"
+  "  st_atim_sec INT, st_atim_nsec INT, st_mtim_sec INT, st_mtim_nsec INT,\n"
+  "  st_ctim_sec INT, st_ctim_nsec INT, link_target TEXT\n"
+  ");\n"
+  "CREATE TEMP TABLE load_attrs(entry INT, name TEXT, value TEXT);\n"
+  "CREATE TEMP TABLE load_rank(seq INTEGER PRIMARY KEY, rank INT);";
+
+#define LOAD_STAT_FIELDS \
+    "e.st_dev, e.st_nlink, e.st_uid, e.st_gid, e.st_rdev, e.st_blksize, e.st_blocks, " \
+    "e.st_atim_sec, e.st_atim_nsec, e.st_mtim_sec, e.st_mtim_nsec, e.st_ctim_sec, e.st_ctim_nsec"
+
+/*
+ * Read the stream of entries in the staging tables.
+ */
+static int load_stream(sqlite3 *db, FILE *in, sqlite3_int64 *hashes)
 {
-    (void) path;
-    int res;
-    
-    fprintf(stderr, "write %ld %ld %ld\n", fi->fh, offset, size);
-    res = pwrite(fi->fh, buf, size, offset);
-    if (res == -1) res = -errno;
-    return res;
+    sqlite3_stmt *volume = NULL, *entry = NULL, *hash = NULL, *link = NULL, *attr = NULL;
+    struct load_text path = {0}, rpath = {0}, name = {0}, value = {0};
+    unsigned char record[STAT_RECORD_MAX], *p;
+    int64_t number, count[2];
+    sqlite3_int64 seq = 0, entries = 0, attributes = 0;
+    struct stat buf;
+    char header[sizeof(DUMP_MAGIC) + 1];
+    int type, i, result = 0;
+
+    if( fread(header, 1, sizeof(header), in) != sizeof(header) ||
+        memcmp(header, DUMP_MAGIC, sizeof(DUMP_MAGIC)) != 0 ) {
+        fprintf(stderr, "Not a catalogue dump\n");
+        return -EINVAL;
+    }
+    if( header[sizeof(DUMP_MAGIC)] != DUMP_VERSION ) {
+        fprintf(stderr, "Unsupported dump version %d\n", header[sizeof(DUMP_MAGIC)]);
+        return -EINVAL;
+    }
+    if( sqlite3_prepare_v2(db, "INSERT INTO catifs_volumes (id, prefix) VALUES (?1, ?2)",
+                           -1, &volume, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(db,
+            "INSERT INTO load_entries VALUES (NULL, ?1, ?2, nullif(?3, 0), nullif(?4, 0), "
+            "NULL, NULL, nullif(?5, 0), ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?15, ?16, ?17, ?18, ?19, ?20, NULL)",
+            -1, &entry, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(db,
+            "UPDATE load_entries SET content_hash=?2, dedup_origin=?3 WHERE seq=?1",
+            -1, &hash, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "UPDATE load_entries SET link_target=?2 WHERE seq=?1",
+                           -1, &link, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "INSERT INTO load_attrs VALUES (?1, ?2, ?3)",
+                           -1, &attr, 0) != SQLITE_OK )
+        result = -EIO;
+    while( result == 0 && (type = getc_unlocked(in)) != 'Z' ) {
+        switch( type ) {
+            case 'V':
+                if( load_int(in, &number) != 0 || load_text(in, &name) != 0 ) {
+                    result = -EINVAL;
+                    break;
+                }
+                sqlite3_bind_int64(volume, 1, number);
+                bind_load_text(volume, 2, &name);
+                if( sqlite3_step(volume) != SQLITE_DONE ) result = -EIO;
+                sqlite3_reset(volume);
+                break;
+            case 'E':
+                if( load_text(in, &path) != 0 || ! path.data || load_text(in, &rpath) != 0 ) {
+                    result = -EINVAL;
+                    break;
+                }
+                bind_load_text(entry, 1, &path);
+                bind_load_text(entry, 2, &rpath);
+                for( i=3; i<=7 && result == 0; i++ ) {
+                    if( load_int(in, &number) != 0 ) result = -EINVAL;
+                    sqlite3_bind_int64(entry, i, number);
+                }
+                /* The stat record is decoded by stat_unpack() */
+                p = record;
+                *p++ = getc_unlocked(in);
+                for( i=0; i<STAT_RECORD_FIELDS && result == 0; i++ ) {
+                    if( load_int(in, &number) != 0 ) result = -EINVAL;
+                    else p = varint_put(p, number);
+                }
+                if( result != 0 || stat_unpack(record, p - record, &buf) != 0 ) {
+                    result = -EINVAL;
+                    break;
+                }
+                sqlite3_bind_int64(entry, 8, buf.st_dev);
+                sqlite3_bind_int64(entry, 9, buf.st_nlink);
+                sqlite3_bind_int64(entry, 10, buf.st_uid);
+                sqlite3_bind_int64(entry, 11, buf.st_gid);
+                sqlite3_bind_int64(entry, 12, buf.st_rdev);
+                sqlite3_bind_int64(entry, 13, buf.st_blksize);
+                sqlite3_bind_int64(entry, 14, buf.st_blocks);
+                sqlite3_bind_int64(entry, 15, buf.st_atim.tv_sec);
+                sqlite3_bind_int64(entry, 16, buf.st_atim.tv_nsec);
+                sqlite3_bind_int64(entry, 17, buf.st_mtim.tv_sec);
+                sqlite3_bind_int64(entry, 18, buf.st_mtim.tv_nsec);
+                sqlite3_bind_int64(entry, 19, buf.st_ctim.tv_sec);
+                sqlite3_bind_int64(entry, 20, buf.st_ctim.tv_nsec);
+                if( sqlite3_step(entry) != SQLITE_DONE ) result = -EIO;
+                sqlite3_reset(entry);
+                seq = sqlite3_last_insert_rowid(db);
+                ++entries;
+                break;
+            case 'H':
+                if( ! seq || load_int(in, &number) != 0 || load_text(in, &value) != 0 ) {
+                    result = -EINVAL;
+                    break;
+                }
+                sqlite3_bind_int64(hash, 1, seq);
+                sqlite3_bind_int64(hash, 2, number);
+                bind_load_text(hash, 3, &value);
+                if( sqlite3_step(hash) != SQLITE_DONE ) result = -EIO;
+                sqlite3_reset(hash);
+                ++*hashes;
+                break;
+            case 'L':
+                if( ! seq || load_text(in, &value) != 0 || ! value.data ) {
+                    result = -EINVAL;
+                    break;
+                }
+                sqlite3_bind_int64(link, 1, seq);
+                bind_load_text(link, 2, &value);
+                if( sqlite3_step(link) != SQLITE_DONE ) result = -EIO;
+                sqlite3_reset(link);
+                break;
+            case 'A':
+                if( ! seq || load_text(in, &name) != 0 || load_text(in, &value) != 0 ||
+                    ! name.data || ! value.data ) {
+                    result = -EINVAL;
+                    break;
+                }
+                sqlite3_bind_int64(attr, 1, seq);
+                bind_load_text(attr, 2, &name);
+                bind_load_text(attr, 3, &value);
+                if( sqlite3_step(attr) != SQLITE_DONE ) result = -EIO;
+                sqlite3_reset(attr);
+                ++attributes;
+                break;
+            default:
+                result = -EINVAL;
+        }
+    }
+    if( result == 0 &&
+        (load_int(in, &count[0]) != 0 || load_int(in, &count[1]) != 0 ||
+         count[0] != entries || count[1] != attributes) )
+        result = -EINVAL;
+    if( result == -EINVAL ) fprintf(stderr, "Invalid or truncated dump\n");
+    else if( result != 0 ) fprintf(stderr, "Cannot load dump: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(volume);
+    sqlite3_finalize(entry);
+    sqlite3_finalize(hash);
+    sqlite3_finalize(link);
+    sqlite3_finalize(attr);
+    free(path.buffer);
+    free(rpath.buffer);
+    free(name.buffer);
+    free(value.buffer);
+    return result;
 }
 
-static int catifs_write_buf(const char *path, struct fuse_bufvec *buf,
-                            off_t offset, struct fuse_file_info *fi)
+/*
+ * Load a dump in an empty catalogue. Entries go through staging tables
+ * so that they are inserted in path order (rowids follow paths and
+ * attributes are remapped to them), the indexes of the catalogue are
+ * built once everything is inserted and the aggregates are computed at
+ * the end. The change feed is not written.
+ */
+static int load_database(struct catifs *fs, FILE *in)
 {
-    (void) path;
-    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
-
+    sqlite3 *db = fs->db;
+    sqlite3_stmt *query;
+    sqlite3_int64 hashes = 0;
+    char *indexes = sqlite3_mprintf("");
+    char *drop = sqlite3_mprintf("");
+    char *sql = NULL;
+    int result = 0;
 
-    fprintf(stderr, "write buf\n");
-    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
-    dst.buf[0].fd = fi->fh;
-    dst.buf[0].pos = offset;
+    if( sqlite3_prepare_v2(db, "SELECT (SELECT count(*) FROM catifs) + "
+                           "(SELECT count(*) FROM catifs_volumes)", -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    if( sqlite3_step(query) != SQLITE_ROW || sqlite3_column_int64(query, 0) > 0 ) result = -EEXIST;
+    sqlite3_finalize(query);
+    if( result != 0 || has_snapshots(db) ) {
+        fprintf(stderr, "A dump can only be loaded in an empty database\n");
+        return -EEXIST;
+    }
+    /* The database is empty, a crash only loses the load */
+    sqlite3_exec(db, "PRAGMA synchronous = OFF; PRAGMA cache_size = -262144;", 0, 0, 0);
+    sqlite3_create_function(db, "catifs_stat_pack", STAT_RECORD_FIELDS,
+                            SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0,
+                            sql_stat_pack, 0, 0);
+    if( db_begin(db) != 0 ) return -EIO;
+    if( sqlite3_exec(db, load_schema, 0, 0, 0) != SQLITE_OK ) result = -EIO;
+    if( result == 0 ) result = load_stream(db, in, &hashes);
+    if( result == 0 && hashes && ! fs->hashing ) {
+        if( sqlite3_exec(db, hash_schema, 0, 0, 0) != SQLITE_OK ) result = -EIO;
+        else fs->hashing = 1;
+    }
 
-    return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+    /* Indexes are dropped and created again once the rows are inserted */
+    if( result == 0 &&
+        sqlite3_prepare_v2(db, "SELECT name, sql FROM main.sqlite_master WHERE type='index' "
+                           "AND tbl_name IN ('catifs', 'catifs_attrs') AND sql IS NOT NULL",
+                           -1, &query, 0) == SQLITE_OK ) {
+        while( sqlite3_step(query) == SQLITE_ROW ) {
+            drop = sqlite3_mprintf("%zDROP INDEX main.\"%w\";\n", drop,
+                                   sqlite3_column_text(query, 0));
+            indexes = sqlite3_mprintf("%z%s;\n", indexes, sqlite3_column_text(query, 1));
+        }
+        sqlite3_finalize(query);
+    }
+    if( result == 0 ) {
+        sql = sqlite3_mprintf(
+            "%s"
+            "INSERT INTO load_rank SELECT seq, row_number() OVER (ORDER BY path)\n"
+            "  FROM load_entries;\n"
+            "INSERT INTO catifs (rowid, path, real_path, volume, compression, link_target%s, %s)\n"
+            "  SELECT r.rank, e.path, e.real_path, e.volume, e.compression, e.link_target%s, %s\n"
+            "  FROM load_entries e JOIN load_rank r ON r.seq = e.seq ORDER BY r.rank;\n"
+            "INSERT INTO catifs_attrs (st_ino, name, value)\n"
+            "  SELECT r.rank, a.name, a.value\n"
+            "  FROM load_attrs a JOIN load_rank r ON r.seq = a.entry ORDER BY r.rank, a.name;\n"
+            "DROP TABLE load_entries;\n"
+            "DROP TABLE load_attrs;\n"
+            "DROP TABLE load_rank;\n"
+            "%s"
+            "%s",
+            drop,
+            fs->hashing ? ", content_hash, dedup_origin" : "",
+            /* st_ino is the rowid, entries are numbered in path order */
+            fs->compact ? "st_mode, st_size, stat" :
+                          "st_dev, st_mode, st_nlink, st_uid, st_gid, st_rdev, st_size, "
+                          "st_blksize, st_blocks, st_atim_sec, st_atim_nsec, st_mtim_sec, "
+                          "st_mtim_nsec, st_ctim_sec, st_ctim_nsec",
+            fs->hashing ? ", e.content_hash, e.dedup_origin" : "",
+            fs->compact ? "e.st_mode, e.st_size, catifs_stat_pack(" LOAD_STAT_FIELDS ")" :
+                          "e.st_dev, e.st_mode, e.st_nlink, e.st_uid, e.st_gid, "
+                          "e.st_rdev, e.st_size, e.st_blksize, e.st_blocks, e.st_atim_sec, "
+                          "e.st_atim_nsec, e.st_mtim_sec, e.st_mtim_nsec, e.st_ctim_sec, "
+                          "e.st_ctim_nsec",
+            indexes, tree_rebuild);
+        if( sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK ) {
+            /* e.g. the unique index on paths for a dump with duplicates */
+            fprintf(stderr, "Cannot load dump: %s\n", sqlite3_errmsg(db));
+            result = -EIO;
+        }
+    }
+    sqlite3_free(sql);
+    sqlite3_free(drop);
+    sqlite3_free(indexes);
+    return db_end(db, result);
 }
 
-static int catifs_statfs(const char *path, struct statvfs *buf)
+/*
+ * Register a volume and move the rows below its prefix to it (including
+ * rows of a volume with a shorter prefix).
+ */
+static int volume_add(sqlite3 *db, const char *prefix)
 {
-    const char *rpath;
-    int res;
+    char *normalized;
+    int result;
 
-    rpath = real_path(path);
-    res = statvfs(rpath, buf);
-    if (res == -1) return -errno;
-    return 0;
+    if( prefix[0] != '/' ) {
+        fprintf(stderr, "Volume prefix must be an absolute path: %s\n", prefix);
+        return -EINVAL;
+    }
+    if( prefix[strlen(prefix) - 1] == '/' )
+        normalized = sqlite3_mprintf("%s", prefix);
+    else
+        normalized = sqlite3_mprintf("%s/", prefix);
+    if( db_begin(db) != 0 ) {
+        sqlite3_free(normalized);
+        return -EIO;
+    }
+    result = db_run(db, "INSERT INTO catifs_volumes (prefix) VALUES (?1)", normalized, NULL);
+    if( result == 0 ) {
+        result = db_run(db,
+                "UPDATE catifs SET "
+                "  real_path = substr(coalesce((SELECT prefix FROM catifs_volumes "
+                "    WHERE id = catifs.volume), '') || real_path, length(?1) + 1), "
+                "  volume = (SELECT id FROM catifs_volumes WHERE prefix = ?1) "
+                "WHERE substr(coalesce((SELECT prefix FROM catifs_volumes "
+                "    WHERE id = catifs.volume), '') || real_path, 1, length(?1)) = ?1",
+                normalized, NULL);
+    }
+    if( result == 0 ) {
+        printf("%s: %d entries\n", normalized, sqlite3_changes(db));
+    }
+    sqlite3_free(normalized);
+    return db_end(db, result);
 }
 
-static int catifs_flush(const char *path, struct fuse_file_info *fi)
+/*
+ * Change the prefix of a volume, e.g. after its files were copied to
+ * new storage.
+ */
+static int volume_move(struct catifs *fs, const char *from, const char *to)
 {
-    int res;
+    sqlite3 *db = fs->db;
+    char *old_prefix, *new_prefix;
+    int result;
 
-    (void) path;
-    /* This is called from every close on an open file, so call the
-       close on the underlying filesystem.	But since flush may be
-       called multiple times for an open file, this must not really
-       close the file.  This is important if used on a network
-       filesystem like NFS which flush the data/metadata on close() */
-    res = close(dup(fi->fh));
-    if (res == -1) return -errno;
-    return 0;
+    old_prefix = sqlite3_mprintf(from[strlen(from) - 1] == '/' ? "%s" : "%s/", from);
+    new_prefix = sqlite3_mprintf(to[strlen(to) - 1] == '/' ? "%s" : "%s/", to);
+    if( db_begin(db) != 0 ) {
+        sqlite3_free(old_prefix);
+        sqlite3_free(new_prefix);
+        return -EIO;
+    }
+    result = db_run(db, "UPDATE catifs_volumes SET prefix=?2 WHERE prefix=?1",
+                    old_prefix, new_prefix);
+    if( result == 0 && sqlite3_changes(db) == 0 ) {
+        fprintf(stderr, "No volume with prefix %s\n", old_prefix);
+        result = -ENOENT;
+    }
+    if( result == 0 && fs->hashing ) {
+        /* dedup_origin is absolute */
+        result = db_run(db,
+                "UPDATE catifs SET dedup_origin = ?2 || substr(dedup_origin, length(?1) + 1) "
+                "WHERE substr(dedup_origin, 1, length(?1)) = ?1",
+                old_prefix, new_prefix);
+    }
+    result = db_end(db, result);
+    sqlite3_free(old_prefix);
+    sqlite3_free(new_prefix);
+    return result;
 }
 
-static int catifs_release(const char *path, struct fuse_file_info *fi)
+static int volume_list(sqlite3 *db)
 {
-    (void) path;
-    fprintf(stderr, "close %s %ld\n", path, fi->fh);
-    close(fi->fh);
+    sqlite3_stmt *query;
+
+    if( sqlite3_prepare_v2(db,
+            "SELECT v.id, v.prefix, (SELECT count(*) FROM catifs WHERE volume = v.id) "
+            "FROM catifs_volumes v ORDER BY v.prefix",
+            -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    while( sqlite3_step(query) == SQLITE_ROW ) {
+        printf("%lld\t%s\t%lld\n", sqlite3_column_int64(query, 0),
+               sqlite3_column_text(query, 1), sqlite3_column_int64(query, 2));
+    }
+    sqlite3_finalize(query);
     return 0;
 }
 
-// static int catifs_fsync(const char *path, int isdatasync,
-// 		     struct fuse_file_info *fi)
-// {
-// 	return 0;
-// }
 
-// #ifdef HAVE_POSIX_FALLOCATE
-// static int catifs_fallocate(const char *path, int mode,
-// 			off_t offset, off_t length, struct fuse_file_info *fi)
-// {
-// }
-// #endif
+/*
+ * Backing files hashed in parallel by hash_database().
+ */
+#define HASH_BATCH 1024
 
-#ifdef HAVE_SETXATTR
-/* xattr operations are optional and can safely be left unimplemented */
-static int xmp_setxattr(const char *path, const char *name, const char *value,
-			size_t size, int flags)
-{
-	int res = lsetxattr(path, name, value, size, flags);
-	if (res == -1)
-		return -errno;
-	return 0;
-}
+struct hash_batch {
+    pthread_mutex_t lock;
+    int next;
+    int count;
+    sqlite3_int64 rowid[HASH_BATCH];
+    char *path[HASH_BATCH];
+    uint64_t hash[HASH_BATCH];
+    int result[HASH_BATCH];
+};
 
-static int xmp_getxattr(const char *path, const char *name, char *value,
-			size_t size)
+static void *hash_worker(void *arg)
 {
-	int res = lgetxattr(path, name, value, size);
-	if (res == -1)
-		return -errno;
-	return res;
-}
+    struct hash_batch *batch = arg;
+    int i;
 
-static int xmp_listxattr(const char *path, char *list, size_t size)
-{
-	int res = llistxattr(path, list, size);
-	if (res == -1)
-		return -errno;
-	return res;
+    for( ;; ) {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if( i >= batch->count ) break;
+        batch->result[i] = content_hash_file(batch->path[i], &batch->hash[i]);
+    }
+    return NULL;
 }
 
-static int xmp_removexattr(const char *path, const char *name)
+/*
+ * Add the content_hash column if needed and compute the hash of every
+ * regular file that does not have one yet with jobs threads. Files
+ * added later are not hashed by the add (reading a whole file would hold
+ * the connection), they wait for the next run.
+ */
+static int hash_database(struct catifs *fs, int jobs)
 {
-	int res = lremovexattr(path, name);
-	if (res == -1)
-		return -errno;
-	return 0;
-}
-#endif /* HAVE_SETXATTR */
-
-// #ifdef HAVE_LIBULOCKMGR
-// static int catifs_lock(const char *path, struct fuse_file_info *fi, int cmd,
-// 		    struct flock *lock)
-// {
-// }
-// #endif
+    sqlite3 *db = fs->db;
+    sqlite3_stmt *query = NULL, *update;
+    struct hash_batch *batch;
+    pthread_t *threads;
+    sqlite3_int64 last = 0, hashed = 0, errors = 0, bytes = 0;
+    struct timespec start, now;
+    double elapsed;
+    int result = 0;
+    int i, started;
 
-// static int catifs_flock(const char *path, struct fuse_file_info *fi, int op)
-// {
-// 	return 0;
-// }
+    if( ! fs->hashing ) {
+        if( db_begin(db) != 0 ) return -EIO;
+        if( sqlite3_exec(db, hash_schema, 0, 0, 0) != SQLITE_OK ) {
+            fprintf(stderr, "Cannot add content hash columns: %s\n", sqlite3_errmsg(db));
+            result = -EIO;
+        }
+        if( db_end(db, result) != 0 ) return -EIO;
+        fs->hashing = 1;
+    }
+    if( jobs <= 0 ) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if( jobs <= 0 ) jobs = 1;
+    batch = calloc(1, sizeof(*batch));
+    threads = calloc(jobs, sizeof(*threads));
+    if( ! batch || ! threads ) {
+        free(batch);
+        free(threads);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&batch->lock, NULL);
+    if( sqlite3_prepare_v2(db,
+            "SELECT c.rowid, coalesce(v.prefix, '') || c.real_path, c.st_size "
+            "FROM catifs c LEFT JOIN catifs_volumes v ON v.id = c.volume "
+            "WHERE c.rowid > ?1 AND c.content_hash IS NULL AND c.real_path IS NOT NULL "
+            "AND c.st_mode & 61440 = 32768 ORDER BY c.rowid LIMIT ?2",
+            -1, &query, 0) != SQLITE_OK ) {
+        result = -EIO;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while( result == 0 ) {
+        batch->count = 0;
+        batch->next = 0;
+        sqlite3_bind_int64(query, 1, last);
+        sqlite3_bind_int(query, 2, HASH_BATCH);
+        while( sqlite3_step(query) == SQLITE_ROW ) {
+            i = batch->count++;
+            batch->rowid[i] = last = sqlite3_column_int64(query, 0);
+            batch->path[i] = strdup((const char *) sqlite3_column_text(query, 1));
+            bytes += sqlite3_column_int64(query, 2);
+        }
+        sqlite3_reset(query);
+        if( batch->count == 0 ) break;
 
-static struct fuse_operations xmp_oper = {
-    .init       = catifs_init,
-    .destroy    = catifs_destroy,
-    .getattr	= cati_getattr,
-//    .access		= catifs_access,
-//     .symlink	= catifs_symlink,
-//     .readlink	= catifs_readlink,
-//    .opendir	= catifs_opendir,
-    .readdir    = catifs_readdir,
-//     .releasedir	= catifs_releasedir,
-//     .mknod		= catifs_mknod,
-    .mkdir      = catifs_mkdir,
-//     .unlink     = catifs_unlink,
-    .rmdir	= catifs_unlink,
-    .rename     = catifs_rename,
-//     .link	= catifs_symlink,
-    .chmod      = catifs_chmod,
-    .chown      = catifs_chown,
-//     .truncate   = catifs_truncate,
-    .utimens    = catifs_utimens,
-    .create     = catifs_create,
-    .open       = catifs_open,
-    .read       = catifs_read,
-    .read_buf   = catifs_read_buf,
-    .write      = catifs_write,
-// Commented out until I find why writing to a file is not working
-//     .write_buf  = catifs_write_buf,
-    .statfs     = catifs_statfs,
-    .flush      = catifs_flush,
-    .release    = catifs_release,
-//         .fsync      = catifs_fsync,
-// #ifdef HAVE_POSIX_FALLOCATE
-//     .fallocate	= catifs_fallocate,
-// #endif
-#ifdef HAVE_SETXATTR
-// 	.setxattr	= xmp_setxattr,
-// 	.getxattr	= xmp_getxattr,
-// 	.listxattr	= xmp_listxattr,
-// 	.removexattr	= xmp_removexattr,
-#endif
-// #ifdef HAVE_LIBULOCKMGR
-// 	.lock		= catifs_lock,
-// #endif
-// 	.flock		= catifs_flock,
-};
+        for( started=0; started<jobs; started++ ) {
+            if( pthread_create(&threads[started], NULL, hash_worker, batch) != 0 ) break;
+        }
+        /* Workers take files until none is left, one is enough */
+        if( started == 0 ) hash_worker(batch);
+        for( i=0; i<started; i++ )
+            pthread_join(threads[i], NULL);
 
+        if( db_begin(db) != 0 ) {
+            result = -EIO;
+        } else if( sqlite3_prepare_v2(db,
+                       "UPDATE catifs SET content_hash=?2 WHERE rowid=?1",
+                       -1, &update, 0) != SQLITE_OK ) {
+            result = db_end(db, -EIO);
+        } else {
+            for( i=0; i<batch->count && result == 0; i++ ) {
+                if( batch->result[i] != 0 ) {
+                    fprintf(stderr, "%s: %s\n", batch->path[i], strerror(-batch->result[i]));
+                    ++errors;
+                    continue;
+                }
+                sqlite3_bind_int64(update, 1, batch->rowid[i]);
+                sqlite3_bind_int64(update, 2, (sqlite3_int64) batch->hash[i]);
+                if( sqlite3_step(update) != SQLITE_DONE ) result = -EIO;
+                sqlite3_reset(update);
+                ++hashed;
+            }
+            sqlite3_finalize(update);
+            result = db_end(db, result);
+        }
+        for( i=0; i<batch->count; i++ )
+            free(batch->path[i]);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) * 1e-9;
+        printf("%lld files hashed, %lld errors [%.1f MiB/s]\n", hashed, errors,
+               elapsed > 0 ? bytes / elapsed / 1048576 : 0.0);
+    }
+    sqlite3_finalize(query);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch);
+    free(threads);
+    return result;
+}
 
 /*
- * Show a help message and quit.
+ * Point rows with identical content (same hash and size, then compared
+ * byte by byte) to the backing file of the first of them. The former
+ * real path of a row is kept in dedup_origin for copy on write. If
+ * remove is set, the backing files that are no longer used are deleted
+ * once the catalogue is updated.
  */
-static void showHelp(const char *argv0) {
-  fprintf(stderr, "Usage: %s [options] mount <database> <mount-point>\n", argv0);
-  fprintf(stderr, "Usage: %s [options] add <database> <path> <dest_path>\n", argv0);
-  fprintf(stderr,
-     "Options:\n"
-     "   -c      Create database if it does not exists\n"
-  );
-  exit(1);
+static int dedup_database(struct catifs *fs, int remove)
+{
+    sqlite3 *db = fs->db;
+    sqlite3_stmt *query, *update;
+    sqlite3_int64 hash = 0, size = -1;
+    sqlite3_int64 duplicates = 0, saved = 0;
+    char *canonical = NULL, *canonical_rpath = NULL;
+    sqlite3_int64 canonical_volume = 0;
+    int canonical_has_volume = 0;
+    char **unused = NULL;
+    size_t unused_count = 0, unused_size = 0;
+    int result = 0;
+    int rc;
+    size_t i;
+
+    if( ! fs->hashing ) {
+        fprintf(stderr, "No content hashes in database, run the hash command first\n");
+        return -EINVAL;
+    }
+    if( db_begin(db) != 0 ) return -EIO;
+    if( sqlite3_prepare_v2(db,
+            "SELECT c.rowid, coalesce(v.prefix, '') || c.real_path, c.real_path, "
+            "  c.volume, c.content_hash, c.st_size, c.dedup_origin IS NULL "
+            "FROM catifs c LEFT JOIN catifs_volumes v ON v.id = c.volume "
+            "WHERE c.real_path IS NOT NULL AND (c.content_hash, c.st_size) IN "
+            "  (SELECT content_hash, st_size FROM catifs WHERE content_hash IS NOT NULL "
+            "   GROUP BY content_hash, st_size HAVING count(*) > 1) "
+            "ORDER BY c.content_hash, c.st_size, c.rowid",
+            -1, &query, 0) != SQLITE_OK ) {
+        fprintf(stderr, "Cannot search duplicates: %s\n", sqlite3_errmsg(db));
+        return db_end(db, -EIO);
+    }
+    if( sqlite3_prepare_v2(db,
+            "UPDATE catifs SET real_path=?2, volume=?3, "
+            "  dedup_origin=coalesce(dedup_origin, ?4) WHERE rowid=?1",
+            -1, &update, 0) != SQLITE_OK ) {
+        sqlite3_finalize(query);
+        return db_end(db, -EIO);
+    }
+    while( result == 0 && (rc = sqlite3_step(query)) == SQLITE_ROW ) {
+        const char *path = (const char *) sqlite3_column_text(query, 1);
+
+        if( ! canonical || sqlite3_column_int64(query, 4) != hash ||
+            sqlite3_column_int64(query, 5) != size ) {
+            /* First row of a group */
+            free(canonical);
+            free(canonical_rpath);
+            canonical = strdup(path);
+            canonical_rpath = strdup((const char *) sqlite3_column_text(query, 2));
+            canonical_has_volume = sqlite3_column_type(query, 3) != SQLITE_NULL;
+            canonical_volume = sqlite3_column_int64(query, 3);
+            hash = sqlite3_column_int64(query, 4);
+            size = sqlite3_column_int64(query, 5);
+            continue;
+        }
+        if( strcmp(path, canonical) == 0 ) continue;
+        rc = same_content(canonical, path);
+        if( rc < 0 ) {
+            fprintf(stderr, "%s: %s\n", path, strerror(-rc));
+            continue;
+        }
+        if( rc == 0 ) continue;
+        sqlite3_bind_int64(update, 1, sqlite3_column_int64(query, 0));
+        sqlite3_bind_text(update, 2, canonical_rpath, -1, SQLITE_STATIC);
+        if( canonical_has_volume )
+            sqlite3_bind_int64(update, 3, canonical_volume);
+        else
+            sqlite3_bind_null(update, 3);
+        sqlite3_bind_text(update, 4, path, -1, SQLITE_STATIC);
+        if( sqlite3_step(update) != SQLITE_DONE ) result = -EIO;
+        sqlite3_reset(update);
+        ++duplicates;
+        saved += size;
+        /* Only the own file of a row can become unused, not a shared one */
+        if( remove && sqlite3_column_int(query, 6) ) {
+            if( unused_count == unused_size ) {
+                unused_size = unused_size ? 2 * unused_size : 256;
+                unused = realloc(unused, unused_size * sizeof(*unused));
+            }
+            unused[unused_count++] = strdup(path);
+        }
+    }
+    sqlite3_finalize(query);
+    sqlite3_finalize(update);
+    free(canonical);
+    free(canonical_rpath);
+    result = db_end(db, result);
+    if( result == 0 ) {
+        printf("%lld duplicates [%lld bytes]\n", duplicates, saved);
+        for( i=0; i<unused_count; i++ ) {
+            if( unlink(unused[i]) == -1 )
+                fprintf(stderr, "%s: %s\n", unused[i], strerror(errno));
+        }
+    }
+    for( i=0; i<unused_count; i++ )
+        free(unused[i]);
+    free(unused);
+    return result;
 }
 
 
-static sqlite3 *open_database(const char *dbString, int createFlag) {
-    sqlite3 *db;
-    int flags;
+/*
+ * Replace the backing files of the regular files below path (or of all
+ * of them) by copies in the seekable compressed format. Files that do
+ * not get smaller are left as they are. A backing file shared by
+ * several rows is compressed once. If remove is set, the uncompressed
+ * files are deleted.
+ */
+static int compress_database(struct catifs *fs, const char *path, int remove)
+{
+    sqlite3 *db = fs->db;
+    sqlite3_stmt *query, *update;
+    char **files = NULL;
+    size_t count = 0, allocated = 0, i;
+    sqlite3_int64 compressed = 0, size_in = 0, size_out = 0;
+    struct stat before, after;
+    char *zpath;
+    int result = 0;
     int rc;
-    
-    if (createFlag)
-        flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI | SQLITE_OPEN_CREATE;
-    else
-        flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI;
-    rc = sqlite3_open_v2(dbString, &db, flags, 0);
-    if( rc != SQLITE_OK ) {
-        fprintf(stderr, "Cannot open sqlite database: %s\n", dbString);
-        exit(1);
+
+    if( sqlite3_prepare_v2(db,
+            "SELECT DISTINCT coalesce(v.prefix, '') || c.real_path "
+            "FROM catifs c LEFT JOIN catifs_volumes v ON v.id = c.volume "
+            "WHERE c.real_path IS NOT NULL AND c.st_mode & 61440 = 32768 "
+            "AND coalesce(c.compression, 0) = 0 "
+            "AND (?1 IS NULL OR c.path = ?1 OR (c.path > ?1 || '/' AND c.path < ?1 || '0'))",
+            -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    while( sqlite3_step(query) == SQLITE_ROW ) {
+        if( count == allocated ) {
+            allocated = allocated ? 2 * allocated : 256;
+            files = realloc(files, allocated * sizeof(*files));
+        }
+        files[count++] = strdup((const char *) sqlite3_column_text(query, 0));
     }
-    rc = sqlite3_exec(db, "SELECT 1 FROM catifs LIMIT 1", 0, 0, 0);
-    if( rc != SQLITE_OK && createFlag ){
-        rc = sqlite3_exec(db, schema, 0, 0, 0);
-        if (rc != SQLITE_OK) {
-            fprintf(stderr, "Cannot create database schema: %s\n", sqlite3_errmsg(db));
-            sqlite3_close(db);
-            exit(1);
+    sqlite3_finalize(query);
+
+    if( sqlite3_prepare_v2(db, fs->hashing ?
+            "UPDATE catifs SET real_path = real_path || '.zst', compression=?2, "
+            "  content_hash=NULL "
+            "WHERE coalesce((SELECT prefix FROM catifs_volumes WHERE id = volume), '') "
+            "  || real_path = ?1" :
+            "UPDATE catifs SET real_path = real_path || '.zst', compression=?2 "
+            "WHERE coalesce((SELECT prefix FROM catifs_volumes WHERE id = volume), '') "
+            "  || real_path = ?1",
+            -1, &update, 0) != SQLITE_OK )
+        result = -EIO;
+    for( i=0; i<count && result == 0; i++ ) {
+        zpath = sqlite3_mprintf("%s.zst", files[i]);
+        rc = compress_file(files[i], zpath);
+        if( rc == 0 && (stat(files[i], &before) == -1 || stat(zpath, &after) == -1) )
+            rc = -errno;
+        if( rc != 0 ) {
+            fprintf(stderr, "%s: %s\n", files[i], strerror(-rc));
+        } else if( after.st_size >= before.st_size ) {
+            unlink(zpath);
+        } else {
+            sqlite3_bind_text(update, 1, files[i], -1, SQLITE_STATIC);
+            sqlite3_bind_int(update, 2, COMPRESSION_ZSTD_SEEKABLE);
+            if( sqlite3_step(update) != SQLITE_DONE ) {
+                fprintf(stderr, "Cannot update database: %s\n", sqlite3_errmsg(db));
+                unlink(zpath);
+                result = -EIO;
+            } else {
+                ++compressed;
+                size_in += before.st_size;
+                size_out += after.st_size;
+                if( remove && unlink(files[i]) == -1 )
+                    fprintf(stderr, "%s: %s\n", files[i], strerror(errno));
+            }
+            sqlite3_reset(update);
         }
-        rc = sqlite3_exec(db, "SELECT 1 FROM catifs LIMIT 1", 0, 0, 0);
+        sqlite3_free(zpath);
     }
-    if( rc != SQLITE_OK ){
-        fprintf(stderr, "Invalid SQLite database schema: %s\n", dbString);
-        sqlite3_close(db);
-        exit(1);
+    sqlite3_finalize(update);
+    printf("%lld files compressed [%lld -> %lld bytes]\n", compressed, size_in, size_out);
+    for( i=0; i<count; i++ )
+        free(files[i]);
+    free(files);
+    return result;
+}
+
+/*
+ * Print the changes after seq since, one per line:
+ * <seq> <time> <op> <path> [<target>] separated by tabs.
+ */
+static int changes_list(sqlite3 *db, sqlite3_int64 since)
+{
+    sqlite3_stmt *query;
+    int op;
+
+    if( sqlite3_prepare_v2(db,
+            "SELECT seq, time, op, path, target FROM catifs_changes "
+            "WHERE seq > ?1 ORDER BY seq",
+            -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    sqlite3_bind_int64(query, 1, since);
+    while( sqlite3_step(query) == SQLITE_ROW ) {
+        op = sqlite3_column_int(query, 2);
+        printf("%lld\t%lld\t%s\t%s", sqlite3_column_int64(query, 0),
+               sqlite3_column_int64(query, 1),
+               op > 0 && op <= CHANGE_REMOVE_ATTR ? change_names[op] : "?",
+               sqlite3_column_text(query, 3));
+        if( sqlite3_column_type(query, 4) != SQLITE_NULL )
+            printf("\t%s", sqlite3_column_text(query, 4));
+        putchar('\n');
     }
-    return db;
+    sqlite3_finalize(query);
+    return 0;
+}
+
+/*
+ * Forget the changes up to seq upto, once all consumers have seen them.
+ */
+static int changes_prune(sqlite3 *db, sqlite3_int64 upto)
+{
+    sqlite3_stmt *query;
+    int result;
+
+    if( sqlite3_prepare_v2(db, "DELETE FROM catifs_changes WHERE seq <= ?1",
+                           -1, &query, 0) != SQLITE_OK )
+        return -EIO;
+    sqlite3_bind_int64(query, 1, upto);
+    result = sqlite3_step(query) == SQLITE_DONE ? 0 : -EIO;
+    sqlite3_finalize(query);
+    if( result == 0 )
+        fprintf(stderr, "%d changes pruned\n", sqlite3_changes(db));
+    return result;
 }
 
+
 int main(int argc, char *argv[])
 {
     umask(0);
     int i, j;
     int createFlag = 0;
+    int jobs = 0;
+    int prefetch = PREFETCH_THREADS;
+    unsigned latency = 0;
+    char *cacheDir = 0;
+    uint64_t cacheSize = CACHE_SIZE;
+    int removeFlag = 0;
+    sqlite3_int64 since = 0;
+    sqlite3_int64 prune = -1;
+    char *snapshot = 0;
+    char *arg;
     char *cmdString = 0;
     char *dbString = 0;
     char *mountPoint = 0;
-    sqlite3 *db;
-    char *fuseArgv[5];
+    struct catifs fs;
+    struct catifs_mount mount;
+    char *fuseArgv[7];
+    int fuseArgc;
     int result;
     
     for( i=1; i<argc; i++ ){
-        if( argv[i][0] == '-' ) {
-            for( j=1; argv[i][j]; j++ ) {
-                switch( argv[i][j] ){
+        if( argv[i][0] == '-' && argv[i][1] == '-' && argv[i][2] ) {
+            if( i + 1 == argc ) showHelp(argv[0]);
+            if( strcmp(argv[i], "--since") == 0 )
+                since = strtoll(argv[++i], NULL, 10);
+            else if( strcmp(argv[i], "--prune") == 0 )
+                prune = strtoll(argv[++i], NULL, 10);
+            else if( strcmp(argv[i], "--snapshot") == 0 )
+                snapshot = argv[++i];
+            else
+                showHelp(argv[0]);
+        } else if( argv[i][0] == '-' ) {
+            arg = argv[i];
+            for( j=1; arg[j]; j++ ) {
+                switch( arg[j] ){
                     case 'c':
                         createFlag++;
                         break;
+                    case 'C':
+                        if( ++i == argc ) showHelp(argv[0]);
+                        cacheDir = argv[i];
+                        break;
+                    case 'j':
+                        if( ++i == argc ) showHelp(argv[0]);
+                        jobs = atoi(argv[i]);
+                        break;
+                    case 'l':
+                        if( ++i == argc ) showHelp(argv[0]);
+                        latency = atoi(argv[i]);
+                        break;
+                    case 'p':
+                        if( ++i == argc ) showHelp(argv[0]);
+                        prefetch = atoi(argv[i]);
+                        break;
+                    case 'r':
+                        removeFlag++;
+                        break;
+                    case 'S':
+                        if( ++i == argc ) showHelp(argv[0]);
+                        cacheSize = strtoull(argv[i], NULL, 10);
+                        break;
                     case '-':
                         break;
                     default:
@@ -1044,20 +6300,58 @@ int main(int argc, char *argv[])
         }
     }
     if( cmdString == 0 || dbString==0 ) showHelp(argv[0]);
+    memset(&fs, 0, sizeof(fs));
     if ( strcmp(cmdString, "mount" ) == 0) {
-        if ( i == argc - 1 ) {
-            mountPoint = argv[i];
-            db = open_database(dbString, createFlag);
+        if ( i <= argc - 1 ) {
+            /* <database>[@<prefix>] ... <mount-point> */
+            mountPoint = argv[argc - 1];
+            mount.count = argc - i;
+            mount.shards = calloc(mount.count, sizeof(*mount.shards));
+            for( j=0; j<mount.count; j++ ) {
+                struct catifs_shard *shard = &mount.shards[j];
+                char *spec = j == 0 ? dbString : argv[i + j - 1];
+                char *at = strrchr(spec, '@');
+                if( at && at[1] == '/' ) {
+                    *at = 0;
+                    shard->prefix = at + 1;
+                    shard->prefix_len = strlen(shard->prefix);
+                    while( shard->prefix_len > 0 && shard->prefix[shard->prefix_len - 1] == '/' )
+                        shard->prefix[--shard->prefix_len] = 0;
+                } else {
+                    shard->prefix = "";
+                }
+                open_database(&shard->fs, spec, createFlag);
+                if( snapshot && snapshot_open(&shard->fs, snapshot) != 0 ) return 1;
+                bloom_build(&shard->fs);
+            }
             fuseArgv[0] = argv[0];
             fuseArgv[1] = "-f"; // foreground
             fuseArgv[2] = "-s"; // single trheaded
 #ifdef DEBUG
             fuseArgv[2] = "-d"; // single trheaded
-            fprintf(stderr, "Database pointer: %p\n", db);
+            fprintf(stderr, "Database pointer: %p\n", mount.shards[0].fs.db);
 #endif
-            fuseArgv[3] = mountPoint;
-            fuseArgv[4] = 0;
-            result = fuse_main(4, fuseArgv, &xmp_oper, db);
+            fuseArgc = 3;
+            if( snapshot ) {
+                fuseArgv[fuseArgc++] = "-o";
+                fuseArgv[fuseArgc++] = "ro";
+            }
+            fuseArgv[fuseArgc++] = mountPoint;
+            fuseArgv[fuseArgc] = 0;
+            mount.control_running = 0;
+            mount.latency = latency;
+            mount.prefetch = prefetch_start(prefetch);
+            mount.cache = NULL;
+            if( cacheDir ) {
+                mount.cache = cache_open(cacheDir, cacheSize << 20);
+                if( ! mount.cache ) return 1;
+            }
+            /* A snapshot is read only, updates go to the live mount */
+            if( ! snapshot ) control_start(&mount);
+            result = fuse_main(fuseArgc, fuseArgv, &xmp_oper, &mount);
+            if( ! snapshot ) control_stop(&mount);
+            prefetch_stop(mount.prefetch);
+            cache_close(mount.cache);
             return result;
         }
     } else if ( strcmp(cmdString, "add") == 0 ) {
@@ -1069,11 +6363,130 @@ int main(int argc, char *argv[])
             if (i < argc) {
                 dst = argv[i++];
                 if (i == argc) {
-                    db = open_database(dbString, createFlag);
-                    return add_path_to_database(db, src, dst);
+                    /* Hand the request to a running mount if there is one */
+                    char *absolute = realpath(src, NULL);
+                    if( absolute && ! strpbrk(absolute, "\t\n") && ! strpbrk(dst, "\t\n") ) {
+                        char *request = sqlite3_mprintf("add\t%s\t%s\n", absolute, dst);
+                        char reply[32];
+                        result = control_send(dbString, request, reply, sizeof(reply));
+                        sqlite3_free(request);
+                        if( result != -ENOENT ) {
+                            free(absolute);
+                            return result == 0 && reply[0] ? atoi(reply) : -EIO;
+                        }
+                    }
+                    free(absolute);
+                    open_database(&fs, dbString, createFlag);
+                    return add_path_to_database(&fs, src, dst);
                 }
             }
         }
+    } else if ( strcmp(cmdString, "mkdir") == 0 ) {
+        /* Paths from the command line or else one per line on stdin */
+        char **paths = i < argc ? argv + i : NULL;
+        size_t count = i < argc ? argc - i : 0, allocated = 0;
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t n;
+
+        while( i == argc && (n = getline(&line, &size, stdin)) != -1 ) {
+            if( n > 0 && line[n - 1] == '\n' ) line[--n] = 0;
+            if( n == 0 ) continue;
+            if( count == allocated ) {
+                allocated = allocated ? 2 * allocated : 1024;
+                paths = realloc(paths, allocated * sizeof(*paths));
+                if( ! paths ) return 1;
+            }
+            paths[count++] = strdup(line);
+        }
+        free(line);
+        /* Hand the paths to a running mount if there is one */
+        result = control_mkdirs(dbString, paths, count);
+        if( result >= 0 ) return result == 0 ? 0 : 1;
+        /* Otherwise the whole batch is one transaction of the database */
+        open_database(&fs, dbString, createFlag);
+        if( db_begin(fs.db) != 0 ) return 1;
+        for( j=0, result=0; j<count && result == 0; j++ ) {
+            result = make_dirs(&fs, paths[j], 0755, getuid(), getgid());
+            if( result != 0 )
+                fprintf(stderr, "Cannot create %s: %s\n", paths[j], strerror(-result));
+        }
+        return db_end(fs.db, result) == 0 ? 0 : 1;
+    } else if ( strcmp(cmdString, "aggregate") == 0 ) {
+        if (i == argc) {
+            open_database(&fs, dbString, createFlag);
+            if( sqlite3_exec(fs.db, tree_rebuild, 0, 0, 0) != SQLITE_OK ) {
+                fprintf(stderr, "Cannot compute aggregates: %s\n", sqlite3_errmsg(fs.db));
+                return 1;
+            }
+            return 0;
+        }
+    } else if ( strcmp(cmdString, "compact") == 0 ) {
+        if (i == argc) {
+            open_database(&fs, dbString, createFlag);
+            return compact_database(&fs) == 0 ? 0 : 1;
+        }
+    } else if ( strcmp(cmdString, "volume") == 0 ) {
+        if (i == argc - 1 && strcmp(argv[i], "list") == 0) {
+            open_database(&fs, dbString, createFlag);
+            return volume_list(fs.db) == 0 ? 0 : 1;
+        } else if (i == argc - 2 && strcmp(argv[i], "add") == 0) {
+            open_database(&fs, dbString, createFlag);
+            return volume_add(fs.db, argv[i+1]) == 0 ? 0 : 1;
+        } else if (i == argc - 3 && strcmp(argv[i], "move") == 0) {
+            open_database(&fs, dbString, createFlag);
+            return volume_move(&fs, argv[i+1], argv[i+2]) == 0 ? 0 : 1;
+        }
+    } else if ( strcmp(cmdString, "hash") == 0 ) {
+        if (i == argc) {
+            open_database(&fs, dbString, createFlag);
+            return hash_database(&fs, jobs) == 0 ? 0 : 1;
+        }
+    } else if ( strcmp(cmdString, "dedup") == 0 ) {
+        if (i == argc) {
+            open_database(&fs, dbString, createFlag);
+            return dedup_database(&fs, removeFlag) == 0 ? 0 : 1;
+        }
+    } else if ( strcmp(cmdString, "compress") == 0 ) {
+        if (i >= argc - 1) {
+            open_database(&fs, dbString, createFlag);
+            return compress_database(&fs, i < argc ? argv[i] : NULL, removeFlag) == 0 ? 0 : 1;
+        }
+    } else if ( strcmp(cmdString, "changes") == 0 ) {
+        if (i == argc) {
+            open_database(&fs, dbString, createFlag);
+            if( prune >= 0 )
+                return changes_prune(fs.db, prune) == 0 ? 0 : 1;
+            return changes_list(fs.db, since) == 0 ? 0 : 1;
+        }
+    } else if ( strcmp(cmdString, "snapshot") == 0 ) {
+        if (i == argc) {
+            open_database(&fs, dbString, createFlag);
+            return snapshot_list(fs.db) == 0 ? 0 : 1;
+        } else if (i == argc - 1) {
+            open_database(&fs, dbString, createFlag);
+            return snapshot_create(fs.db, argv[i]) == 0 ? 0 : 1;
+        }
+    } else if ( strcmp(cmdString, "dump") == 0 || strcmp(cmdString, "load") == 0 ) {
+        if (i >= argc - 1) {
+            int dump = strcmp(cmdString, "dump") == 0;
+            FILE *file = dump ? stdout : stdin;
+
+            if( i < argc ) file = fopen(argv[i], dump ? "wb" : "rb");
+            if( ! file ) {
+                fprintf(stderr, "Cannot open %s: %s\n", argv[i], strerror(errno));
+                return 1;
+            }
+            setvbuf(file, NULL, _IOFBF, 1 << 20);
+            open_database(&fs, dbString, createFlag);
+            result = dump ? dump_database(&fs, file) : load_database(&fs, file);
+            if( fclose(file) != 0 && result == 0 ) {
+                fprintf(stderr, "Cannot write dump: %s\n", strerror(errno));
+                result = -EIO;
+            }
+            return result == 0 ? 0 : 1;
+        }
     }
     showHelp(argv[0]);
+    return 1;
 }
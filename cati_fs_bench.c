@@ -0,0 +1,460 @@
+/*
+ * Metadata microbenchmark of cati_fs. A synthetic catalogue is generated
+ * (or reused) and the operation handlers of cati_fs.c are called
+ * directly, without FUSE and the kernel. Results (operations per second
+ * and latency percentiles per operation) are written as JSON on stdout
+ * so that they can be compared between versions.
+ *
+ * Build and run with "make bench" (see BENCH_ARGS in the Makefile) or:
+ *
+ *      ./cati_fs_bench [-d <depth>] [-f <fan-out>] [-n <entries>] [-o <ops>] [-c] [<database>]
+ *
+ * The catalogue has depth levels of fan-out directories below the root
+ * and its files are spread over the deepest directories. A database
+ * given on the command line is generated once and reused by the next
+ * runs, it must be reused with the same -d, -f and -n.
+ */
+
+/* Handlers get the mount from fuse_get_context(), there is no FUSE session here */
+#define fuse_get_context bench_context
+#define main cati_fs_main
+#include "cati_fs.c"
+#undef main
+#undef fuse_get_context
+
+#include <time.h>
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+struct bench {
+    int depth;
+    int fanout;
+    long long entries;
+    long long dirs;         /* directories below the root */
+    long long leaves;       /* directories of the last level */
+    long long files;
+    int compact;
+    int ops;                /* calls of each operation */
+    struct catifs_mount mount;
+    struct catifs_shard shard;
+    double *latencies;
+    uint64_t random;
+    int first;              /* print a ',' before the next JSON result */
+};
+
+static struct fuse_context bench_fuse_context;
+
+struct fuse_context *bench_context(void)
+{
+    return &bench_fuse_context;
+}
+
+static double bench_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* xorshift64*, the sequence is the same on every run */
+static long long bench_random(struct bench *bench, long long n)
+{
+    bench->random ^= bench->random >> 12;
+    bench->random ^= bench->random << 25;
+    bench->random ^= bench->random >> 27;
+    return (bench->random * 0x2545f4914f6cdd1dULL >> 1) % n;
+}
+
+/*
+ * Path of directory index (0 <= index < fanout^level) of a level (the
+ * root is level 0), one component per digit of index in base fanout.
+ */
+static int bench_dir_path(const struct bench *bench, int level, long long index,
+                          char *path, size_t size)
+{
+    int digits[64];
+    int i, n = 0;
+
+    path[0] = 0;
+    for( i=0; i<level; i++ ) {
+        digits[i] = index % bench->fanout;
+        index /= bench->fanout;
+    }
+    for( i=level-1; i>=0; i-- )
+        n += snprintf(path + n, size - n, "/d%d", digits[i]);
+    return n;
+}
+
+/* Number of files in a leaf directory, the first ones get the remainder */
+static long long bench_leaf_files(const struct bench *bench, long long leaf)
+{
+    return bench->files / bench->leaves + (leaf < bench->files % bench->leaves);
+}
+
+static int bench_file_path(const struct bench *bench, long long leaf, long long file,
+                           char *path, size_t size)
+{
+    int n = bench_dir_path(bench, bench->depth, leaf, path, size);
+
+    return n + snprintf(path + n, size - n, "/f%lld", file);
+}
+
+static int bench_insert(struct catifs *fs, sqlite3_stmt *query, const char *path,
+                        mode_t mode, off_t size, long long n)
+{
+    char real_path[64];
+    struct stat buf;
+    int result = 0;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.st_mode = mode;
+    buf.st_nlink = 1;
+    buf.st_uid = 1000;
+    buf.st_gid = 1000;
+    buf.st_size = size;
+    buf.st_blksize = 4096;
+    buf.st_blocks = (size + 511) / 512;
+    buf.st_mtim.tv_sec = buf.st_atim.tv_sec = buf.st_ctim.tv_sec = 1600000000 + n;
+    snprintf(real_path, sizeof(real_path), "/synthetic/%lld", n);
+    sqlite3_bind_text(query, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_text(query, 2, real_path, -1, SQLITE_STATIC);
+    if( stat_bind(fs, query, &buf) != 0 || sqlite3_step(query) != SQLITE_DONE )
+        result = -EIO;
+    sqlite3_reset(query);
+    return result;
+}
+
+/*
+ * Fill an empty catalogue, directories of a level then files, in one
+ * transaction.
+ */
+static int bench_generate(struct bench *bench)
+{
+    struct catifs *fs = &bench->shard.fs;
+    sqlite3_stmt *query;
+    char path[PATH_MAX];
+    long long index, count, n = 0, leaf, file;
+    int level, result = 0;
+
+    sqlite3_exec(fs->db, "PRAGMA synchronous = OFF;", 0, 0, 0);
+    if( db_begin(fs->db) != 0 ) return -EIO;
+    if( sqlite3_prepare_v2(fs->db, stat_insert[fs->compact], -1, &query, 0) != SQLITE_OK )
+        return db_end(fs->db, -EIO);
+    for( level=1, count=bench->fanout; level<=bench->depth && result == 0;
+         level++, count*=bench->fanout ) {
+        for( index=0; index<count && result == 0; index++ ) {
+            bench_dir_path(bench, level, index, path, sizeof(path));
+            result = bench_insert(fs, query, path, S_IFDIR | 0755, 4096, n++);
+        }
+    }
+    for( leaf=0; leaf<bench->leaves && result == 0; leaf++ ) {
+        for( file=0; file<bench_leaf_files(bench, leaf) && result == 0; file++ ) {
+            bench_file_path(bench, leaf, file, path, sizeof(path));
+            result = bench_insert(fs, query, path, S_IFREG | 0644, 1 + n % 1048576, n);
+            ++n;
+        }
+        if( leaf % 1000 == 999 )
+            fprintf(stderr, "%lld entries generated\r", n);
+    }
+    sqlite3_finalize(query);
+    if( result == 0 && sqlite3_exec(fs->db, tree_rebuild, 0, 0, 0) != SQLITE_OK )
+        result = -EIO;
+    if( result != 0 )
+        fprintf(stderr, "Cannot generate catalogue: %s\n", sqlite3_errmsg(fs->db));
+    return db_end(fs->db, result);
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Sort the latencies of the ops calls of an operation that lasted
+ * elapsed seconds and print its results.
+ */
+static void bench_report(struct bench *bench, const char *name, int ops,
+                         double elapsed, int errors)
+{
+    qsort(bench->latencies, ops, sizeof(*bench->latencies), bench_compare);
+    printf("%s\n    \"%s\": {\"ops\": %d, \"errors\": %d, \"ops_per_sec\": %.1f, "
+           "\"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f}",
+           bench->first ? "" : ",", name, ops, errors, ops / elapsed,
+           bench->latencies[ops / 2] * 1e6, bench->latencies[ops * 99 / 100] * 1e6,
+           bench->latencies[ops - 1] * 1e6);
+    fprintf(stderr, "%-16s %10.1f ops/s  p50 %8.2f us  p99 %8.2f us%s\n", name, ops / elapsed,
+            bench->latencies[ops / 2] * 1e6, bench->latencies[ops * 99 / 100] * 1e6,
+            errors ? "  (errors)" : "");
+    bench->first = 0;
+}
+
+static int bench_filler(void *buf, const char *name, const struct stat *stbuf,
+                        off_t off, enum fuse_fill_dir_flags flags)
+{
+    ++*(long long *) buf;
+    return 0;
+}
+
+enum {
+    BENCH_GETATTR, BENCH_GETATTR_DIR, BENCH_GETATTR_MISSING, BENCH_READDIR,
+    BENCH_RENAME, BENCH_RENAME_DIR, BENCH_MKDIR, BENCH_ADD, BENCH_UNLINK,
+    BENCH_RMDIR, BENCH_STATFS, BENCH_COUNT
+};
+
+static const char *bench_names[BENCH_COUNT] = {
+    "getattr", "getattr_dir", "getattr_missing", "readdir", "rename",
+    "rename_dir", "mkdir", "add", "unlink", "rmdir", "statfs",
+};
+
+/*
+ * One call of an operation on a random entry. Calls are paired so that
+ * the catalogue is unchanged after a run: odd calls of rename and
+ * rename_dir move the entry back, unlink removes the files created by
+ * add and rmdir the directories created by mkdir (their paths are in
+ * created).
+ */
+static int bench_call(struct bench *bench, int op, int call, const char *source,
+                      char (*created)[PATH_MAX], double *latency)
+{
+    static char from[PATH_MAX], to[PATH_MAX];
+    char path[PATH_MAX];
+    struct fuse_file_info fi;
+    struct statvfs vfs;
+    struct stat buf;
+    long long leaf = bench_random(bench, bench->leaves), entries = 0;
+    double start;
+    int n, result = 0;
+
+    switch( op ) {
+        case BENCH_GETATTR:
+            bench_file_path(bench, leaf, bench_random(bench, bench_leaf_files(bench, leaf)),
+                            path, sizeof(path));
+            break;
+        case BENCH_GETATTR_DIR:
+        case BENCH_READDIR:
+            if( bench_dir_path(bench, bench->depth, leaf, path, sizeof(path)) == 0 )
+                strcpy(path, "/");
+            break;
+        case BENCH_GETATTR_MISSING:
+            n = bench_dir_path(bench, bench->depth, leaf, path, sizeof(path));
+            snprintf(path + n, sizeof(path) - n, "/missing%d", call);
+            break;
+        case BENCH_RENAME:
+        case BENCH_RENAME_DIR:
+            if( call % 2 == 1 ) break;
+            if( op == BENCH_RENAME )
+                bench_file_path(bench, leaf, bench_random(bench, bench_leaf_files(bench, leaf)),
+                                from, sizeof(from));
+            else
+                bench_dir_path(bench, bench->depth, leaf, from, sizeof(from));
+            snprintf(to, sizeof(to), "%s.renamed", from);
+            break;
+        case BENCH_MKDIR:
+        case BENCH_ADD:
+            n = bench_dir_path(bench, bench->depth, leaf, created[call], PATH_MAX);
+            snprintf(created[call] + n, PATH_MAX - n, "/%s%d", bench_names[op], call);
+            break;
+    }
+    start = bench_now();
+    switch( op ) {
+        case BENCH_GETATTR:
+        case BENCH_GETATTR_DIR:
+            result = cati_getattr(path, &buf, NULL);
+            break;
+        case BENCH_GETATTR_MISSING:
+            result = cati_getattr(path, &buf, NULL) == -ENOENT ? 0 : -EIO;
+            break;
+        case BENCH_READDIR:
+            memset(&fi, 0, sizeof(fi));
+            result = catifs_opendir(path, &fi);
+            if( result == 0 ) {
+                result = catifs_readdir(path, &entries, bench_filler, 0, &fi, 0);
+                catifs_releasedir(path, &fi);
+            }
+            break;
+        case BENCH_RENAME:
+        case BENCH_RENAME_DIR:
+            result = call % 2 == 0 ? catifs_rename(from, to, 0) : catifs_rename(to, from, 0);
+            break;
+        case BENCH_MKDIR:
+            result = catifs_mkdir(created[call], 0755);
+            break;
+        case BENCH_ADD:
+            result = add_path_to_database(&bench->shard.fs, source, created[call]);
+            break;
+        case BENCH_UNLINK:
+            result = catifs_unlink(created[call]);
+            break;
+        case BENCH_RMDIR:
+            result = catifs_rmdir(created[call]);
+            break;
+        case BENCH_STATFS:
+            result = catifs_statfs("/", &vfs);
+            break;
+    }
+    *latency = bench_now() - start;
+    return result;
+}
+
+/*
+ * Run every operation and print the "operations" object of the results.
+ */
+static int bench_run(struct bench *bench, const char *source)
+{
+    char (*dirs)[PATH_MAX] = calloc(bench->ops, PATH_MAX);
+    char (*files)[PATH_MAX] = calloc(bench->ops, PATH_MAX);
+    double start, elapsed;
+    int op, call, errors;
+
+    bench->latencies = malloc(bench->ops * sizeof(*bench->latencies));
+    if( ! dirs || ! files || ! bench->latencies ) return -ENOMEM;
+    bench->first = 1;
+    printf("  \"operations\": {");
+    for( op=0; op<BENCH_COUNT; op++ ) {
+        errors = 0;
+        start = bench_now();
+        for( call=0; call<bench->ops; call++ ) {
+            if( bench_call(bench, op, call, source,
+                           op == BENCH_MKDIR || op == BENCH_RMDIR ? dirs : files,
+                           &bench->latencies[call]) != 0 )
+                ++errors;
+        }
+        elapsed = bench_now() - start;
+        bench_report(bench, bench_names[op], bench->ops, elapsed, errors);
+    }
+    printf("\n  }\n");
+    free(dirs);
+    free(files);
+    free(bench->latencies);
+    return 0;
+}
+
+static void bench_help(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options] [<database>]\n", argv0);
+    fprintf(stderr,
+       "Options:\n"
+       "   -c        Generate a compact catalogue\n"
+       "   -d <n>    Levels of directories (default: 3)\n"
+       "   -f <n>    Sub-directories per directory (default: 10)\n"
+       "   -n <n>    Number of entries (default: 100000)\n"
+       "   -o <n>    Calls of each operation (default: 10000)\n"
+    );
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench bench;
+    char database[] = "/tmp/cati_fs_bench_XXXXXX";
+    char source[] = "/tmp/cati_fs_bench_file_XXXXXX";
+    const char *dbString = NULL;
+    sqlite3_stmt *query;
+    long long count = 0, level_count;
+    double start, generate = 0;
+    int i, level, fd, result;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.depth = 3;
+    bench.fanout = 10;
+    bench.entries = 100000;
+    bench.ops = 10000;
+    bench.random = 88172645463325252ULL;
+    for( i=1; i<argc; i++ ) {
+        if( argv[i][0] == '-' && argv[i][1] && ! argv[i][2] ) {
+            if( argv[i][1] == 'c' ) {
+                bench.compact = 1;
+                continue;
+            }
+            if( i + 1 == argc ) bench_help(argv[0]);
+            switch( argv[i][1] ) {
+                case 'd':
+                    bench.depth = atoi(argv[++i]);
+                    break;
+                case 'f':
+                    bench.fanout = atoi(argv[++i]);
+                    break;
+                case 'n':
+                    bench.entries = atoll(argv[++i]);
+                    break;
+                case 'o':
+                    bench.ops = atoi(argv[++i]);
+                    break;
+                default:
+                    bench_help(argv[0]);
+            }
+        } else if( ! dbString ) {
+            dbString = argv[i];
+        } else {
+            bench_help(argv[0]);
+        }
+    }
+    if( bench.depth < 0 || bench.depth > 16 || bench.fanout < 1 || bench.ops < 2 )
+        bench_help(argv[0]);
+    /* rename and rename_dir calls go by pairs */
+    bench.ops += bench.ops % 2;
+    for( level=1, level_count=1; level<=bench.depth; level++ ) {
+        level_count *= bench.fanout;
+        bench.dirs += level_count;
+    }
+    bench.leaves = level_count;
+    bench.files = bench.entries - bench.dirs;
+    if( bench.files < bench.leaves ) {
+        fprintf(stderr, "%lld entries are not enough for %lld directories and "
+                "one file per directory of the last level\n", bench.entries, bench.dirs);
+        return 1;
+    }
+
+    /* A temporary catalogue unless one was given */
+    if( ! dbString ) {
+        fd = mkstemp(database);
+        if( fd == -1 ) return 1;
+        close(fd);
+        unlink(database);
+    }
+    fd = mkstemp(source);
+    if( fd == -1 || write(fd, "cati_fs", 7) != 7 ) return 1;
+    close(fd);
+
+    open_database(&bench.shard.fs, dbString ? dbString : database, 1);
+    if( sqlite3_prepare_v2(bench.shard.fs.db, "SELECT count(*) FROM catifs",
+                           -1, &query, 0) == SQLITE_OK && sqlite3_step(query) == SQLITE_ROW )
+        count = sqlite3_column_int64(query, 0);
+    sqlite3_finalize(query);
+    if( count == 0 ) {
+        if( bench.compact && compact_database(&bench.shard.fs) != 0 ) return 1;
+        start = bench_now();
+        if( bench_generate(&bench) != 0 ) return 1;
+        generate = bench_now() - start;
+        fprintf(stderr, "%lld entries generated in %.1f s\n", bench.entries, generate);
+    } else if( count != bench.entries ) {
+        fprintf(stderr, "%s has %lld entries instead of %lld\n", dbString, count, bench.entries);
+        return 1;
+    }
+    bench.shard.prefix = "";
+    bench.mount.count = 1;
+    bench.mount.shards = &bench.shard;
+    bench_fuse_context.private_data = &bench.mount;
+    bloom_build(&bench.shard.fs);
+
+    printf("{\n");
+    printf("  \"revision\": \"%s\",\n", BENCH_REVISION);
+    printf("  \"sqlite\": \"%s\",\n", sqlite3_libversion());
+    printf("  \"catalogue\": {\"entries\": %lld, \"directories\": %lld, \"depth\": %d, "
+           "\"fanout\": %d, \"compact\": %s, \"generate_sec\": %.2f},\n",
+           bench.entries, bench.dirs, bench.depth, bench.fanout,
+           bench.shard.fs.compact ? "true" : "false", generate);
+    result = bench_run(&bench, source);
+    printf("}\n");
+
+    bloom_free(&bench.shard.fs.bloom);
+    sqlite3_close(bench.shard.fs.db);
+    unlink(source);
+    if( ! dbString ) unlink(database);
+    return result == 0 ? 0 : 1;
+}
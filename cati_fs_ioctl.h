@@ -0,0 +1,50 @@
+/*
+ * ioctl of cati_fs on directories, shared by cati_fs.c and its clients
+ * (see catifs_dir.py for a Python client).
+ *
+ * CATIFS_IOC_DIR_PAGE fills a page with the next entries of an open
+ * directory, their stat fields and their attributes (catifs_attrs), in
+ * a single request instead of one readdir plus one getattr and several
+ * getxattr per entry. The first call is made with cursor 0, the next
+ * ones with the cursor returned by the previous call, until flags has
+ * CATIFS_DIR_PAGE_END. Entries do not include "." and "..".
+ *
+ * data holds count entries packed one after the other. Integers are
+ * zigzag LEB128 varints (see varint_put() in cati_fs.c) and strings are
+ * a varint length followed by the bytes (no terminating 0):
+ *
+ *   name
+ *   st_ino, st_mode, st_size
+ *   stat record: a format byte (1) followed by the varints st_dev,
+ *     st_nlink, st_uid, st_gid, st_rdev, st_blksize, st_blocks,
+ *     st_atim sec and nsec, st_mtim sec and nsec, st_ctim sec and nsec
+ *   attributes: pairs of strings (name without "user.", value) where the
+ *     length of the name is incremented by one, ended by a 0 varint
+ *
+ * An entry never spans two pages, the ioctl fails with E2BIG for an
+ * entry (with its attributes) larger than data.
+ */
+#ifndef CATI_FS_IOCTL_H
+#define CATI_FS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/* The size of an ioctl argument is limited to 14 bits */
+#define CATIFS_DIR_PAGE_SIZE 16376
+#define CATIFS_DIR_PAGE_DATA (CATIFS_DIR_PAGE_SIZE - 24)
+
+#define CATIFS_DIR_PAGE_END 1
+
+struct catifs_dir_page {
+    uint64_t cursor;    /* in: 0 or cursor of the previous page, out: cursor of the next page */
+    uint32_t count;     /* out: number of entries in data */
+    uint32_t size;      /* out: bytes of data used */
+    uint32_t flags;     /* out: CATIFS_DIR_PAGE_END once the last entry is in a page */
+    uint32_t reserved;
+    unsigned char data[CATIFS_DIR_PAGE_DATA];
+};
+
+#define CATIFS_IOC_DIR_PAGE _IOWR('C', 1, struct catifs_dir_page)
+
+#endif
@@ -0,0 +1,933 @@
+/*
+ * Tests of the operation handlers of cati_fs.c, called directly without
+ * FUSE and the kernel (as in cati_fs_bench.c). Each test works on new
+ * databases in a temporary directory. Run with "make check" or:
+ *
+ *      ./cati_fs_test [<test> ...]
+ *
+ * A failed check prints its line and the program exits with 1.
+ */
+
+/* Handlers get the mount from fuse_get_context(), there is no FUSE session here */
+#define fuse_get_context test_context
+#define main cati_fs_main
+#include "cati_fs.c"
+#undef main
+#undef fuse_get_context
+
+static struct fuse_context test_fuse_context;
+static char test_dir[] = "/tmp/cati_fs_test_XXXXXX";
+static int test_failures;
+
+struct fuse_context *test_context(void)
+{
+    return &test_fuse_context;
+}
+
+#define CHECK(cond) do { \
+        if( ! (cond) ) { \
+            fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, __func__, #cond); \
+            ++test_failures; \
+        } \
+    } while( 0 )
+
+/*
+ * A mount of count databases, shard i is mounted below prefixes[i] ("" to
+ * merge it at the root). Databases are created unless they exist.
+ */
+struct test_mount {
+    struct catifs_mount mount;
+    struct catifs_shard shards[4];
+    char files[4][PATH_MAX];
+};
+
+static void test_mount_open(struct test_mount *t, const char *name, int count,
+                            const char **prefixes, int compact)
+{
+    int i;
+
+    memset(t, 0, sizeof(*t));
+    for( i=0; i<count; i++ ) {
+        snprintf(t->files[i], PATH_MAX, "%s/%s%s%d.sqlite", test_dir, name,
+                 compact ? "_compact" : "", i);
+        open_database(&t->shards[i].fs, t->files[i], 1);
+        if( compact ) compact_database(&t->shards[i].fs);
+        t->shards[i].prefix = prefixes ? (char *) prefixes[i] : "";
+        t->shards[i].prefix_len = strlen(t->shards[i].prefix);
+        t->shards[i].control = -1;
+    }
+    t->mount.count = count;
+    t->mount.shards = t->shards;
+    test_fuse_context.private_data = &t->mount;
+    test_fuse_context.uid = getuid();
+    test_fuse_context.gid = getgid();
+}
+
+static void test_mount_close(struct test_mount *t)
+{
+    int i;
+
+    for( i=0; i<t->mount.count; i++ ) {
+        bloom_free(&t->shards[i].fs.bloom);
+        sqlite3_close(t->shards[i].fs.db);
+    }
+}
+
+/* A backing file with some content */
+static const char *test_file(void)
+{
+    static char path[PATH_MAX];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/backing", test_dir);
+    f = fopen(path, "w");
+    if( f ) {
+        fputs("cati_fs", f);
+        fclose(f);
+    }
+    return path;
+}
+
+static int test_filler(void *buf, const char *name, const struct stat *stbuf,
+                       off_t off, enum fuse_fill_dir_flags flags)
+{
+    char ***names = buf;
+    size_t n = 0;
+
+    if( strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ) return 0;
+    while( (*names)[n] ) ++n;
+    *names = realloc(*names, (n + 2) * sizeof(char *));
+    (*names)[n] = strdup(name);
+    (*names)[n + 1] = NULL;
+    return 0;
+}
+
+static void test_free_names(char **names)
+{
+    size_t i;
+
+    for( i=0; names && names[i]; i++ )
+        free(names[i]);
+    free(names);
+}
+
+/* Names listed by readdir on an open handle, "." and ".." excluded */
+static char **test_readdir(const char *path)
+{
+    struct fuse_file_info fi;
+    char **names = calloc(1, sizeof(char *));
+
+    memset(&fi, 0, sizeof(fi));
+    if( catifs_opendir(path, &fi) != 0 ) return names;
+    catifs_readdir(path, &names, test_filler, 0, &fi, 0);
+    catifs_releasedir(path, &fi);
+    return names;
+}
+
+static size_t test_count(char **names)
+{
+    size_t n = 0;
+
+    while( names && names[n] ) ++n;
+    return n;
+}
+
+/*
+ * Decoded entry of a directory page (see cati_fs_ioctl.h).
+ */
+struct test_page_entry {
+    char name[256];
+    int64_t ino, mode, size;
+    int attrs;
+    char attr_name[64], attr_value[64];   /* first attribute */
+};
+
+/* Return the number of entries decoded or -1 if the page is invalid */
+static int test_page_decode(const struct catifs_dir_page *page,
+                            struct test_page_entry *entries, int max)
+{
+    const unsigned char *p = page->data, *end = page->data + page->size;
+    int64_t value, length;
+    int n, i;
+
+    for( n=0; n<(int) page->count && n<max; n++ ) {
+        struct test_page_entry *e = &entries[n];
+        memset(e, 0, sizeof(*e));
+        if( ! (p = varint_get(p, end, &length)) || length >= (int) sizeof(e->name) ) return -1;
+        memcpy(e->name, p, length);
+        p += length;
+        if( ! (p = varint_get(p, end, &e->ino)) || ! (p = varint_get(p, end, &e->mode)) ||
+            ! (p = varint_get(p, end, &e->size)) )
+            return -1;
+        if( p >= end || *p++ != STAT_RECORD_FORMAT ) return -1;
+        for( i=0; i<STAT_RECORD_FIELDS; i++ )
+            if( ! (p = varint_get(p, end, &value)) ) return -1;
+        for( ;; ) {
+            if( ! (p = varint_get(p, end, &length)) ) return -1;
+            if( length == 0 ) break;
+            if( e->attrs == 0 && length - 1 < (int) sizeof(e->attr_name) )
+                memcpy(e->attr_name, p, length - 1);
+            p += length - 1;
+            if( ! (p = varint_get(p, end, &length)) ) return -1;
+            if( e->attrs == 0 && length < (int) sizeof(e->attr_value) )
+                memcpy(e->attr_value, p, length);
+            p += length;
+            ++e->attrs;
+        }
+    }
+    return p == end ? n : -1;
+}
+
+/*
+ * Read a whole directory with CATIFS_IOC_DIR_PAGE, return the number of
+ * pages or -errno. entries receives at most max entries.
+ */
+static int test_dir_pages(const char *path, struct test_page_entry *entries, int max,
+                          int *count)
+{
+    struct fuse_file_info fi;
+    struct catifs_dir_page *page = calloc(1, sizeof(*page));
+    int pages = 0, n, result = 0;
+
+    *count = 0;
+    memset(&fi, 0, sizeof(fi));
+    if( ! page || catifs_opendir(path, &fi) != 0 ) {
+        free(page);
+        return -EIO;
+    }
+    do {
+        result = catifs_ioctl(path, CATIFS_IOC_DIR_PAGE, NULL, &fi, FUSE_IOCTL_DIR, page);
+        if( result != 0 ) break;
+        n = test_page_decode(page, entries + *count, max - *count);
+        if( n < 0 ) {
+            result = -EINVAL;
+            break;
+        }
+        *count += n;
+        ++pages;
+    } while( ! (page->flags & CATIFS_DIR_PAGE_END) && *count < max );
+    catifs_releasedir(path, &fi);
+    free(page);
+    return result == 0 ? pages : result;
+}
+
+static int test_add(struct catifs *fs, const char *path)
+{
+    return add_path_to_database(fs, test_file(), path);
+}
+
+/*
+ * CATIFS_IOC_DIR_PAGE: paging across cursors, attributes, E2BIG and
+ * merged directories.
+ */
+static void test_dir_page(int compact)
+{
+    struct test_mount t;
+    struct test_page_entry *entries = calloc(4000, sizeof(*entries));
+    struct fuse_file_info fi;
+    struct catifs_dir_page *page = calloc(1, sizeof(*page));
+    char path[64], value[32], *big;
+    char **names;
+    int i, count, pages, sorted = 1;
+
+    test_mount_open(&t, "page", 1, NULL, compact);
+    CHECK(catifs_mkdir("/d", 0755) == 0);
+    db_begin(t.shards[0].fs.db);
+    for( i=0; i<3001; i++ ) {
+        snprintf(path, sizeof(path), "/d/e%04d", i);
+        CHECK(test_add(&t.shards[0].fs, path) == 0);
+        if( i % 7 == 0 ) {
+            snprintf(value, sizeof(value), "%d", i);
+            CHECK(catifs_setxattr(path, "user.n", value, strlen(value), 0) == 0);
+        }
+    }
+    db_end(t.shards[0].fs.db, 0);
+    pages = test_dir_pages("/d", entries, 4000, &count);
+    CHECK(pages > 1);
+    CHECK(count == 3001);
+    for( i=1; i<count; i++ )
+        if( strcmp(entries[i - 1].name, entries[i].name) >= 0 ) sorted = 0;
+    CHECK(sorted);
+    CHECK(strcmp(entries[0].name, "e0000") == 0 && strcmp(entries[3000].name, "e3000") == 0);
+    CHECK(entries[7].attrs == 1 && strcmp(entries[7].attr_name, "n") == 0 &&
+          strcmp(entries[7].attr_value, "7") == 0);
+    CHECK(entries[8].attrs == 0);
+    CHECK(S_ISREG(entries[0].mode) && entries[0].size == 7);
+    names = test_readdir("/d");
+    CHECK(test_count(names) == 3001);
+    test_free_names(names);
+
+    /* An entry larger than a page */
+    big = malloc(CATIFS_DIR_PAGE_SIZE);
+    memset(big, 'x', CATIFS_DIR_PAGE_SIZE);
+    CHECK(catifs_mkdir("/big", 0755) == 0);
+    CHECK(test_add(&t.shards[0].fs, "/big/f") == 0);
+    CHECK(catifs_setxattr("/big/f", "user.big", big, CATIFS_DIR_PAGE_SIZE, 0) == 0);
+    memset(&fi, 0, sizeof(fi));
+    CHECK(catifs_opendir("/big", &fi) == 0);
+    CHECK(catifs_ioctl("/big", CATIFS_IOC_DIR_PAGE, NULL, &fi, FUSE_IOCTL_DIR, page) == -E2BIG);
+    CHECK(catifs_ioctl("/big", CATIFS_IOC_DIR_PAGE, NULL, &fi, 0, page) == -ENOTTY);
+    catifs_releasedir("/big", &fi);
+    free(big);
+    test_mount_close(&t);
+
+    /* Directories merged from two shards, the first one wins */
+    test_mount_open(&t, "page_merged", 2, NULL, compact);
+    CHECK(test_add(&t.shards[0].fs, "/a") == 0);
+    CHECK(test_add(&t.shards[0].fs, "/c") == 0);
+    CHECK(test_add(&t.shards[1].fs, "/b") == 0);
+    CHECK(test_add(&t.shards[1].fs, "/c") == 0);
+    CHECK(attr_set(t.shards[0].fs.db, "/c", "shard", "0", 1, 0) == 0);
+    CHECK(attr_set(t.shards[1].fs.db, "/b", "shard", "1", 1, 0) == 0);
+    pages = test_dir_pages("/", entries, 4000, &count);
+    CHECK(pages == 1 && count == 3);
+    CHECK(strcmp(entries[1].name, "b") == 0 && strcmp(entries[1].attr_value, "1") == 0);
+    CHECK(strcmp(entries[2].name, "c") == 0 && strcmp(entries[2].attr_value, "0") == 0);
+    test_mount_close(&t);
+    free(page);
+    free(entries);
+}
+
+/* Filler keeping at most limit names, as a full kernel buffer */
+struct test_limited {
+    char **names;
+    int limit;
+    off_t offset;       /* offset of the last name kept */
+};
+
+static int test_limited_filler(void *buf, const char *name, const struct stat *stbuf,
+                               off_t off, enum fuse_fill_dir_flags flags)
+{
+    struct test_limited *l = buf;
+
+    if( l->limit == 0 ) return 1;
+    --l->limit;
+    l->offset = off;
+    return test_filler(&l->names, name, stbuf, off, flags);
+}
+
+/*
+ * Listings resume after entries removed between two batches, even
+ * when the offset of the handle is not the last one given.
+ */
+static void test_dir_resume(void)
+{
+    struct test_mount t;
+    struct test_page_entry *entries = calloc(3000, sizeof(*entries));
+    struct catifs_dir_page *page = calloc(1, sizeof(*page));
+    struct test_limited l;
+    struct fuse_file_info fi;
+    char path[300], **names;
+    int i, n, count;
+
+    test_mount_open(&t, "resume", 1, NULL, 0);
+    CHECK(catifs_mkdir("/a", 0755) == 0);
+    CHECK(catifs_mkdir("/b", 0755) == 0);
+    db_begin(t.shards[0].fs.db);
+    for( i=0; i<2000; i++ ) {
+        snprintf(path, sizeof(path), "/a/e%04d", i);
+        CHECK(test_add(&t.shards[0].fs, path) == 0);
+    }
+    db_end(t.shards[0].fs.db, 0);
+    CHECK(test_add(&t.shards[0].fs, "/b/f") == 0);
+
+    /* readdir: the last entry of a batch is removed */
+    memset(&fi, 0, sizeof(fi));
+    memset(&l, 0, sizeof(l));
+    l.names = calloc(1, sizeof(char *));
+    l.limit = 12;
+    CHECK(catifs_opendir("/a", &fi) == 0);
+    CHECK(catifs_readdir("/a", &l, test_limited_filler, 0, &fi, 0) == 0);
+    CHECK(test_count(l.names) == 10 && strcmp(l.names[9], "e0009") == 0);
+    CHECK(catifs_unlink("/a/e0009") == 0);
+    CHECK(catifs_unlink("/a/e0010") == 0);
+    l.limit = 5;
+    CHECK(catifs_readdir("/a", &l, test_limited_filler, l.offset, &fi, 0) == 0);
+    CHECK(test_count(l.names) == 15 && strcmp(l.names[10], "e0011") == 0);
+    /* The rowid of the removed e0010 (offset 15) is reused in another directory */
+    CHECK(test_add(&t.shards[0].fs, "/b/g") == 0);
+    CHECK(db_run(t.shards[0].fs.db, "UPDATE catifs SET rowid=13 WHERE path=?1",
+                 "/b/g", NULL) == 0);
+    l.limit = 5;
+    CHECK(catifs_readdir("/a", &l, test_limited_filler, 15, &fi, 0) == 0);
+    CHECK(test_count(l.names) == 20 && strcmp(l.names[15], "e0016") == 0);
+    catifs_releasedir("/a", &fi);
+    test_free_names(l.names);
+
+    /* ioctl: the last entry of a page is removed */
+    memset(&fi, 0, sizeof(fi));
+    CHECK(catifs_opendir("/a", &fi) == 0);
+    CHECK(catifs_ioctl("/a", CATIFS_IOC_DIR_PAGE, NULL, &fi, FUSE_IOCTL_DIR, page) == 0);
+    n = test_page_decode(page, entries, 3000);
+    CHECK(n > 0 && ! (page->flags & CATIFS_DIR_PAGE_END));
+    snprintf(path, sizeof(path), "/a/%s", entries[n - 1].name);
+    CHECK(catifs_unlink(path) == 0);
+    count = n;
+    while( n > 0 && ! (page->flags & CATIFS_DIR_PAGE_END) ) {
+        CHECK(catifs_ioctl("/a", CATIFS_IOC_DIR_PAGE, NULL, &fi, FUSE_IOCTL_DIR, page) == 0);
+        n = test_page_decode(page, entries + count, 3000 - count);
+        count += n;
+    }
+    catifs_releasedir("/a", &fi);
+    CHECK(count == 1998);
+    CHECK(strcmp(entries[count - 1].name, "e1999") == 0);
+    names = test_readdir("/b");
+    CHECK(test_count(names) == 2);
+    test_free_names(names);
+    test_mount_close(&t);
+    free(page);
+    free(entries);
+}
+
+/*
+ * mkdir, symlink, readlink, make_dirs, link, unlink and rmdir.
+ */
+static void test_namespace(int compact)
+{
+    struct test_mount t;
+    struct stat st;
+    struct statvfs vfs;
+    char buf[64];
+    char link[PATH_MAX];
+
+    test_mount_open(&t, "namespace", 1, NULL, compact);
+    CHECK(catifs_mkdir("/d", 0750) == 0);
+    CHECK(catifs_mkdir("/d", 0750) == -EEXIST);
+    CHECK(cati_getattr("/d", &st, NULL) == 0 && st.st_mode == (S_IFDIR | 0750));
+    CHECK(st.st_uid == getuid() && st.st_mtime > 0);
+    CHECK(test_add(&t.shards[0].fs, "/d/f") == 0);
+
+    CHECK(catifs_symlink("/abs/target", "/d/l") == 0);
+    CHECK(catifs_symlink("x", "/d/f") == -EEXIST);
+    CHECK(cati_getattr("/d/l", &st, NULL) == 0 && S_ISLNK(st.st_mode) && st.st_size == 11);
+    CHECK(catifs_readlink("/d/l", buf, sizeof(buf)) == 0 && strcmp(buf, "/abs/target") == 0);
+    CHECK(catifs_readlink("/d/l", buf, 4) == 0 && strcmp(buf, "/ab") == 0);
+    CHECK(catifs_readlink("/d/f", buf, sizeof(buf)) == -EINVAL);
+    CHECK(catifs_readlink("/d/missing", buf, sizeof(buf)) == -ENOENT);
+
+    /* Symbolic link imported from the backing storage (add_dir_to_db.py) */
+    snprintf(link, sizeof(link), "%s/backing_link", test_dir);
+    unlink(link);
+    CHECK(symlink("/backing/target", link) == 0);
+    CHECK(test_add(&t.shards[0].fs, "/d/imported") == 0);
+    CHECK(db_run(t.shards[0].fs.db, "UPDATE catifs SET real_path=?2, st_mode=41471 WHERE path=?1",
+                 "/d/imported", link) == 0);
+    CHECK(catifs_readlink("/d/imported", buf, sizeof(buf)) == 0 &&
+          strcmp(buf, "/backing/target") == 0);
+
+    CHECK(make_dirs(&t.shards[0].fs, "/a/b/c/", 0755, 1, 2) == 0);
+    CHECK(cati_getattr("/a/b", &st, NULL) == 0 && S_ISDIR(st.st_mode) && st.st_uid == 1);
+    CHECK(make_dirs(&t.shards[0].fs, "/a/b", 0755, 1, 2) == 0);
+    CHECK(make_dirs(&t.shards[0].fs, "/d/f/x", 0755, 1, 2) == -ENOTDIR);
+    CHECK(make_dirs(&t.shards[0].fs, "a/b", 0755, 1, 2) == -EINVAL);
+    CHECK(make_dirs(&t.shards[0].fs, "/a//b", 0755, 1, 2) == -EINVAL);
+    /* Free space of the backing storage, the mount is not full */
+    CHECK(catifs_statfs("/", &vfs) == 0 && vfs.f_bavail > 0 && vfs.f_ffree > 0);
+    CHECK(vfs.f_blocks >= vfs.f_bfree && vfs.f_files > 7);
+    CHECK(catifs_statfs("/d/f", &vfs) == 0 && vfs.f_bavail > 0);
+    /* Aggregates of the entry itself, not of the whole shard */
+    CHECK(catifs_statfs("/d/f", &vfs) == 0 && vfs.f_files - vfs.f_ffree == 1);
+    CHECK(vfs.f_blocks - vfs.f_bfree == 1);
+    CHECK(catifs_mkdir("/e", 0755) == 0);
+    CHECK(catifs_statfs("/e", &vfs) == 0 && vfs.f_files == vfs.f_ffree);
+    CHECK(vfs.f_blocks == vfs.f_bfree);
+    CHECK(catifs_statfs("/missing", &vfs) == 0 && vfs.f_files - vfs.f_ffree > 7);
+    CHECK(catifs_rename("/d/l", "/a/l", 0) == 0);
+    CHECK(catifs_readlink("/a/l", buf, sizeof(buf)) == 0 && strcmp(buf, "/abs/target") == 0);
+    CHECK(catifs_link("/d/f", "/d/h") == -EPERM);
+    CHECK(cati_getattr("/d/h", &st, NULL) == -ENOENT);
+    /* unlink removes files and links, rmdir directories */
+    CHECK(catifs_unlink("/a/b") == -EISDIR);
+    CHECK(catifs_rmdir("/a/l") == -ENOTDIR);
+    CHECK(catifs_unlink("/a/l") == 0 && cati_getattr("/a/l", &st, NULL) == -ENOENT);
+    CHECK(catifs_rmdir("/a/b") == -ENOTEMPTY);
+    CHECK(catifs_rmdir("/a/b/c") == 0 && catifs_rmdir("/a/b") == 0);
+    CHECK(catifs_unlink("/a/missing") == -ENOENT && catifs_rmdir("/a/missing") == -ENOENT);
+    /* Children are found without the aggregates of their directory */
+    CHECK(catifs_mkdir("/x", 0755) == 0 && test_add(&t.shards[0].fs, "/x/f") == 0);
+    CHECK(db_run(t.shards[0].fs.db, "DELETE FROM catifs_tree WHERE path=?1", "/x", NULL) == 0);
+    CHECK(catifs_rmdir("/x") == -ENOTEMPTY);
+    CHECK(cati_getattr("/x/f", &st, NULL) == 0);
+    test_mount_close(&t);
+}
+
+/*
+ * A snapshot keeps showing rows updated or removed after it was taken.
+ */
+static void test_snapshot(void)
+{
+    struct test_mount t;
+    struct catifs snap;
+    struct stat st;
+    sqlite3_int64 size, files, dirs;
+    char value[16];
+    int n;
+
+    test_mount_open(&t, "snapshot", 1, NULL, 0);
+    CHECK(catifs_mkdir("/d", 0755) == 0);
+    CHECK(test_add(&t.shards[0].fs, "/d/f") == 0);
+    CHECK(test_add(&t.shards[0].fs, "/d/g") == 0);
+    CHECK(catifs_chmod("/d/f", 0644, NULL) == 0);
+    CHECK(catifs_setxattr("/d/f", "user.k", "old", 3, 0) == 0);
+    CHECK(snapshot_create(t.shards[0].fs.db, "s1") == 0);
+    CHECK(snapshot_create(t.shards[0].fs.db, "s1") == -EEXIST);
+    CHECK(catifs_chmod("/d/f", 0600, NULL) == 0);
+    CHECK(catifs_setxattr("/d/f", "user.k", "new", 3, 0) == 0);
+    CHECK(catifs_unlink("/d/g") == 0);
+    CHECK(test_add(&t.shards[0].fs, "/d/h") == 0);
+    CHECK(test_add(&t.shards[0].fs, "/d/i") == 0);
+
+    memset(&snap, 0, sizeof(snap));
+    open_database(&snap, t.files[0], 0);
+    CHECK(snapshot_open(&snap, "s1") == 0);
+    CHECK(load_stat(&snap, "/d/f", &st) == 0 && (st.st_mode & 07777) == 0644);
+    CHECK(load_stat(&snap, "/d/g", &st) == 0);
+    CHECK(load_stat(&snap, "/d/h", &st) == -ENOENT);
+    CHECK(tree_get(snap.db, "/d", &size, &files, &dirs) == 0 && files == 2 && size == 14);
+    test_fuse_context.private_data = NULL;
+    {
+        struct catifs_mount mount;
+        struct catifs_shard shard;
+        memset(&mount, 0, sizeof(mount));
+        memset(&shard, 0, sizeof(shard));
+        shard.fs = snap;
+        shard.prefix = "";
+        mount.count = 1;
+        mount.shards = &shard;
+        test_fuse_context.private_data = &mount;
+        n = catifs_getxattr("/d/f", "user.k", value, sizeof(value));
+        CHECK(n == 3 && memcmp(value, "old", 3) == 0);
+        CHECK(catifs_chmod("/d/f", 0777, NULL) != 0);
+        test_fuse_context.private_data = &t.mount;
+    }
+    sqlite3_close(snap.db);
+    /* The aggregates of the first mount are kept for the next ones */
+    CHECK(tree_get(t.shards[0].fs.db, "/d", &size, &files, &dirs) == 0 && files == 3);
+    CHECK(db_run(t.shards[0].fs.db, "UPDATE catifs_snapshots_tree SET files=5 "
+                 "WHERE path=?1", "/d", NULL) == 0 && sqlite3_changes(t.shards[0].fs.db) == 1);
+    memset(&snap, 0, sizeof(snap));
+    open_database(&snap, t.files[0], 0);
+    CHECK(snapshot_open(&snap, "s1") == 0);
+    CHECK(tree_get(snap.db, "/d", &size, &files, &dirs) == 0 && files == 5);
+    bloom_free(&snap.bloom);
+    sqlite3_close(snap.db);
+
+    CHECK(load_stat(&t.shards[0].fs, "/d/f", &st) == 0 && (st.st_mode & 07777) == 0600);
+    CHECK(load_stat(&t.shards[0].fs, "/d/g", &st) == -ENOENT);
+    n = catifs_getxattr("/d/f", "user.k", value, sizeof(value));
+    CHECK(n == 3 && memcmp(value, "new", 3) == 0);
+    test_mount_close(&t);
+}
+
+/*
+ * Databases created with "st_ino INT PRIMARY KEY" are converted so that
+ * attributes (keyed by st_ino) stay on their entry after a VACUUM, with
+ * their snapshots.
+ */
+static void test_st_ino(void)
+{
+    static const char legacy[] =
+        "CREATE TABLE catifs(path TEXT NOT NULL, real_path TEXT, st_dev INT, "
+        "st_ino INT PRIMARY KEY, st_mode INT, st_nlink INT, st_uid INT, st_gid INT, "
+        "st_rdev INT, st_size INT, st_blksize INT, st_blocks INT, st_atim_sec INT, "
+        "st_atim_nsec INT, st_mtim_sec INT, st_mtim_nsec INT, st_ctim_sec INT, "
+        "st_ctim_nsec INT, is_dir BOOL, is_link BOOL);\n"
+        "CREATE UNIQUE INDEX idx_catifs_path ON catifs (path);\n"
+        "CREATE TABLE catifs_attrs(st_ino INT NOT NULL REFERENCES catifs (st_ino), "
+        "name TEXT NOT NULL, value TEXT NOT NULL, PRIMARY KEY (st_ino, name));\n"
+        "INSERT INTO catifs (path, st_mode, st_size) VALUES "
+        "('/a', 33188, 1), ('/b', 33188, 2), ('/c', 33188, 3);\n"
+        "INSERT INTO catifs_attrs VALUES (2, 'k', 'b'), (3, 'k', 'c');\n"
+        "DELETE FROM catifs WHERE path = '/a';";
+    struct test_mount t;
+    struct catifs snap;
+    struct stat st;
+    char file[PATH_MAX], value[16];
+    sqlite3 *db;
+
+    snprintf(file, sizeof(file), "%s/st_ino0.sqlite", test_dir);
+    unlink(file);
+    CHECK(sqlite3_open(file, &db) == SQLITE_OK);
+    CHECK(sqlite3_exec(db, legacy, 0, 0, 0) == SQLITE_OK);
+    CHECK(snapshot_create(db, "s") == 0);
+    sqlite3_close(db);
+
+    test_mount_open(&t, "st_ino", 1, NULL, 0);
+    CHECK(sqlite3_exec(t.shards[0].fs.db, "VACUUM", 0, 0, 0) == SQLITE_OK);
+    CHECK(cati_getattr("/c", &st, NULL) == 0 && st.st_ino == 3 && st.st_size == 3);
+    CHECK(catifs_getxattr("/b", "user.k", value, sizeof(value)) == 1 && value[0] == 'b');
+    CHECK(catifs_getxattr("/c", "user.k", value, sizeof(value)) == 1 && value[0] == 'c');
+    CHECK(test_add(&t.shards[0].fs, "/d") == 0);
+    CHECK(cati_getattr("/d", &st, NULL) == 0 && st.st_ino == 4);
+    CHECK(db_run(t.shards[0].fs.db, "UPDATE catifs SET is_dir=1 WHERE path=?1", "/d", NULL) == 0);
+
+    /* Triggers of the snapshots were kept */
+    CHECK(catifs_chmod("/c", 0600, NULL) == 0);
+    CHECK(catifs_setxattr("/c", "user.k", "C", 1, 0) == 0);
+    memset(&snap, 0, sizeof(snap));
+    open_database(&snap, t.files[0], 0);
+    CHECK(snapshot_open(&snap, "s") == 0);
+    CHECK(load_stat(&snap, "/c", &st) == 0 && (st.st_mode & 07777) == 0644);
+    CHECK(load_stat(&snap, "/d", &st) == -ENOENT);
+    sqlite3_close(snap.db);
+    test_mount_close(&t);
+}
+
+/* Content of a file in a new string */
+static char *test_read_file(const char *path, long *size)
+{
+    FILE *f = fopen(path, "rb");
+    char *data;
+
+    *size = 0;
+    if( ! f ) return NULL;
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    rewind(f);
+    data = malloc(*size + 1);
+    if( data && fread(data, 1, *size, f) != (size_t) *size ) *size = -1;
+    fclose(f);
+    return data;
+}
+
+static int test_dump(struct catifs *fs, const char *file)
+{
+    FILE *out = fopen(file, "wb");
+    int result;
+
+    if( ! out ) return -errno;
+    result = dump_database(fs, out);
+    fclose(out);
+    return result;
+}
+
+static int test_load(struct catifs *fs, const char *file)
+{
+    FILE *in = fopen(file, "rb");
+    int result;
+
+    if( ! in ) return -errno;
+    result = load_database(fs, in);
+    fclose(in);
+    return result;
+}
+
+/*
+ * dump then load gives the same catalogue, a second round trip gives
+ * the same dump.
+ */
+static void test_dump_load(int compact)
+{
+    struct test_mount t;
+    struct catifs loaded[2];
+    char dumps[3][PATH_MAX], file[PATH_MAX], buf[64];
+    char *data[2];
+    long size[2];
+    struct stat st;
+    int i;
+
+    test_mount_open(&t, "dump", 1, NULL, compact);
+    CHECK(catifs_mkdir("/d", 0755) == 0);
+    CHECK(test_add(&t.shards[0].fs, "/d/f") == 0);
+    CHECK(test_add(&t.shards[0].fs, "/d/e") == 0);
+    CHECK(catifs_symlink("f", "/d/l") == 0);
+    CHECK(catifs_setxattr("/d/f", "user.k", "v", 1, 0) == 0);
+    CHECK(catifs_setxattr("/d/e", "user.k", "w", 1, 0) == 0);
+    for( i=0; i<3; i++ ) snprintf(dumps[i], PATH_MAX, "%s/dump%d", test_dir, i);
+    CHECK(test_dump(&t.shards[0].fs, dumps[0]) == 0);
+    for( i=0; i<2; i++ ) {
+        snprintf(file, sizeof(file), "%s/loaded%d.sqlite", test_dir, i);
+        unlink(file);
+        memset(&loaded[i], 0, sizeof(loaded[i]));
+        open_database(&loaded[i], file, 1);
+        if( compact ) compact_database(&loaded[i]);
+        CHECK(test_load(&loaded[i], dumps[i]) == 0);
+        CHECK(test_dump(&loaded[i], dumps[i + 1]) == 0);
+    }
+    CHECK(test_load(&loaded[1], dumps[0]) == -EEXIST);
+    data[0] = test_read_file(dumps[1], &size[0]);
+    data[1] = test_read_file(dumps[2], &size[1]);
+    CHECK(size[0] > 0 && size[0] == size[1] && memcmp(data[0], data[1], size[0]) == 0);
+    free(data[0]);
+    free(data[1]);
+
+    t.shards[0].fs = loaded[1];
+    CHECK(load_stat(&loaded[1], "/d/f", &st) == 0 && st.st_size == 7);
+    CHECK(catifs_getxattr("/d/e", "user.k", buf, sizeof(buf)) == 1 && buf[0] == 'w');
+    CHECK(catifs_readlink("/d/l", buf, sizeof(buf)) == 0 && strcmp(buf, "f") == 0);
+    sqlite3_close(loaded[0].db);
+    test_mount_close(&t);
+}
+
+/*
+ * A batch sent to the control socket of a mount is applied and answered
+ * request by request.
+ */
+static void test_control(void)
+{
+    struct test_mount t;
+    char request[PATH_MAX * 2], reply[256], value[16];
+    char **paths;
+    struct stat st;
+    int i;
+
+    test_mount_open(&t, "control", 1, NULL, 0);
+    CHECK(control_start(&t.mount) == 0);
+    CHECK(t.shards[0].control != -1);
+    snprintf(request, sizeof(request),
+             "mkdir\t/c/d\n"
+             "add\t%s\t/c/d/f\n"
+             "set-attr\t/c/d/f\tk\tv\n"
+             "remove\t/missing\n"
+             "unknown\n",
+             test_file());
+    CHECK(control_send(t.files[0], request, reply, sizeof(reply)) == 0);
+    CHECK(strcmp(reply, "0\n0\n0\n-2\n-22\n") == 0);
+    CHECK(cati_getattr("/c/d/f", &st, NULL) == 0 && st.st_size == 7);
+    CHECK(catifs_getxattr("/c/d/f", "user.k", value, sizeof(value)) == 1 && value[0] == 'v');
+    CHECK(control_send(t.files[0], "remove\t/c/d/f\n", reply, sizeof(reply)) == 0);
+    CHECK(strcmp(reply, "0\n") == 0);
+    CHECK(cati_getattr("/c/d/f", &st, NULL) == -ENOENT);
+
+    /* mkdir subcommand: more paths than fit in one batch, one of them fails */
+    paths = calloc(6001, sizeof(*paths));
+    for( i=0; i<6000; i++ ) {
+        snprintf(request, sizeof(request), "/m/%04d_%0200d", i, 0);
+        paths[i] = strdup(request);
+    }
+    paths[6000] = "/c/d/f/x";
+    CHECK(6000 * strlen(paths[0]) > CONTROL_CLIENT_BATCH);
+    CHECK(add_path_to_database(&t.shards[0].fs, test_file(), "/c/d/f") == 0);
+    CHECK(control_mkdirs(t.files[0], paths, 6001) == 1);
+    CHECK(cati_getattr(paths[0], &st, NULL) == 0 && S_ISDIR(st.st_mode));
+    CHECK(cati_getattr(paths[5999], &st, NULL) == 0 && S_ISDIR(st.st_mode));
+    for( i=0; i<6000; i++ )
+        free(paths[i]);
+    free(paths);
+    control_stop(&t.mount);
+    CHECK(control_send(t.files[0], "remove\t/c\n", reply, sizeof(reply)) == -ENOENT);
+    paths = (char *[]) { "/n" };
+    CHECK(control_mkdirs(t.files[0], paths, 1) == -ENOENT);
+    test_mount_close(&t);
+}
+
+/*
+ * Several shards: lookups in the second root shard, and directories
+ * merged from the shard cursors and the shard prefixes across batches.
+ */
+static void test_shards(void)
+{
+    const char *prefixes[] = { "", "", "/p/q", "/p/r" };
+    struct test_mount t;
+    struct test_page_entry *entries = calloc(4000, sizeof(*entries));
+    struct test_limited l;
+    struct fuse_file_info fi;
+    struct stat st;
+    char path[64], buf[64];
+    char **names;
+    int i, count, pages, sorted = 1;
+
+    test_mount_open(&t, "shards", 4, prefixes, 0);
+    /* Even entries in shard 0, odd and every tenth one in shard 1 */
+    CHECK(make_dirs(&t.shards[0].fs, "/d", 0755, getuid(), getgid()) == 0);
+    CHECK(make_dirs(&t.shards[1].fs, "/d", 0755, getuid(), getgid()) == 0);
+    for( i=0; i<2; i++ ) db_begin(t.shards[i].fs.db);
+    for( i=0; i<3000; i++ ) {
+        snprintf(path, sizeof(path), "/d/e%04d", i);
+        if( i % 2 == 0 ) CHECK(test_add(&t.shards[0].fs, path) == 0);
+        if( i % 2 == 1 || i % 10 == 0 ) CHECK(test_add(&t.shards[1].fs, path) == 0);
+    }
+    for( i=0; i<2; i++ ) db_end(t.shards[i].fs.db, 0);
+    CHECK(attr_set(t.shards[0].fs.db, "/d/e0010", "shard", "0", 1, 0) == 0);
+    CHECK(attr_set(t.shards[1].fs.db, "/d/e0010", "shard", "1", 1, 0) == 0);
+    CHECK(attr_set(t.shards[1].fs.db, "/d/e0011", "shard", "1", 1, 0) == 0);
+    CHECK(test_add(&t.shards[1].fs, "/only1") == 0);
+    CHECK(test_add(&t.shards[2].fs, "/f") == 0);
+
+    /* Lookups falling through to the second shard */
+    CHECK(cati_getattr("/only1", &st, NULL) == 0 && S_ISREG(st.st_mode) && st.st_size == 7);
+    CHECK(cati_getattr("/missing", &st, NULL) == -ENOENT);
+    CHECK(cati_getattr("/p/q/f", &st, NULL) == 0 && S_ISREG(st.st_mode));
+    CHECK(catifs_symlink("target", "/d/link") == 0);
+    CHECK(catifs_readlink("/d/link", buf, sizeof(buf)) == 0 && strcmp(buf, "target") == 0);
+    CHECK(catifs_getxattr("/d/e0011", "user.shard", buf, sizeof(buf)) == 1 && buf[0] == '1');
+    CHECK(catifs_getxattr("/d/e0010", "user.shard", buf, sizeof(buf)) == 1 && buf[0] == '0');
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    CHECK(catifs_open("/only1", &fi) == 0);
+    CHECK(catifs_read("/only1", buf, sizeof(buf), 0, &fi) == 7 && memcmp(buf, "cati_fs", 7) == 0);
+    catifs_release("/only1", &fi);
+
+    /* Merged listing with ioctl pages, duplicates given once */
+    pages = test_dir_pages("/d", entries, 4000, &count);
+    CHECK(pages > 1 && count == 3001);
+    for( i=1; i<count; i++ )
+        if( strcmp(entries[i - 1].name, entries[i].name) >= 0 ) sorted = 0;
+    CHECK(sorted);
+    CHECK(strcmp(entries[10].name, "e0010") == 0 && strcmp(entries[10].attr_value, "0") == 0);
+    CHECK(strcmp(entries[11].name, "e0011") == 0 && strcmp(entries[11].attr_value, "1") == 0);
+    CHECK(strcmp(entries[3000].name, "link") == 0);
+
+    /* Merged listing with readdir batches, then from an earlier offset */
+    memset(&fi, 0, sizeof(fi));
+    memset(&l, 0, sizeof(l));
+    l.names = calloc(1, sizeof(char *));
+    CHECK(catifs_opendir("/d", &fi) == 0);
+    do {
+        count = test_count(l.names);
+        l.limit = 700;
+        CHECK(catifs_readdir("/d", &l, test_limited_filler, l.offset, &fi, 0) == 0);
+    } while( test_count(l.names) > count );
+    CHECK(test_count(l.names) == 3001 && strcmp(l.names[1500], "e1500") == 0);
+    l.limit = 1;
+    CHECK(catifs_readdir("/d", &l, test_limited_filler, 102, &fi, 0) == 0);
+    CHECK(test_count(l.names) == 3002 && strcmp(l.names[3001], "e0100") == 0);
+    catifs_releasedir("/d", &fi);
+    test_free_names(l.names);
+
+    /* Root: entries of both root shards and the prefix p once */
+    names = test_readdir("/");
+    CHECK(test_count(names) == 3);
+    CHECK(strcmp(names[0], "d") == 0 && strcmp(names[1], "only1") == 0 &&
+          strcmp(names[2], "p") == 0);
+    test_free_names(names);
+    names = test_readdir("/p");
+    CHECK(test_count(names) == 2 && strcmp(names[0], "q") == 0 && strcmp(names[1], "r") == 0);
+    test_free_names(names);
+    test_mount_close(&t);
+    free(entries);
+}
+
+/* Write content in a new backing file named name, return its path */
+static const char *test_backing(const char *name, const char *content, mode_t mode)
+{
+    static char path[PATH_MAX];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", test_dir, name);
+    f = fopen(path, "w");
+    if( f ) {
+        fputs(content, f);
+        fclose(f);
+    }
+    chmod(path, mode);
+    return path;
+}
+
+/* Content read through the mount */
+static int test_read(const char *path, char *buf, size_t size)
+{
+    struct fuse_file_info fi;
+    int n;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    if( catifs_open(path, &fi) != 0 ) return -1;
+    n = catifs_read(path, buf, size - 1, 0, &fi);
+    catifs_release(path, &fi);
+    buf[n > 0 ? n : 0] = 0;
+    return n;
+}
+
+/*
+ * Writing through any row of a group of duplicates, the first one
+ * included, leaves the content of the other rows unchanged. Adds leave
+ * the hash to "cati_fs hash".
+ */
+static void test_dedup(void)
+{
+    struct test_mount t;
+    struct fuse_file_info fi;
+    sqlite3_stmt *query;
+    struct stat st;
+    char buf[64], origin[PATH_MAX];
+
+    test_mount_open(&t, "dedup", 1, NULL, 0);
+    CHECK(add_path_to_database(&t.shards[0].fs, test_backing("dup_a", "same", 0600), "/a") == 0);
+    CHECK(add_path_to_database(&t.shards[0].fs, test_backing("dup_b", "same", 0644), "/b") == 0);
+    CHECK(add_path_to_database(&t.shards[0].fs, test_backing("dup_c", "same", 0640), "/c") == 0);
+    CHECK(hash_database(&t.shards[0].fs, 2) == 0);
+    /* An add does not read the file, the next hash run does */
+    CHECK(add_path_to_database(&t.shards[0].fs, test_backing("dup_d", "late", 0644), "/d") == 0);
+    CHECK(sqlite3_prepare_v2(t.shards[0].fs.db, "SELECT count(*) FROM catifs "
+                             "WHERE content_hash IS NULL AND st_size > 0", -1, &query, 0) == SQLITE_OK);
+    CHECK(sqlite3_step(query) == SQLITE_ROW && sqlite3_column_int(query, 0) == 1);
+    sqlite3_reset(query);
+    CHECK(hash_database(&t.shards[0].fs, 2) == 0);
+    CHECK(sqlite3_step(query) == SQLITE_ROW && sqlite3_column_int(query, 0) == 0);
+    sqlite3_finalize(query);
+    CHECK(dedup_database(&t.shards[0].fs, 1) == 0);
+    snprintf(origin, sizeof(origin), "%s/dup_b", test_dir);
+    CHECK(access(origin, F_OK) == -1);
+
+    /* /a is the first row, /b and /c share its file */
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    CHECK(catifs_open("/a", &fi) == 0);
+    CHECK(catifs_write("/a", "other", 5, 0, &fi) == 5);
+    catifs_release("/a", &fi);
+    CHECK(test_read("/a", buf, sizeof(buf)) == 5 && strcmp(buf, "other") == 0);
+    CHECK(test_read("/b", buf, sizeof(buf)) == 4 && strcmp(buf, "same") == 0);
+    CHECK(test_read("/c", buf, sizeof(buf)) == 4 && strcmp(buf, "same") == 0);
+    /* The copy went back to the origin of /b, which shares it with /c */
+    CHECK(stat(origin, &st) == 0 && st.st_size == 4);
+
+    /* Truncating /c gives it a new file with the mode of the shared one */
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY | O_TRUNC;
+    CHECK(catifs_open("/c", &fi) == 0);
+    catifs_release("/c", &fi);
+    CHECK(test_read("/c", buf, sizeof(buf)) == 0);
+    CHECK(test_read("/b", buf, sizeof(buf)) == 4 && strcmp(buf, "same") == 0);
+    snprintf(origin, sizeof(origin), "%s/dup_c", test_dir);
+    CHECK(stat(origin, &st) == 0 && st.st_size == 0 && (st.st_mode & 07777) == 0600);
+    test_mount_close(&t);
+}
+
+static void test_dir_page_default(void) { test_dir_page(0); }
+static void test_dir_page_compact(void) { test_dir_page(1); }
+static void test_namespace_default(void) { test_namespace(0); }
+static void test_namespace_compact(void) { test_namespace(1); }
+static void test_dump_load_default(void) { test_dump_load(0); }
+static void test_dump_load_compact(void) { test_dump_load(1); }
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    { "dir_page", test_dir_page_default },
+    { "dir_page_compact", test_dir_page_compact },
+    { "dir_resume", test_dir_resume },
+    { "shards", test_shards },
+    { "namespace", test_namespace_default },
+    { "namespace_compact", test_namespace_compact },
+    { "snapshot", test_snapshot },
+    { "st_ino", test_st_ino },
+    { "dump_load", test_dump_load_default },
+    { "dump_load_compact", test_dump_load_compact },
+    { "control", test_control },
+    { "dedup", test_dedup },
+};
+
+int main(int argc, char *argv[])
+{
+    size_t i;
+    int j, run, failures;
+
+    if( ! mkdtemp(test_dir) ) return 1;
+    /* Databases report their messages (filters, conversions) on stderr */
+    for( i=0; i<sizeof(tests)/sizeof(*tests); i++ ) {
+        for( j=1, run=argc==1; j<argc && ! run; j++ )
+            run = strcmp(argv[j], tests[i].name) == 0;
+        if( ! run ) continue;
+        failures = test_failures;
+        tests[i].run();
+        printf("%-20s %s\n", tests[i].name, failures == test_failures ? "ok" : "FAILED");
+    }
+    {
+        char command[PATH_MAX];
+        snprintf(command, sizeof(command), "rm -rf '%s'", test_dir);
+        if( system(command) != 0 ) fprintf(stderr, "Cannot remove %s\n", test_dir);
+    }
+    return test_failures ? 1 : 0;
+}
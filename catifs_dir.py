@@ -0,0 +1,134 @@
+"""
+Client of the directory ioctl of cati_fs (see cati_fs_ioctl.h): list a
+directory of a cati_fs mount with the stat fields and the attributes of
+every entry in a few requests.
+
+    import catifs_dir
+    for entry in catifs_dir.scandir('/mnt/catalogue/study'):
+        print(entry.name, entry.stat.st_size, entry.attrs)
+
+or from the command line (-r lists sub-directories too):
+
+    python3 catifs_dir.py [-r] <directory>
+"""
+from __future__ import print_function
+
+from collections import namedtuple
+import fcntl
+import os
+import stat
+import struct
+import sys
+
+DIR_PAGE_SIZE = 16376
+DIR_PAGE_END = 1
+# _IOWR('C', 1, struct catifs_dir_page) with the layout of x86 and ARM
+IOC_DIR_PAGE = (3 << 30) | (DIR_PAGE_SIZE << 16) | (ord('C') << 8) | 1
+HEADER = struct.Struct('=QIIII')
+
+Stat = namedtuple('Stat', [
+    'st_ino', 'st_mode', 'st_size', 'st_dev', 'st_nlink', 'st_uid', 'st_gid',
+    'st_rdev', 'st_blksize', 'st_blocks', 'st_atime_ns', 'st_mtime_ns', 'st_ctime_ns',
+])
+DirEntry = namedtuple('DirEntry', ['name', 'stat', 'attrs'])
+
+
+def varint(data, pos):
+    """Decode the zigzag LEB128 varint at pos, return it and the next position."""
+    value = 0
+    shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            return (value >> 1) ^ -(value & 1), pos
+        shift += 7
+
+
+def text(data, pos, size):
+    return bytes(data[pos:pos + size]), pos + size
+
+
+def decode_page(page):
+    """Return the cursor, the flags and the entries of a page."""
+    cursor, count, size, flags, _ = HEADER.unpack_from(page)
+    data = memoryview(page)[HEADER.size:HEADER.size + size]
+    entries = []
+    pos = 0
+    for _ in range(count):
+        length, pos = varint(data, pos)
+        name, pos = text(data, pos, length)
+        fields = []
+        for _ in range(3):
+            value, pos = varint(data, pos)
+            fields.append(value)
+        if data[pos] != 1:
+            raise ValueError('unknown stat record format %d' % data[pos])
+        pos += 1
+        record = []
+        for _ in range(13):
+            value, pos = varint(data, pos)
+            record.append(value)
+        fields.extend(record[:7])
+        for i in (7, 9, 11):
+            fields.append(record[i] * 1000000000 + record[i + 1])
+        attrs = {}
+        while True:
+            length, pos = varint(data, pos)
+            if length == 0:
+                break
+            key, pos = text(data, pos, length - 1)
+            length, pos = varint(data, pos)
+            attrs[key.decode('utf-8', 'surrogateescape')], pos = text(data, pos, length)
+        entries.append(DirEntry(os.fsdecode(name), Stat(*fields), attrs))
+    return cursor, flags, entries
+
+
+def scandir(path):
+    """Yield a DirEntry (name, stat, attrs) for each entry of directory path."""
+    fd = os.open(path, os.O_RDONLY | os.O_DIRECTORY)
+    try:
+        page = bytearray(DIR_PAGE_SIZE)
+        cursor = 0
+        while True:
+            HEADER.pack_into(page, 0, cursor, 0, 0, 0, 0)
+            fcntl.ioctl(fd, IOC_DIR_PAGE, page, True)
+            cursor, flags, entries = decode_page(page)
+            for entry in entries:
+                yield entry
+            if flags & DIR_PAGE_END:
+                break
+    finally:
+        os.close(fd)
+
+
+def walk(path):
+    """Yield (directory, DirEntry) for every entry below path, depth first."""
+    for entry in scandir(path):
+        yield path, entry
+        if stat.S_ISDIR(entry.stat.st_mode):
+            for item in walk(os.path.join(path, entry.name)):
+                yield item
+
+
+def main():
+    args = sys.argv[1:]
+    recursive = '-r' in args
+    args = [i for i in args if i != '-r']
+    if len(args) != 1:
+        print('Usage: %s [-r] <directory>' % sys.argv[0], file=sys.stderr)
+        return 1
+    if recursive:
+        entries = walk(args[0])
+    else:
+        entries = ((args[0], entry) for entry in scandir(args[0]))
+    for directory, entry in entries:
+        print('%s\t%o\t%d\t%s' % (os.path.join(directory, entry.name), entry.stat.st_mode,
+                                  entry.stat.st_size,
+                                  ' '.join('%s=%r' % item for item in sorted(entry.attrs.items()))))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())